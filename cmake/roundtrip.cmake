@@ -0,0 +1,36 @@
+# ecm and unecm with --mmap on the synthetic images, against the stdio paths
+#
+# cmake -DECM=... -DUNECM=... -DECM_BENCH=... -DDIR=... -P roundtrip.cmake
+
+file(REMOVE_RECURSE "${DIR}")
+file(MAKE_DIRECTORY "${DIR}")
+execute_process(COMMAND "${ECM_BENCH}" --write "${DIR}" --size 2 RESULT_VARIABLE r OUTPUT_QUIET)
+if(r)
+    message(FATAL_ERROR "ecm_bench --write failed")
+endif()
+
+foreach(name mode1 mode2 cdda garbage misaligned)
+    set(image "${DIR}/${name}.bin")
+    execute_process(COMMAND "${ECM}" "${image}" "${DIR}/${name}.ecm" RESULT_VARIABLE r OUTPUT_QUIET ERROR_QUIET)
+    if(r)
+        message(FATAL_ERROR "${name}: ecm failed")
+    endif()
+    execute_process(COMMAND "${ECM}" --mmap "${image}" "${DIR}/${name}.mmap.ecm" RESULT_VARIABLE r OUTPUT_QUIET ERROR_QUIET)
+    if(r)
+        message(FATAL_ERROR "${name}: ecm --mmap failed")
+    endif()
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${DIR}/${name}.ecm" "${DIR}/${name}.mmap.ecm" RESULT_VARIABLE r)
+    if(r)
+        message(FATAL_ERROR "${name}: ecm --mmap wrote a different ECM file")
+    endif()
+    execute_process(COMMAND "${UNECM}" --mmap "${DIR}/${name}.mmap.ecm" "${DIR}/${name}.out" RESULT_VARIABLE r OUTPUT_QUIET ERROR_QUIET)
+    if(r)
+        message(FATAL_ERROR "${name}: unecm --mmap failed")
+    endif()
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${image}" "${DIR}/${name}.out" RESULT_VARIABLE r)
+    if(r)
+        message(FATAL_ERROR "${name}: unecm --mmap didn't give back the image")
+    endif()
+endforeach()
+
+file(REMOVE_RECURSE "${DIR}")
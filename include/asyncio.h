@@ -0,0 +1,52 @@
+#ifndef ECM_ASYNCIO_H
+#define ECM_ASYNCIO_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+** Background reading and writing for the ECM tools.
+**
+** A reader fills a ring of buffers from a stream on its own thread, ahead
+** of the caller; a writer drains a ring to a stream on its own thread,
+** behind the caller.  So while one block is being encoded or decoded, the
+** next one is being read and the one before is being written.  Streams
+** are only ever touched by the ring's thread, and never seeked, so pipes
+** work too.
+*/
+
+struct async_ring;
+
+/* nbufs buffers of bufsize bytes each; returns NULL if it can't be set up */
+struct async_ring *async_reader_create(FILE *in, size_t bufsize, unsigned nbufs);
+
+/*
+** The next block of input, which stays valid until the next call.  Every
+** block is full except the last.  Returns 0 at the end of the input or on
+** a read error.
+*/
+size_t async_read(struct async_ring *r, const unsigned char **data);
+
+struct async_ring *async_writer_create(FILE *out, size_t bufsize, unsigned nbufs);
+
+/*
+** Room for more output: returns the buffer being filled and puts the space
+** left in it in *space (never 0).  async_commit() then adds n bytes
+** written there; a buffer is handed to the thread once it is full.
+*/
+unsigned char *async_buffer(struct async_ring *w, size_t *space);
+void async_commit(struct async_ring *w, size_t n);
+
+/* Copy through async_buffer() and async_commit() */
+void async_write(struct async_ring *w, const void *buf, size_t n);
+
+/* Nonzero if reading or writing has failed */
+int async_error(struct async_ring *ring);
+
+/*
+** Stop the thread and free the ring.  A writer writes out everything first.
+** Returns nonzero if anything failed.
+*/
+int async_close(struct async_ring *ring);
+
+#endif //ECM_ASYNCIO_H
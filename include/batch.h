@@ -0,0 +1,31 @@
+#ifndef ECM_BATCH_H
+#define ECM_BATCH_H
+
+/*
+** Image lists for --batch in the ECM tools.
+**
+** A list is either a directory, in which case every regular file in it that
+** the tool wants is taken, or "-" for file names one per line on standard
+** input.  Jobs come back largest first: handed out in that order to a pool
+** of workers, the large images start early and the small ones fill in
+** around them, so the workers finish at about the same time.
+*/
+
+struct batch_job {
+    char *name;
+    unsigned long long size;
+    /* Filled in by the tool */
+    int failed;
+    unsigned long long in_bytes;
+    unsigned long long out_bytes;
+};
+
+/*
+** want() picks the directory entries to take, by file name; names read
+** from standard input are all taken.  Returns the number of jobs, put in
+** *jobs, or -1 (with a message) if the list can't be read.
+*/
+int batch_list(const char *list, int (*want)(const char *name), struct batch_job **jobs);
+void batch_free(struct batch_job *jobs, int count);
+
+#endif //ECM_BATCH_H
@@ -0,0 +1,133 @@
+#ifndef ECM_ECCEDC_H
+#define ECM_ECCEDC_H
+
+#include <stddef.h>
+
+/* Data types */
+#define ecc_uint8 unsigned char
+#define ecc_uint16 unsigned short
+#define ecc_uint32 unsigned
+
+/***************************************************************************/
+/*
+** EDC (CRC-32, polynomial 0x8001801B, reflected, no inversion)
+**
+** edc_init() must be called once before any other EDC routine.  It builds
+** the lookup tables and picks the fastest engine the CPU supports.
+*/
+
+enum edc_engine {
+    EDC_ENGINE_TABLE,   /* Byte at a time through a single 256-entry table */
+    EDC_ENGINE_SLICE16, /* Slicing-by-16, 16 bytes per step */
+    EDC_ENGINE_CLMUL    /* Carry-less multiply folding (PCLMULQDQ / PMULL) */
+};
+
+void edc_init(void);
+
+/* Force a particular engine; returns 0 if this CPU can't run it */
+int edc_select(enum edc_engine engine);
+enum edc_engine edc_selected(void);
+const char *edc_engine_name(enum edc_engine engine);
+
+/*
+** Continue an EDC computation over another block of data
+*/
+ecc_uint32 edc_partial_computeblock(
+        ecc_uint32 edc,
+        const ecc_uint8 *src,
+        size_t size
+);
+
+/*
+** EDC of two blocks joined together, given the EDC of each (both started
+** from 0) and the size of the second; lets blocks be checked in parallel
+*/
+ecc_uint32 edc_combine(ecc_uint32 edc1, ecc_uint32 edc2, unsigned long long size2);
+
+/*
+** Continue an EDC over n contiguous sectors whose own EDC is known to be
+** right, as after ecc/edc generation or a successful check.  Data followed
+** by its own EDC brings the EDC back to 0, so everything up to and
+** including each sector's EDC only shifts the running value along; just
+** the bytes after it are read.
+*/
+enum edc_sector {
+    EDC_SECTOR_MODE1,       /* 2352 bytes, EDC of 0-0x80F at 0x810 */
+    EDC_SECTOR_MODE2_FORM1, /* 2336-byte body, EDC of 0-0x807 at 0x808 */
+    EDC_SECTOR_MODE2_FORM2  /* 2336-byte body, EDC of 0-0x91B at 0x91C */
+};
+
+ecc_uint32 edc_sectors(ecc_uint32 edc, const ecc_uint8 *sectors, size_t n, enum edc_sector layout);
+
+/*
+** How the EDC of a Mode 1 sector changes when the 3 address bytes at sector
+** offset 0xC are xored with delta; the EDC is linear in the bytes it covers
+*/
+ecc_uint32 edc_mode1_address_delta(const ecc_uint8 *delta);
+
+/***************************************************************************/
+/*
+** ECC (CD-ROM Reed-Solomon product code, P and Q parity)
+**
+** Both routines take the 4 header bytes at sector offset 0xC separately
+** from the data starting at offset 0x10; pass NULL for the address to
+** treat it as all zeros, as Mode 2 does.  The data is never written to.
+**
+** ecc_compute_p() reads 2060 bytes of data and writes 172 bytes of P parity.
+** ecc_compute_q() reads 2232 bytes (the data followed by P parity) and
+** writes 104 bytes of Q parity.
+*/
+
+enum ecc_engine {
+    ECC_ENGINE_SCALAR, /* The original table-driven loop, kept as reference */
+    ECC_ENGINE_SSSE3,  /* 16 columns at a time, pshufb nibble tables */
+    ECC_ENGINE_AVX2,   /* 32 columns at a time */
+    ECC_ENGINE_NEON    /* 16 columns at a time, tbl nibble tables */
+};
+
+void ecc_init(void);
+
+/* Force a particular engine; returns 0 if this CPU can't run it */
+int ecc_select(enum ecc_engine engine);
+enum ecc_engine ecc_selected(void);
+const char *ecc_engine_name(enum ecc_engine engine);
+
+void ecc_compute_p(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *p);
+void ecc_compute_q(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *q);
+
+/*
+** Incremental ECC for Mode 1 sectors that differ only in their header and
+** EDC.  Xors delta[0-3] into the header at sector offset 0xC and delta[4-7]
+** into the EDC at 0x810, and patches the P and Q parity of the 2352-byte
+** sector to match, as if it had been generated again.
+*/
+void ecc_patch(ecc_uint8 *sector, const ecc_uint8 *delta);
+
+/*
+** Check that the P and Q parity stored after data (at sector offsets 0x81C
+** and 0x8C8) is correct; returns 1 if it is
+*/
+int ecc_verify(const ecc_uint8 *address, const ecc_uint8 *data);
+
+/*
+** The same for n sectors at once, laid out for the batch kernels: data
+** points at offset 0x10 of the first sector (the start of the body, for a
+** Mode 2 sector without its header) and each sector is stride bytes after
+** the one before.  With address set, the header is the 4 bytes before each
+** sector's data; otherwise it is taken as zeros.  The SSSE3 and AVX2
+** engines give each sector a byte lane and work on 16 or 32 at a time;
+** the others, and short runs, go a sector at a time.
+**
+** ecc_generate_batch() writes the P and Q parity of each sector after its
+** data; ecc_verify_batch() returns how many sectors from the first have
+** theirs right.
+*/
+void ecc_generate_batch(ecc_uint8 *data, size_t stride, size_t n, int address);
+size_t ecc_verify_batch(const ecc_uint8 *data, size_t stride, size_t n, int address);
+
+/***************************************************************************/
+
+/* Initialize both the ECC and EDC engines; later calls do nothing */
+void eccedc_init(void);
+
+#endif //ECM_ECCEDC_H
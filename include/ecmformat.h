@@ -0,0 +1,33 @@
+#ifndef ECM_ECMFORMAT_H
+#define ECM_ECMFORMAT_H
+
+/*
+** Layout constants shared by the encoder, the decoder and the tools
+** (see doc/format.txt)
+*/
+
+/*
+** Newest format version written after "ECM" in the magic; version 1 adds
+** record type 4, and version 2 types 5-7 (see doc/format.txt)
+*/
+#define ECM_FORMAT_VERSION 2
+
+/* Record types a format version allows are those below this */
+#define ECM_RECORD_TYPES(version) (((version) >= 2) ? 8 : (version) ? 5 : 4)
+
+/* Seek index trailer */
+#define ECM_INDEX_INTERVAL 0x100000
+#define ECM_INDEX_ENTRY 16
+#define ECM_INDEX_FOOTER 16
+
+/* Block checksum table, just before the index entries */
+#define ECM_CHECKSUM_ENTRY 4
+#define ECM_CHECKSUM_FOOTER 8
+
+/* Most ECM stream bytes in one block of the compressed container */
+#define ECM_PACK_BLOCK 0x800000
+
+/* Progress callbacks fire about this often, in bytes of input */
+#define ECM_PROGRESS_STEP 0x100000
+
+#endif //ECM_ECMFORMAT_H
@@ -0,0 +1,67 @@
+#ifndef ECM_IMAGE_H
+#define ECM_IMAGE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+** Random access to the image in an ECM file, for the ECM tools.
+**
+** The image is cut into blocks at the entries of the seek index, or, for a
+** file without one, at about ECM_INDEX_INTERVAL bytes apart along a walk
+** through the record headers done when the file is opened.  A read decodes
+** whole blocks, starting from the record each one begins in, and keeps them
+** in a cache that any number of images can share: least recently used
+** blocks are dropped once the cache is over its size.  With block checksums
+** every block is checked as it is decoded.  Nothing here is thread-safe.
+*/
+
+/***************************************************************************/
+/*
+** Seek index trailer and block checksums (see doc/format.txt).  Block i of
+** the image runs from image[i] to image[i + 1], and image[count] is the
+** size of the image.
+*/
+
+struct trailer {
+    unsigned count;
+    unsigned long long *image;
+    unsigned long long *ecm;
+    unsigned *edc;  /* NULL if there are no block checksums */
+};
+
+/* Returns 0 if the file has no (valid) index, leaving t empty */
+int trailer_load(FILE *in, struct trailer *t);
+void trailer_free(struct trailer *t);
+
+/***************************************************************************/
+
+struct image_cache;
+
+/* Blocks are kept until there are more than size bytes of them */
+struct image_cache *image_cache_create(size_t size);
+void image_cache_destroy(struct image_cache *cache);
+
+struct image;
+
+/*
+** Opens the ECM file read from in, which stays the caller's and must not be
+** used elsewhere until image_close().  Returns NULL with the ECM_ERROR_*
+** status in *status if it is not a plain (uncompressed) ECM file or the walk
+** through it fails.
+*/
+struct image *image_open(FILE *in, struct image_cache *cache, int *status);
+void image_close(struct image *img);
+
+unsigned long long image_size(const struct image *img);
+/* Whether the blocks came from a seek index, not a walk */
+int image_indexed(const struct image *img);
+
+/*
+** Read len bytes of the image from offset, fewer at the end of it.  Returns
+** the number read, or an ECM_ERROR_* status (ECM_ERROR_EDC for a block that
+** fails its checksum).
+*/
+long long image_read(struct image *img, void *buf, size_t len, unsigned long long offset);
+
+#endif //ECM_IMAGE_H
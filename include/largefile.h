@@ -0,0 +1,20 @@
+#ifndef ECM_LARGEFILE_H
+#define ECM_LARGEFILE_H
+
+/*
+** Seeking with 64-bit offsets, for images over 2 GB.  Offsets are long
+** long; on POSIX systems the build also asks for a 64-bit off_t.
+*/
+
+#include <stdio.h>
+
+#if defined(_WIN32)
+#define file_seek(f, offset, whence) _fseeki64((f), (long long) (offset), (whence))
+#define file_tell(f) ((long long) _ftelli64(f))
+#else
+#include <sys/types.h>
+#define file_seek(f, offset, whence) fseeko((f), (off_t) (offset), (whence))
+#define file_tell(f) ((long long) ftello(f))
+#endif
+
+#endif //ECM_LARGEFILE_H
@@ -0,0 +1,38 @@
+#ifndef ECM_MAPFILE_H
+#define ECM_MAPFILE_H
+
+#include <stddef.h>
+
+/*
+** Whole-file memory mappings (mmap on POSIX, MapViewOfFile on Windows)
+**
+** All functions return 0 on success and -1 on failure, with errno set
+** where the platform provides one.  A zero-length file maps to data == NULL
+** and size == 0.
+*/
+
+struct mapfile {
+    unsigned char *data;
+    size_t size;
+    int writable;
+#if defined(_WIN32)
+    void *file;
+    void *mapping;
+#else
+    int fd;
+#endif
+};
+
+/* Map an existing file read-only */
+int mapfile_open_read(struct mapfile *m, const char *path);
+
+/* Create (or truncate) a file of the given size and map it read-write */
+int mapfile_create(struct mapfile *m, const char *path, size_t size);
+
+/*
+** Unmap and close; a writable mapping is flushed and the file cut down to
+** finalsize bytes (which must not exceed the mapped size)
+*/
+int mapfile_close(struct mapfile *m, size_t finalsize);
+
+#endif //ECM_MAPFILE_H
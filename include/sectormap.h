@@ -0,0 +1,60 @@
+#ifndef ECM_SECTORMAP_H
+#define ECM_SECTORMAP_H
+
+#include <stdio.h>
+#include "unecm.h"
+
+/*
+** Sector maps for the ECM tools.
+**
+** A map says what is where in an image, in runs: literal bytes, Mode 1
+** sectors, Mode 2 sectors without their headers (2336 bytes, either form)
+** and raw Mode 2 sectors (2352 bytes, the header kept as literal bytes by
+** the ECM file).  It is built from the records as they are written or read,
+** so it is only as good as what the encoder found.  Saved as text, a run a
+** line: the image offset, the kind (LITERAL, MODE1, MODE2/2336 or
+** MODE2/2352) and the count, in bytes for LITERAL and sectors otherwise.
+** Lines starting with # are comments.
+*/
+
+enum sector_kind {SECTOR_LITERAL, SECTOR_MODE1, SECTOR_MODE2, SECTOR_MODE2_RAW};
+
+struct sector_run {
+    unsigned long long offset;
+    unsigned long long count;
+    enum sector_kind kind;
+};
+
+struct sector_map {
+    struct sector_run *runs;
+    unsigned count;
+    unsigned capacity;
+};
+
+/* The record callback of the encoder and decoder options, with the map as opaque */
+void sector_map_record(void *opaque, unsigned type, unsigned long long offset, unsigned count);
+void sector_map_free(struct sector_map *m);
+
+/* The image size the map covers */
+unsigned long long sector_map_size(const struct sector_map *m);
+
+/* Returns 0 if it can't be written */
+int sector_map_save(const struct sector_map *m, FILE *f);
+/* Returns 0 (with a message) if name can't be read or isn't a map */
+int sector_map_load(struct sector_map *m, const char *name);
+
+/*
+** The literal runs, as extents for the encoder options.  Returns the number
+** of them, put in *extents to be freed by the caller.
+*/
+unsigned sector_map_literal(const struct sector_map *m, struct ecm_extent **extents);
+
+/*
+** Write a CUE sheet for the image file, with a track for each stretch of
+** literal bytes (as audio), Mode 1 or Mode 2 sectors.  Stretches shorter
+** than a track can be (4 seconds) go to the track before them.  Returns 0
+** if it can't be written.
+*/
+int sector_map_cue(const struct sector_map *m, FILE *f, const char *imagename);
+
+#endif //ECM_SECTORMAP_H
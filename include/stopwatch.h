@@ -0,0 +1,10 @@
+#ifndef ECM_STOPWATCH_H
+#define ECM_STOPWATCH_H
+
+/*
+** Monotonic wall-clock time in seconds, from an arbitrary starting point;
+** only differences between two readings mean anything
+*/
+double stopwatch_now(void);
+
+#endif //ECM_STOPWATCH_H
@@ -0,0 +1,26 @@
+#ifndef ECM_THREADPOOL_H
+#define ECM_THREADPOOL_H
+
+/*
+** Minimal fork/join worker pool.
+**
+** threadpool_run() calls func(arg, index) once for every index in
+** [0, count), spread over the pool's workers and the calling thread, and
+** returns only after every call has finished.
+*/
+
+typedef void (*threadpool_func)(void *arg, unsigned index);
+
+struct threadpool;
+
+struct threadpool *threadpool_create(unsigned threads);
+void threadpool_destroy(struct threadpool *pool);
+unsigned threadpool_size(const struct threadpool *pool);
+void threadpool_run(
+        struct threadpool *pool,
+        threadpool_func func,
+        void *arg,
+        unsigned count
+);
+
+#endif //ECM_THREADPOOL_H
@@ -1,8 +1,315 @@
 #ifndef ECM_UNECM_H
 #define ECM_UNECM_H
 
-#if defined(WIN32) || defined(WIN64)
-#define strcasecmp _stricmp
-#endif
+#include <stddef.h>
+
+/***************************************************************************/
+/*
+** libecm - ECM encoding and decoding on caller-supplied buffers
+**
+** Each direction has a context object.  Input goes in with push(), which
+** may take less than it is offered, and output comes back out with pull():
+**
+**     while (more input) {
+**         used = 0;
+**         while (used < len) {
+**             used += ecm_encoder_push(enc, buf + used, len - used);
+**             while ((n = ecm_encoder_pull(enc, out, sizeof(out)))) consume(out, n);
+**         }
+**     }
+**     ecm_encoder_finish(enc);
+**     while ((n = ecm_encoder_pull(enc, out, sizeof(out)))) consume(out, n);
+**
+** after which the status is ECM_DONE, or an error.  The decoder works the
+** same way.  push() stops accepting input until enough output has been
+** pulled, so memory use stays bounded.
+**
+** Contexts are independent and may be used on different threads, but one
+** context must not be used by two threads at once.  The first context should
+** be created before any other threads start using the library, since that
+** builds the shared ECC/EDC tables.
+*/
+
+enum ecm_status {
+    ECM_OK = 0,                 /* Still running */
+    ECM_DONE = 1,               /* Finished, and all output has been pulled */
+    ECM_ERROR_MEMORY = -1,      /* Out of memory */
+    ECM_ERROR_HEADER = -2,      /* Not an ECM file */
+    ECM_ERROR_CORRUPT = -3,     /* Invalid record */
+    ECM_ERROR_TRUNCATED = -4,   /* Input ended in the middle of the data */
+    ECM_ERROR_EDC = -5,         /* Decoded data does not match the file EDC */
+    ECM_ERROR_SPACE = -6,       /* Output buffer too small */
+    ECM_ERROR_STATE = -7,       /* Call not allowed at this point */
+    ECM_ERROR_UNSUPPORTED = -8, /* Not available in this build */
+    ECM_ERROR_IO = -9           /* Temporary file could not be used */
+};
+
+const char *ecm_status_string(int status);
+
+/***************************************************************************/
+/*
+** Encoder
+*/
+
+struct ecm_encoder_stats {
+    unsigned long long count[4];      /* Literal bytes, then sectors of types 1-3 */
+    unsigned long long in_bytes;      /* Input accepted */
+    unsigned long long analyzed_bytes;/* Input classified */
+    unsigned long long encoded_bytes; /* Input written out as records */
+    unsigned long long out_bytes;     /* ECM data produced */
+    /*
+    ** Time spent inside the encoder calls, not counting progress callbacks:
+    ** finding the sectors (their EDC and ECC checks included), and writing
+    ** the records (the whole-file EDC included)
+    */
+    double analyze_seconds;
+    double encode_seconds;
+};
+
+/* A stretch of the input, in bytes */
+struct ecm_extent {
+    unsigned long long offset;
+    unsigned long long length;
+};
+
+struct ecm_encoder_options {
+    unsigned threads;  /* Threads for sector analysis; 0 or 1 for none */
+    int index;         /* Append a seek index trailer */
+    /*
+    ** Stretches of the input known to hold no sectors, such as CD-DA audio
+    ** tracks, in order and not overlapping.  They are stored as literal
+    ** bytes without being searched, and no sector is found overlapping
+    ** them.  The encoder keeps its own copy.
+    */
+    const struct ecm_extent *literal;
+    unsigned literal_count;
+    /*
+    ** Format version to write: 0 is readable by every decoder, 1 also stores
+    ** runs of Mode 1 sectors with consecutive addresses without them, and 2
+    ** also stores runs of empty sectors without their data
+    */
+    unsigned version;
+    /* Called every so often with the progress so far, if not NULL */
+    void (*progress)(void *opaque, const struct ecm_encoder_stats *stats);
+    void *opaque;
+    /*
+    ** Runs of fewer than this many sectors next to literal bytes are stored
+    ** as literal bytes too, up to ECM_MERGE_MAX; 0 to store every sector
+    ** found.  Fewer, longer records make a slightly larger file that is
+    ** quicker to decode.
+    */
+    unsigned merge;
+    /*
+    ** Bytes of input kept while streaming, allocated once per encoder; 0
+    ** for 1 MiB, otherwise at least ECM_WINDOW_MIN.  The output is the same
+    ** whatever the size: a record that would fill more than half of it is
+    ** encoded into a tmpfile() until it ends, and ECM_ERROR_IO means that
+    ** failed.  One-shot encoding reads the input in place.
+    **
+    ** It is also how much input the sector search takes in one go (up to
+    ** 1 GiB), one-shot too.  Streaming, an encoder needs about twice the
+    ** window plus 1.5 MiB: the window, a copy of its first 256 KiB, and
+    ** the output queue, which ecm_encoder_push() lets grow to 1 MiB plus
+    ** what one run of the search writes.  With threads above 1 the search
+    ** needs another 14 bytes per byte it takes in one go, 14 MiB for the
+    ** default window.
+    */
+    size_t window;
+    /*
+    ** Called for each record as it is written, if not NULL, with its type
+    ** (0 to 7, see doc/format.txt), the input offset it starts at and its
+    ** count: bytes for type 0, sectors otherwise.  In order, the records
+    ** are a map of where the sectors are in the image.
+    */
+    void (*record)(void *opaque, unsigned type, unsigned long long offset, unsigned count);
+};
+
+#define ECM_MERGE_MAX 64
+#define ECM_WINDOW_MIN 0x80000
+
+struct ecm_encoder;
+
+/* Options may be NULL for the defaults (all zero); returns NULL if they are invalid */
+struct ecm_encoder *ecm_encoder_create(const struct ecm_encoder_options *options);
+void ecm_encoder_destroy(struct ecm_encoder *enc);
+
+size_t ecm_encoder_push(struct ecm_encoder *enc, const void *buf, size_t len);
+/* No more input will be pushed */
+void ecm_encoder_finish(struct ecm_encoder *enc);
+size_t ecm_encoder_pull(struct ecm_encoder *enc, void *buf, size_t len);
+
+int ecm_encoder_status(const struct ecm_encoder *enc);
+void ecm_encoder_stats(const struct ecm_encoder *enc, struct ecm_encoder_stats *stats);
+
+/*
+** One-shot encoding of a whole image in memory, read in place.  out must
+** hold at least ecm_encode_bound(len, index) bytes to be sure of success;
+** the encoded size goes in *outlen.  The context must be fresh.  Returns
+** ECM_DONE or an error.
+*/
+size_t ecm_encode_bound(size_t len, int index);
+int ecm_encoder_encode_buffer(
+        struct ecm_encoder *enc,
+        const void *in,
+        size_t len,
+        void *out,
+        size_t outsize,
+        size_t *outlen
+);
+
+/***************************************************************************/
+/*
+** Decoder
+*/
+
+struct ecm_decoder_stats {
+    unsigned long long in_bytes;   /* ECM data consumed */
+    unsigned long long out_bytes;  /* Image data produced */
+    unsigned edc;                  /* EDC of the image data so far */
+    unsigned stored_edc;           /* EDC stored in the file, once reached */
+    /* Units in the records read so far, by record type; bytes for type 0 */
+    unsigned long long count[8];
+    /* Time spent inside the decoder calls, not counting progress callbacks */
+    double decode_seconds;
+};
+
+struct ecm_decoder_options {
+    unsigned threads;  /* Threads for sector rebuilding; 0 or 1 for none */
+    void (*progress)(void *opaque, const struct ecm_decoder_stats *stats);
+    void *opaque;
+    /*
+    ** EDC of the image before the first record, for picking up decoding
+    ** partway through a file: push the magic identifier, then the records
+    ** from that point on.  The file EDC is then checked for the whole image.
+    */
+    unsigned edc;
+    /*
+    ** Called for each record as it is read, if not NULL, as for the
+    ** encoder; the offset is in the image produced.  Decoding a file gives
+    ** it the same map of the image that encoding it did.
+    */
+    void (*record)(void *opaque, unsigned type, unsigned long long offset, unsigned count);
+};
+
+struct ecm_decoder;
+
+struct ecm_decoder *ecm_decoder_create(const struct ecm_decoder_options *options);
+void ecm_decoder_destroy(struct ecm_decoder *dec);
+
+/* Anything after the file EDC (such as a seek index) is accepted and ignored */
+size_t ecm_decoder_push(struct ecm_decoder *dec, const void *buf, size_t len);
+void ecm_decoder_finish(struct ecm_decoder *dec);
+size_t ecm_decoder_pull(struct ecm_decoder *dec, void *buf, size_t len);
+
+/*
+** A push and a pull in one, without copying the input into the decoder:
+** sectors are rebuilt from in straight into out.  Returns the bytes put in
+** out and sets *used to the input taken, which may be less than inlen once
+** out is full; the rest must be offered again.  Only a record header or
+** unit cut off by the end of in is copied, to wait for the next call.  The
+** two ways of feeding the decoder can be mixed; after the last input, call
+** ecm_decoder_finish() and pull the rest.
+*/
+size_t ecm_decoder_decode(
+        struct ecm_decoder *dec,
+        const void *in,
+        size_t inlen,
+        size_t *used,
+        void *out,
+        size_t outlen
+);
+
+int ecm_decoder_status(const struct ecm_decoder *dec);
+void ecm_decoder_stats(const struct ecm_decoder *dec, struct ecm_decoder_stats *stats);
+
+/*
+** One-shot decoding of a whole ECM file in memory.  ecm_decoded_size()
+** only walks the record headers to find the decoded size (returns ECM_OK
+** or an error); ecm_decoder_decode_buffer() then decodes straight into out.
+** The context must be fresh.  Returns ECM_DONE or an error.
+*/
+int ecm_decoded_size(const void *in, size_t len, unsigned long long *size);
+int ecm_decoder_decode_buffer(
+        struct ecm_decoder *dec,
+        const void *in,
+        size_t len,
+        void *out,
+        size_t outsize,
+        size_t *outlen
+);
+
+/***************************************************************************/
+/*
+** Compressed container (see doc/format.txt).  The packer takes an ECM
+** stream, such as the encoder's output, and splits it into separately
+** compressed streams of record headers, addresses, subheaders and sector
+** data.  The unpacker turns that back into the same ECM stream, ready for
+** the decoder.  Both work like the encoder and decoder: push, finish, pull
+** until the status is ECM_DONE.  Compression uses LZMA, and builds without
+** it report ECM_ERROR_UNSUPPORTED.
+*/
+
+int ecm_pack_supported(void);
+
+struct ecm_pack_stats {
+    unsigned long long in_bytes;   /* Bytes pushed */
+    unsigned long long out_bytes;  /* Bytes pulled */
+};
+
+struct ecm_pack_options {
+    unsigned threads;  /* Blocks compressed at once; 0 or 1 for one */
+    unsigned level;    /* LZMA preset 1-9; 0 for the default (6) */
+};
+
+struct ecm_packer;
+
+struct ecm_packer *ecm_packer_create(const struct ecm_pack_options *options);
+void ecm_packer_destroy(struct ecm_packer *pk);
+size_t ecm_packer_push(struct ecm_packer *pk, const void *buf, size_t len);
+void ecm_packer_finish(struct ecm_packer *pk);
+size_t ecm_packer_pull(struct ecm_packer *pk, void *buf, size_t len);
+int ecm_packer_status(const struct ecm_packer *pk);
+void ecm_packer_stats(const struct ecm_packer *pk, struct ecm_pack_stats *stats);
+
+struct ecm_unpacker;
+
+struct ecm_unpacker *ecm_unpacker_create(const struct ecm_pack_options *options);
+void ecm_unpacker_destroy(struct ecm_unpacker *up);
+/* Anything after the end of the container is accepted and ignored */
+size_t ecm_unpacker_push(struct ecm_unpacker *up, const void *buf, size_t len);
+void ecm_unpacker_finish(struct ecm_unpacker *up);
+size_t ecm_unpacker_pull(struct ecm_unpacker *up, void *buf, size_t len);
+int ecm_unpacker_status(const struct ecm_unpacker *up);
+void ecm_unpacker_stats(const struct ecm_unpacker *up, struct ecm_pack_stats *stats);
+
+/***************************************************************************/
+/*
+** Record-level helpers, for readers that find their own way to a record
+** (for example through the seek index)
+*/
+
+/*
+** Bytes a record type stores ahead of its units, bytes stored per unit, and
+** bytes each unit decodes to.  Types 4 and 5 start with the address of the
+** first sector, and types 6 and 7 with the flags shared by every sector.
+*/
+unsigned ecm_prefix_size(unsigned type);
+unsigned ecm_stored_size(unsigned type);
+unsigned ecm_decoded_unit(unsigned type);
+
+/*
+** Rebuild one sector from its stored bytes: the record prefix, if the type
+** has one, then the unit.  Types 1, 4 and 5 write 2352 bytes; types 2, 3, 6
+** and 7 write the 2336 bytes from sector offset 0x10.
+*/
+void ecm_sector_rebuild(unsigned type, const unsigned char *stored, unsigned char *sector);
+
+/*
+** Step a BCD minutes:seconds:frames address on by one frame, or by n, as
+** types 4 and 5 do from one sector to the next.  A field that isn't valid
+** BCD is left alone, and so are the fields above it.
+*/
+void ecm_address_next(unsigned char *address);
+void ecm_address_advance(unsigned char *address, unsigned long long n);
 
 #endif //ECM_UNECM_H
@@ -0,0 +1,278 @@
+/***************************************************************************/
+/*
+** Background reading and writing for the ECM tools
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "asyncio.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+typedef HANDLE aio_thread;
+typedef CRITICAL_SECTION aio_mutex;
+typedef CONDITION_VARIABLE aio_cond;
+#define aio_mutex_init(m) InitializeCriticalSection(m)
+#define aio_mutex_destroy(m) DeleteCriticalSection(m)
+#define aio_lock(m) EnterCriticalSection(m)
+#define aio_unlock(m) LeaveCriticalSection(m)
+#define aio_cond_init(c) InitializeConditionVariable(c)
+#define aio_cond_destroy(c) ((void) 0)
+#define aio_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define aio_broadcast(c) WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+typedef pthread_t aio_thread;
+typedef pthread_mutex_t aio_mutex;
+typedef pthread_cond_t aio_cond;
+#define aio_mutex_init(m) pthread_mutex_init(m, NULL)
+#define aio_mutex_destroy(m) pthread_mutex_destroy(m)
+#define aio_lock(m) pthread_mutex_lock(m)
+#define aio_unlock(m) pthread_mutex_unlock(m)
+#define aio_cond_init(c) pthread_cond_init(c, NULL)
+#define aio_cond_destroy(c) pthread_cond_destroy(c)
+#define aio_wait(c, m) pthread_cond_wait(c, m)
+#define aio_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/***************************************************************************/
+
+/*
+** Buffers head, head + 1... (mod nbufs) hold data, filled of them in all.
+** For a reader the thread fills them and the caller empties them, holding
+** on to the one at head until its next call; for a writer it is the other
+** way round, and the caller fills the buffer after the last full one.
+*/
+struct async_ring {
+    FILE *f;
+    int writing;
+    unsigned char *mem;
+    size_t bufsize;
+    unsigned nbufs;
+    size_t *len;
+    aio_thread thread;
+    aio_mutex lock;
+    aio_cond changed;
+    /* Guarded by lock */
+    unsigned head;
+    unsigned filled;
+    int done;    /* Reader: input ended.  Writer: no more output coming. */
+    int stop;    /* Reader: the caller is closing early */
+    int error;
+    /* The caller's side, not shared */
+    int held;    /* Reader: the caller has the buffer at head */
+    int acquired;/* Writer: the caller has buffer cur, with fill bytes in it */
+    unsigned cur;
+    size_t fill;
+};
+
+static void async_reader_run(struct async_ring *r) {
+    aio_lock(&r->lock);
+    for (;;) {
+        unsigned slot;
+        size_t n;
+        int err;
+        while (!r->stop && (r->filled == r->nbufs)) aio_wait(&r->changed, &r->lock);
+        if (r->stop) break;
+        slot = (r->head + r->filled) % r->nbufs;
+        aio_unlock(&r->lock);
+        n = fread(r->mem + (size_t) slot * r->bufsize, 1, r->bufsize, r->f);
+        err = ferror(r->f);
+        aio_lock(&r->lock);
+        r->len[slot] = n;
+        r->filled++;
+        if (err) r->error = 1;
+        if (n < r->bufsize) r->done = 1;
+        aio_broadcast(&r->changed);
+        if (r->done) break;
+    }
+    aio_unlock(&r->lock);
+}
+
+static void async_writer_run(struct async_ring *w) {
+    aio_lock(&w->lock);
+    for (;;) {
+        unsigned slot;
+        int err = 0;
+        while (!w->filled && !w->done) aio_wait(&w->changed, &w->lock);
+        if (!w->filled) {
+            /* So that errors stdio was still holding on to show up too */
+            if (!w->error && fflush(w->f)) w->error = 1;
+            break;
+        }
+        slot = w->head;
+        aio_unlock(&w->lock);
+        /* After an error, keep taking buffers so the caller never waits forever */
+        if (!w->error && (fwrite(w->mem + (size_t) slot * w->bufsize, 1, w->len[slot], w->f) != w->len[slot])) {
+            err = 1;
+        }
+        aio_lock(&w->lock);
+        if (err) w->error = 1;
+        w->head = (w->head + 1) % w->nbufs;
+        w->filled--;
+        aio_broadcast(&w->changed);
+    }
+    aio_unlock(&w->lock);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI async_thread(LPVOID param) {
+#else
+static void *async_thread(void *param) {
+#endif
+    struct async_ring *ring = param;
+    if (ring->writing) {
+        async_writer_run(ring);
+    } else {
+        async_reader_run(ring);
+    }
+    return 0;
+}
+
+static struct async_ring *async_create(FILE *f, int writing, size_t bufsize, unsigned nbufs) {
+    struct async_ring *ring;
+    if (!bufsize || (nbufs < 2)) return NULL;
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+    ring->f = f;
+    ring->writing = writing;
+    ring->bufsize = bufsize;
+    ring->nbufs = nbufs;
+    ring->mem = malloc(bufsize * nbufs);
+    ring->len = calloc(nbufs, sizeof(*ring->len));
+    if (!ring->mem || !ring->len) {
+        free(ring->mem);
+        free(ring->len);
+        free(ring);
+        return NULL;
+    }
+    aio_mutex_init(&ring->lock);
+    aio_cond_init(&ring->changed);
+#if defined(_WIN32)
+    ring->thread = CreateThread(NULL, 0, async_thread, ring, 0, NULL);
+    if (!ring->thread) {
+#else
+    if (pthread_create(&ring->thread, NULL, async_thread, ring)) {
+#endif
+        aio_cond_destroy(&ring->changed);
+        aio_mutex_destroy(&ring->lock);
+        free(ring->mem);
+        free(ring->len);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+struct async_ring *async_reader_create(FILE *in, size_t bufsize, unsigned nbufs) {
+    return async_create(in, 0, bufsize, nbufs);
+}
+
+struct async_ring *async_writer_create(FILE *out, size_t bufsize, unsigned nbufs) {
+    return async_create(out, 1, bufsize, nbufs);
+}
+
+/***************************************************************************/
+
+size_t async_read(struct async_ring *r, const unsigned char **data) {
+    size_t n;
+    aio_lock(&r->lock);
+    if (r->held) {
+        r->head = (r->head + 1) % r->nbufs;
+        r->filled--;
+        r->held = 0;
+        aio_broadcast(&r->changed);
+    }
+    while (!r->filled && !r->done) aio_wait(&r->changed, &r->lock);
+    if (!r->filled) {
+        aio_unlock(&r->lock);
+        return 0;
+    }
+    r->held = 1;
+    *data = r->mem + (size_t) r->head * r->bufsize;
+    n = r->len[r->head];
+    aio_unlock(&r->lock);
+    return n;
+}
+
+unsigned char *async_buffer(struct async_ring *w, size_t *space) {
+    if (!w->acquired) {
+        aio_lock(&w->lock);
+        while (w->filled == w->nbufs) aio_wait(&w->changed, &w->lock);
+        w->cur = (w->head + w->filled) % w->nbufs;
+        aio_unlock(&w->lock);
+        w->acquired = 1;
+        w->fill = 0;
+    }
+    *space = w->bufsize - w->fill;
+    return w->mem + (size_t) w->cur * w->bufsize + w->fill;
+}
+
+/* Hand the buffer being filled to the thread */
+static void async_hand_off(struct async_ring *w) {
+    aio_lock(&w->lock);
+    w->len[w->cur] = w->fill;
+    w->filled++;
+    aio_broadcast(&w->changed);
+    aio_unlock(&w->lock);
+    w->acquired = 0;
+}
+
+void async_commit(struct async_ring *w, size_t n) {
+    w->fill += n;
+    if (w->fill == w->bufsize) async_hand_off(w);
+}
+
+void async_write(struct async_ring *w, const void *buf, size_t n) {
+    const unsigned char *p = buf;
+    while (n) {
+        size_t space;
+        unsigned char *dst = async_buffer(w, &space);
+        if (space > n) space = n;
+        memcpy(dst, p, space);
+        async_commit(w, space);
+        p += space;
+        n -= space;
+    }
+}
+
+int async_error(struct async_ring *ring) {
+    int error;
+    aio_lock(&ring->lock);
+    error = ring->error;
+    aio_unlock(&ring->lock);
+    return error;
+}
+
+int async_close(struct async_ring *ring) {
+    int error;
+    if (!ring) return 0;
+    if (ring->writing && ring->acquired && ring->fill) async_hand_off(ring);
+    aio_lock(&ring->lock);
+    if (ring->writing) {
+        ring->done = 1;
+    } else {
+        ring->stop = 1;
+    }
+    aio_broadcast(&ring->changed);
+    aio_unlock(&ring->lock);
+#if defined(_WIN32)
+    WaitForSingleObject(ring->thread, INFINITE);
+    CloseHandle(ring->thread);
+#else
+    pthread_join(ring->thread, NULL);
+#endif
+    error = ring->error;
+    aio_cond_destroy(&ring->changed);
+    aio_mutex_destroy(&ring->lock);
+    free(ring->mem);
+    free(ring->len);
+    free(ring);
+    return error;
+}
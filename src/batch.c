@@ -0,0 +1,155 @@
+/***************************************************************************/
+/*
+** Image lists for --batch in the ECM tools
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "largefile.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+/***************************************************************************/
+
+struct joblist {
+    struct batch_job *jobs;
+    int count;
+    int capacity;
+};
+
+/* Add a job for the file name, copied; returns 0 (with a message) if it can't be opened */
+static int joblist_add(struct joblist *l, const char *name) {
+    struct batch_job *job;
+    long long size;
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        perror(name);
+        return 0;
+    }
+    size = (!file_seek(f, 0, SEEK_END)) ? file_tell(f) : 0;
+    fclose(f);
+    if (l->count == l->capacity) {
+        int capacity = l->capacity ? l->capacity * 2 : 64;
+        struct batch_job *p = realloc(l->jobs, capacity * sizeof(*p));
+        if (!p) abort();
+        l->jobs = p;
+        l->capacity = capacity;
+    }
+    job = l->jobs + l->count++;
+    memset(job, 0, sizeof(*job));
+    job->name = malloc(strlen(name) + 1);
+    if (!job->name) abort();
+    strcpy(job->name, name);
+    job->size = (size > 0) ? (unsigned long long) size : 0;
+    return 1;
+}
+
+/* Largest first, then by name so the order doesn't depend on the directory */
+static int job_order(const void *a, const void *b) {
+    const struct batch_job *x = a;
+    const struct batch_job *y = b;
+    if (x->size != y->size) return (x->size < y->size) ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/* Names one per line; blank lines are skipped */
+static int list_stdin(struct joblist *l) {
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin)) {
+        size_t n = strlen(line);
+        if (n && (line[n - 1] != '\n') && !feof(stdin)) {
+            fprintf(stderr, "file name too long in the list\n");
+            return 0;
+        }
+        while (n && ((line[n - 1] == '\n') || (line[n - 1] == '\r'))) line[--n] = 0;
+        if (n && !joblist_add(l, line)) return 0;
+    }
+    return 1;
+}
+
+static char *path_join(const char *dir, const char *name) {
+    size_t n = strlen(dir);
+    char *path = malloc(n + strlen(name) + 2);
+    if (!path) abort();
+    strcpy(path, dir);
+    if (n && (dir[n - 1] != '/') && (dir[n - 1] != '\\')) strcat(path, "/");
+    strcat(path, name);
+    return path;
+}
+
+#if defined(_WIN32)
+static int list_dir(struct joblist *l, const char *dir, int (*want)(const char *name)) {
+    WIN32_FIND_DATAA found;
+    char *pattern = path_join(dir, "*");
+    HANDLE h = FindFirstFileA(pattern, &found);
+    int ok = 1;
+    free(pattern);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "%s: can't read the directory\n", dir);
+        return 0;
+    }
+    do {
+        char *path;
+        if ((found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || !want(found.cFileName)) continue;
+        path = path_join(dir, found.cFileName);
+        ok = joblist_add(l, path);
+        free(path);
+    } while (ok && FindNextFileA(h, &found));
+    FindClose(h);
+    return ok;
+}
+#else
+static int list_dir(struct joblist *l, const char *dir, int (*want)(const char *name)) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    int ok = 1;
+    if (!d) {
+        perror(dir);
+        return 0;
+    }
+    while (ok && (e = readdir(d))) {
+        struct stat st;
+        char *path;
+        if (!want(e->d_name)) continue;
+        path = path_join(dir, e->d_name);
+        if (!stat(path, &st) && S_ISREG(st.st_mode)) ok = joblist_add(l, path);
+        free(path);
+    }
+    closedir(d);
+    return ok;
+}
+#endif
+
+/***************************************************************************/
+
+int batch_list(const char *list, int (*want)(const char *name), struct batch_job **jobs) {
+    struct joblist l = {NULL, 0, 0};
+    int ok = !strcmp(list, "-") ? list_stdin(&l) : list_dir(&l, list, want);
+    if (!ok) {
+        batch_free(l.jobs, l.count);
+        *jobs = NULL;
+        return -1;
+    }
+    if (l.count) qsort(l.jobs, l.count, sizeof(*l.jobs), job_order);
+    *jobs = l.jobs;
+    return l.count;
+}
+
+void batch_free(struct batch_job *jobs, int count) {
+    int i;
+    for (i = 0; i < count; i++) free(jobs[i].name);
+    free(jobs);
+}
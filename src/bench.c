@@ -0,0 +1,1070 @@
+/***************************************************************************/
+/*
+** ECM_BENCH - Throughput of the ECM kernels and of libecm as a whole, on
+** synthetic CD images
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+/*
+** Every rate is given per 2352-byte sector, so MB/s is sectors/s times
+** 2352, whatever part of the sector a kernel actually reads.  Kernels run
+** on every engine this CPU supports.  Full encodes and decodes run on each
+** synthetic image at 1, 2, 4... threads up to --threads, and every decode
+** is checked against the original image.  --difftest runs differential
+** checks instead (see below).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eccedc.h"
+#include "ecmformat.h"
+#include "stopwatch.h"
+#include "unecm.h"
+
+/***************************************************************************/
+
+/* Seconds each measurement runs for, at least */
+static double bench_time = 0.5;
+
+static void report(const char *name, const char *variant, double sectors, double seconds) {
+    double rate = sectors / seconds;
+    printf("%-10s %-22s %10.1f MB/s %12.0f sectors/s\n", name, variant, rate * 2352.0 / 1e6, rate);
+    fflush(stdout);
+}
+
+/***************************************************************************/
+/*
+** Synthetic images
+*/
+
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+static unsigned rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned) (rng_state >> 32);
+}
+
+static void fill_random(unsigned char *p, size_t n) {
+    while (n--) *p++ = (unsigned char) rng();
+}
+
+static unsigned char bcd(unsigned v) {
+    return (unsigned char) (((v / 10) << 4) | (v % 10));
+}
+
+/* Sync, address and mode of a raw sector at the given LBA */
+static void sector_header(unsigned char *sector, unsigned lba, unsigned char mode) {
+    unsigned frame = lba + 150;
+    sector[0] = 0;
+    memset(sector + 1, 0xFF, 10);
+    sector[11] = 0;
+    sector[12] = bcd(frame / 4500);
+    sector[13] = bcd(frame / 75 % 60);
+    sector[14] = bcd(frame % 75);
+    sector[15] = mode;
+}
+
+/* One raw sector of type 1-3 at the given LBA, with random (or zero) data */
+static void make_sector(unsigned char *sector, unsigned type, unsigned lba, int empty) {
+    unsigned char stored[4 + 2324];
+    unsigned size = ecm_stored_size(type);
+    memset(stored, 0, sizeof(stored));
+    if (type == 1) {
+        sector_header(sector, lba, 1);
+        memcpy(stored, sector + 12, 3);
+        if (!empty) fill_random(stored + 3, size - 3);
+        ecm_sector_rebuild(1, stored, sector);
+    } else {
+        sector_header(sector, lba, 2);
+        stored[2] = (type == 2) ? 0x08 : 0x20;
+        if (!empty) fill_random(stored + 4, size - 4);
+        ecm_sector_rebuild(type, stored, sector + 0x10);
+    }
+}
+
+enum image_kind {
+    IMAGE_MODE1,      /* Mode 1 data track, with the odd run of empty sectors */
+    IMAGE_MODE2,      /* XA track mixing form 1 and form 2 runs */
+    IMAGE_CDDA,       /* Red Book audio */
+    IMAGE_GARBAGE,    /* Random bytes */
+    IMAGE_MISALIGNED, /* Mode 1 sectors with odd-sized junk between them */
+    IMAGE_KINDS
+};
+
+static const char *image_name[IMAGE_KINDS] = {
+    "mode1", "mode2", "cdda", "garbage", "misaligned"
+};
+
+static size_t make_image(unsigned char *p, size_t size, enum image_kind kind) {
+    size_t n = 0;
+    unsigned lba = 0;
+    unsigned run = 0;
+    unsigned type = 1;
+    int empty = 0;
+    unsigned phase = 0;
+    switch (kind) {
+    case IMAGE_CDDA:
+        /* Two slowly drifting tones with a little noise on top */
+        for (n = 0; n + 4 <= size; n += 2) {
+            int s = (int) ((phase / 7) % 2000) - 1000 + (int) ((phase / 3) % 600) + (int) (rng() % 64);
+            p[n] = (unsigned char) s;
+            p[n + 1] = (unsigned char) (s >> 8);
+            phase++;
+        }
+        return n;
+    case IMAGE_GARBAGE:
+        fill_random(p, size);
+        return size;
+    default:
+        break;
+    }
+    while (n + 2352 + 128 <= size) {
+        if (!run) {
+            run = 1 + rng() % 64;
+            if (kind == IMAGE_MODE2) type = (rng() % 4) ? 2 : 3;
+            empty = !(rng() % 8);
+        }
+        if (kind == IMAGE_MISALIGNED) {
+            unsigned gap = 1 + rng() % 100;
+            fill_random(p + n, gap);
+            n += gap;
+        }
+        make_sector(p + n, type, lba++, empty);
+        n += 2352;
+        run--;
+    }
+    return n;
+}
+
+/***************************************************************************/
+/*
+** Kernels, on a batch of valid sectors that stays in cache
+*/
+
+#define KERNEL_SECTORS 64
+
+static unsigned char kernel_mode1[KERNEL_SECTORS][2352];
+static unsigned char kernel_mode2[KERNEL_SECTORS][2352];
+
+static volatile ecc_uint32 bench_sink;
+
+enum kernel {
+    KERNEL_EDC,
+    KERNEL_ECC_P,
+    KERNEL_ECC_Q,
+    KERNEL_ECC_BATCH,
+    KERNEL_VERIFY,
+    KERNEL_VERIFY_BATCH,
+    KERNEL_REBUILD1,
+    KERNEL_REBUILD2,
+    KERNEL_REBUILD3
+};
+
+static void kernel_pass(enum kernel k) {
+    unsigned char out[2352] = { 0 };
+    unsigned char stored[4 + 2324];
+    ecc_uint32 edc = 0;
+    unsigned i;
+    if (k == KERNEL_ECC_BATCH) {
+        /* The sectors are valid, so generating their parity again leaves them so */
+        ecc_generate_batch(kernel_mode1[0] + 0x10, 2352, KERNEL_SECTORS, 1);
+        return;
+    }
+    if (k == KERNEL_VERIFY_BATCH) {
+        /* As KERNEL_VERIFY, for a run of Mode 1 sectors */
+        for (i = 0; i < KERNEL_SECTORS; i++) edc ^= edc_partial_computeblock(0, kernel_mode1[i], 0x810);
+        bench_sink = edc ^ (ecc_uint32) ecc_verify_batch(kernel_mode1[0] + 0x10, 2352, KERNEL_SECTORS, 1);
+        return;
+    }
+    for (i = 0; i < KERNEL_SECTORS; i++) {
+        unsigned char *s = kernel_mode1[i];
+        switch (k) {
+        case KERNEL_EDC:
+            edc ^= edc_partial_computeblock(0, s, 0x810);
+            break;
+        case KERNEL_ECC_P:
+            ecc_compute_p(s + 0xC, s + 0x10, out);
+            break;
+        case KERNEL_ECC_Q:
+            ecc_compute_q(s + 0xC, s + 0x10, out);
+            break;
+        case KERNEL_ECC_BATCH:
+        case KERNEL_VERIFY_BATCH:
+            break;
+        case KERNEL_VERIFY:
+            /* What classifying a Mode 1 sector costs once its mode byte matches */
+            edc ^= edc_partial_computeblock(0, s, 0x810);
+            edc ^= (ecc_uint32) ecc_verify(s + 0xC, s + 0x10);
+            break;
+        case KERNEL_REBUILD1:
+            memcpy(stored, s + 0xC, 3);
+            memcpy(stored + 3, s + 0x10, 0x800);
+            ecm_sector_rebuild(1, stored, out);
+            break;
+        case KERNEL_REBUILD2:
+        case KERNEL_REBUILD3:
+            s = kernel_mode2[i];
+            memcpy(stored, s + 0x10, 4);
+            memcpy(stored + 4, s + 0x18, ecm_stored_size(k - KERNEL_REBUILD1 + 1) - 4);
+            ecm_sector_rebuild(k - KERNEL_REBUILD1 + 1, stored, out);
+            break;
+        }
+        edc ^= out[0x100];
+    }
+    bench_sink = edc;
+}
+
+static void kernel_bench(const char *name, const char *variant, enum kernel k) {
+    double start = stopwatch_now();
+    double elapsed;
+    double passes = 0;
+    do {
+        kernel_pass(k);
+        passes++;
+    } while ((elapsed = stopwatch_now() - start) < bench_time);
+    report(name, variant, passes * KERNEL_SECTORS, elapsed);
+}
+
+static void kernels(void) {
+    static const char *rebuild_variant[3] = { "type 1", "type 2", "type 3" };
+    enum edc_engine edc_saved = edc_selected();
+    enum ecc_engine ecc_saved = ecc_selected();
+    int engine;
+    unsigned i;
+    for (i = 0; i < KERNEL_SECTORS; i++) {
+        make_sector(kernel_mode1[i], 1, i, 0);
+        make_sector(kernel_mode2[i], (i & 1) ? 3 : 2, i, 0);
+    }
+    for (engine = EDC_ENGINE_TABLE; engine <= EDC_ENGINE_CLMUL; engine++) {
+        if (!edc_select((enum edc_engine) engine)) continue;
+        kernel_bench("edc", edc_engine_name((enum edc_engine) engine), KERNEL_EDC);
+    }
+    edc_select(edc_saved);
+    for (engine = ECC_ENGINE_SCALAR; engine <= ECC_ENGINE_NEON; engine++) {
+        if (!ecc_select((enum ecc_engine) engine)) continue;
+        kernel_bench("ecc p", ecc_engine_name((enum ecc_engine) engine), KERNEL_ECC_P);
+        kernel_bench("ecc q", ecc_engine_name((enum ecc_engine) engine), KERNEL_ECC_Q);
+        kernel_bench("ecc batch", ecc_engine_name((enum ecc_engine) engine), KERNEL_ECC_BATCH);
+    }
+    ecc_select(ecc_saved);
+    kernel_bench("classify", "mode 1 verify", KERNEL_VERIFY);
+    kernel_bench("classify", "mode 1 run", KERNEL_VERIFY_BATCH);
+    for (i = 0; i < 3; i++) {
+        kernel_bench("rebuild", rebuild_variant[i], (enum kernel) (KERNEL_REBUILD1 + i));
+    }
+}
+
+/***************************************************************************/
+/*
+** Whole images through the library
+*/
+
+static int image_bench(const unsigned char *image, size_t len, const char *name, unsigned maxthreads, unsigned version) {
+    size_t bound = ecm_encode_bound(len, 0);
+    unsigned char *ecm = malloc(bound);
+    unsigned char *back = malloc(len ? len : 1);
+    unsigned threads;
+    size_t ecmlen = 0;
+    int r = 0;
+    if (!ecm || !back) {
+        fprintf(stderr, "Out of memory\n");
+        free(ecm);
+        free(back);
+        return 1;
+    }
+    for (threads = 1; threads <= maxthreads; threads *= 2) {
+        char variant[64];
+        double start, elapsed;
+        double runs = 0;
+        struct ecm_encoder_options eo;
+        struct ecm_decoder_options dopt;
+        memset(&eo, 0, sizeof(eo));
+        eo.threads = threads;
+        eo.version = version;
+        start = stopwatch_now();
+        do {
+            struct ecm_encoder *enc = ecm_encoder_create(&eo);
+            int status = enc ? ecm_encoder_encode_buffer(enc, image, len, ecm, bound, &ecmlen) : ECM_ERROR_MEMORY;
+            ecm_encoder_destroy(enc);
+            if (status != ECM_DONE) {
+                fprintf(stderr, "%s: %s\n", name, ecm_status_string(status));
+                r = 1;
+                goto done;
+            }
+            runs++;
+        } while ((elapsed = stopwatch_now() - start) < bench_time);
+        sprintf(variant, "%s %ut", name, threads);
+        report("encode", variant, runs * (double) len / 2352.0, elapsed);
+
+        memset(&dopt, 0, sizeof(dopt));
+        dopt.threads = threads;
+        runs = 0;
+        start = stopwatch_now();
+        do {
+            struct ecm_decoder *dec = ecm_decoder_create(&dopt);
+            size_t backlen = 0;
+            int status = dec ? ecm_decoder_decode_buffer(dec, ecm, ecmlen, back, len, &backlen) : ECM_ERROR_MEMORY;
+            ecm_decoder_destroy(dec);
+            if ((status != ECM_DONE) || (backlen != len) || memcmp(back, image, len)) {
+                fprintf(stderr, "%s: decoded image doesn't match (%s)\n", name, ecm_status_string(status));
+                r = 1;
+                goto done;
+            }
+            runs++;
+        } while ((elapsed = stopwatch_now() - start) < bench_time);
+        report("decode", variant, runs * (double) len / 2352.0, elapsed);
+    }
+    printf("%-10s %-22s %10.1f%% of %lu bytes\n", "ratio", name, len ? 100.0 * (double) ecmlen / (double) len : 0.0,
+           (unsigned long) len);
+done:
+    free(ecm);
+    free(back);
+    return r;
+}
+
+/***************************************************************************/
+/*
+** Differential checks (--difftest ROUNDS)
+**
+** The optimized paths must give exactly what the reference ones do.  Each
+** round checks every EDC and ECC engine against the table and scalar ones
+** on random blocks, then makes a random image full of near misses and
+** checks that the encoder finds the same sectors as a plain walk through
+** it in the manner of the original ECM.  The image is encoded on every
+** engine, at several thread counts and through pushes of random sizes into
+** windows of random sizes, and every result must be the same byte for
+** byte; each is decoded back in as many ways.  The first difference stops
+** the run.
+*/
+
+static unsigned long long difftest_seed;
+static unsigned difftest_round;
+
+static int differs(const char *what, const char *variant) {
+    fprintf(stderr, "difftest: %s %s differs in round %u (seed %llu)\n", what, variant, difftest_round, difftest_seed);
+    return 1;
+}
+
+/* A random size for a block of input or output, mostly small */
+static size_t chunk_size(void) {
+    return (rng() % 4) ? 1 + rng() % 4096 : 1 + rng() % 0x60000;
+}
+
+/* The EDC the plain way, a byte at a time through a table of our own */
+static ecc_uint32 ref_edc_lut[256];
+
+static void ref_edc_init(void) {
+    ecc_uint32 i, j, edc;
+    for (i = 0; i < 256; i++) {
+        edc = i;
+        for (j = 0; j < 8; j++) edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
+        ref_edc_lut[i] = edc;
+    }
+}
+
+static ecc_uint32 ref_edc(ecc_uint32 edc, const unsigned char *p, size_t n) {
+    while (n--) edc = (edc >> 8) ^ ref_edc_lut[(edc ^ *p++) & 0xFF];
+    return edc;
+}
+
+/* Whether the n bytes at p are followed by their EDC */
+static int ref_edc_matches(const unsigned char *p, size_t n) {
+    ecc_uint32 edc = ref_edc(0, p, n);
+    return (p[n] == (edc & 0xFF)) && (p[n + 1] == ((edc >> 8) & 0xFF)) &&
+           (p[n + 2] == ((edc >> 16) & 0xFF)) && (p[n + 3] == (edc >> 24));
+}
+
+/* Whether the P and Q parity after data is right; the scalar engine must be selected */
+static int ref_ecc_matches(const unsigned char *address, const unsigned char *data) {
+    unsigned char p[172];
+    unsigned char q[104];
+    ecc_compute_p(address, data, p);
+    if (memcmp(p, data + 0x80C, sizeof(p))) return 0;
+    ecc_compute_q(address, data, q);
+    return !memcmp(q, data + 0x8B8, sizeof(q));
+}
+
+/* The original ECM's sector check, one test after another */
+static int ref_check_type(const unsigned char *s, int canbetype1) {
+    static const unsigned char sync[12] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+    static const unsigned char zeros[8];
+    int mode2 = (s[0] == s[4]) && (s[1] == s[5]) && (s[2] == s[6]) && (s[3] == s[7]);
+    if (canbetype1 && !memcmp(s, sync, 12) && (s[0x0F] == 0x01) && !memcmp(s + 0x814, zeros, 8) &&
+        ref_edc_matches(s, 0x810) && ref_ecc_matches(s + 0xC, s + 0x10)) {
+        return 1;
+    }
+    if (mode2 && ref_edc_matches(s, 0x808) && ref_ecc_matches(NULL, s)) return 2;
+    if (mode2 && ref_edc_matches(s, 0x91C)) return 3;
+    return 0;
+}
+
+/* Runs of literal bytes (type 0) and of sectors of types 1-3 */
+struct run {
+    unsigned type;
+    unsigned long long count;
+};
+
+struct runlist {
+    struct run *runs;
+    size_t count;
+    size_t capacity;
+};
+
+static void runlist_add(struct runlist *l, unsigned type, unsigned long long count) {
+    if (l->count && (l->runs[l->count - 1].type == type)) {
+        l->runs[l->count - 1].count += count;
+        return;
+    }
+    if (l->count == l->capacity) {
+        size_t capacity = l->capacity ? l->capacity * 2 : 256;
+        struct run *p = realloc(l->runs, capacity * sizeof(*p));
+        if (!p) abort();
+        l->runs = p;
+        l->capacity = capacity;
+    }
+    l->runs[l->count].type = type;
+    l->runs[l->count].count = count;
+    l->count++;
+}
+
+/* The sectors the original ECM finds in the image */
+static void ref_walk(const unsigned char *image, size_t len, struct runlist *l) {
+    static const unsigned stride[4] = {1, 2352, 2336, 2336};
+    enum ecc_engine saved = ecc_selected();
+    size_t pos = 0;
+    ecc_select(ECC_ENGINE_SCALAR);
+    while (pos < len) {
+        size_t avail = len - pos;
+        int t = 0;
+        if (avail >= 2352) {
+            t = ref_check_type(image + pos, 1);
+        } else if (avail >= 2336) {
+            t = ref_check_type(image + pos, 0);
+        }
+        runlist_add(l, (unsigned) t, 1);
+        pos += stride[t];
+    }
+    ecc_select(saved);
+}
+
+/*
+** The sectors an ECM file records, types 4-7 counted as the types they
+** stand for, and how many records it takes; 0 if it doesn't parse
+*/
+static int ecm_walk(const unsigned char *ecm, size_t len, struct runlist *l, size_t *records) {
+    static const unsigned basetype[8] = {0, 1, 2, 3, 1, 1, 2, 3};
+    unsigned version;
+    size_t pos = 4;
+    if (len < 4) return 0;
+    version = ecm[3];
+    for (;;) {
+        unsigned bits = version ? 4 : 5;
+        unsigned type, num;
+        int c;
+        if (pos >= len) return 0;
+        c = ecm[pos++];
+        type = version ? (c & 7) : (c & 3);
+        num = version ? ((c >> 3) & 0x0F) : ((c >> 2) & 0x1F);
+        while (c & 0x80) {
+            if ((pos >= len) || (bits >= 32)) return 0;
+            c = ecm[pos++];
+            num |= ((unsigned) (c & 0x7F)) << bits;
+            bits += 7;
+        }
+        if (num == 0xFFFFFFFF) return 1;
+        num++;
+        runlist_add(l, basetype[type], num);
+        ++*records;
+        pos += ecm_prefix_size(type) + (size_t) num * ecm_stored_size(type);
+    }
+}
+
+/***************************************************************************/
+
+/* Every engine against the reference on random blocks and sectors */
+static int difftest_kernels(void) {
+    static const enum edc_sector layout[4] = {EDC_SECTOR_MODE1, EDC_SECTOR_MODE1,
+                                              EDC_SECTOR_MODE2_FORM1, EDC_SECTOR_MODE2_FORM2};
+    static unsigned char buf[4 * 2352 + 64];
+    unsigned char sector[2352];
+    unsigned char expect[2352];
+    unsigned char stored[4 + 2324];
+    unsigned char p[172];
+    unsigned char q[104];
+    int engine;
+    unsigned i;
+    for (i = 0; i < 64; i++) {
+        size_t off = rng() % 64;
+        size_t n = rng() % (sizeof(buf) - 64);
+        size_t split = n ? rng() % n : 0;
+        ecc_uint32 init = rng();
+        ecc_uint32 edc;
+        fill_random(buf, off + n);
+        edc = ref_edc(init, buf + off, n);
+        for (engine = EDC_ENGINE_TABLE; engine <= EDC_ENGINE_CLMUL; engine++) {
+            if (!edc_select((enum edc_engine) engine)) continue;
+            if (edc_partial_computeblock(init, buf + off, n) != edc) {
+                return differs("edc", edc_engine_name((enum edc_engine) engine));
+            }
+        }
+        if (edc_combine(ref_edc(init, buf + off, split), ref_edc(0, buf + off + split, n - split), n - split) != edc) {
+            return differs("edc", "combine");
+        }
+    }
+    for (i = 1; i <= 3; i++) {
+        size_t n = 1 + rng() % 4;
+        size_t size = (i == 1) ? 2352 : 2336;
+        ecc_uint32 init = rng();
+        size_t k;
+        for (k = 0; k < n; k++) {
+            make_sector(sector, i, rng() % 1000, !(rng() % 4));
+            memcpy(buf + k * size, (i == 1) ? sector : sector + 0x10, size);
+        }
+        for (engine = EDC_ENGINE_TABLE; engine <= EDC_ENGINE_CLMUL; engine++) {
+            if (!edc_select((enum edc_engine) engine)) continue;
+            if (edc_sectors(init, buf, n, layout[i]) != ref_edc(init, buf, n * size)) {
+                return differs("edc sectors", edc_engine_name((enum edc_engine) engine));
+            }
+        }
+        /* The sectors the library rebuilds must pass the original check */
+        ecc_select(ECC_ENGINE_SCALAR);
+        if (ref_check_type(buf, i == 1) != (int) i) return differs("sector rebuild", "type");
+    }
+    for (i = 0; i < 16; i++) {
+        const unsigned char *address = (i & 1) ? sector + 0xC : NULL;
+        unsigned char *data = sector + 0x10;
+        int valid;
+        fill_random(sector, sizeof(sector));
+        ecc_select(ECC_ENGINE_SCALAR);
+        ecc_compute_p(address, data, data + 0x80C);
+        ecc_compute_q(address, data, data + 0x8B8);
+        if (i & 2) data[rng() % (0x8B8 + 104)] ^= (unsigned char) (1 + rng() % 255);
+        valid = ref_ecc_matches(address, data);
+        ecc_compute_p(address, data, expect);
+        ecc_compute_q(address, data, expect + 172);
+        for (engine = ECC_ENGINE_SCALAR; engine <= ECC_ENGINE_NEON; engine++) {
+            if (!ecc_select((enum ecc_engine) engine)) continue;
+            ecc_compute_p(address, data, p);
+            ecc_compute_q(address, data, q);
+            if (memcmp(p, expect, 172)) return differs("ecc p", ecc_engine_name((enum ecc_engine) engine));
+            if (memcmp(q, expect + 172, 104)) return differs("ecc q", ecc_engine_name((enum ecc_engine) engine));
+            if (ecc_verify(address, data) != valid) {
+                return differs("ecc verify", ecc_engine_name((enum ecc_engine) engine));
+            }
+        }
+    }
+    /* Runs of sectors through the batch kernels, against a sector at a time */
+    for (i = 0; i < 8; i++) {
+        static unsigned char run[70 * 2352 + 0x10];
+        static unsigned char work[70 * 2352 + 0x10];
+        int address = i & 1;
+        size_t stride = address ? 2352 : 2336;
+        size_t n = 1 + rng() % 70;
+        size_t valid = n;
+        size_t k;
+        fill_random(run, n * stride + 0x10);
+        ecc_select(ECC_ENGINE_SCALAR);
+        for (k = 0; k < n; k++) {
+            unsigned char *d = run + k * stride + 0x10;
+            ecc_compute_p(address ? d - 4 : NULL, d, d + 0x80C);
+            ecc_compute_q(address ? d - 4 : NULL, d, d + 0x8B8);
+        }
+        if (i & 2) {
+            size_t bad = rng() % n;
+            run[bad * stride + 0xC + rng() % (4 + 0x8B8 + 104)] ^= (unsigned char) (1 + rng() % 255);
+            for (valid = 0; valid < n; valid++) {
+                const unsigned char *d = run + valid * stride + 0x10;
+                if (!ref_ecc_matches(address ? d - 4 : NULL, d)) break;
+            }
+        }
+        for (engine = ECC_ENGINE_SCALAR; engine <= ECC_ENGINE_NEON; engine++) {
+            if (!ecc_select((enum ecc_engine) engine)) continue;
+            memcpy(work, run, n * stride + 0x10);
+            for (k = 0; k < valid; k++) memset(work + k * stride + 0x10 + 0x80C, 0, 276);
+            ecc_generate_batch(work + 0x10, stride, valid, address);
+            if (memcmp(work, run, n * stride + 0x10)) {
+                return differs("ecc batch", ecc_engine_name((enum ecc_engine) engine));
+            }
+            if (ecc_verify_batch(run + 0x10, stride, n, address) != valid) {
+                return differs("ecc verify batch", ecc_engine_name((enum ecc_engine) engine));
+            }
+        }
+    }
+    /* Moving a Mode 1 sector to another address, against rebuilding it there */
+    make_sector(sector, 1, rng() % 300000, rng() & 1);
+    memcpy(stored, sector + 0xC, 3);
+    memcpy(stored + 3, sector + 0x10, 0x800);
+    stored[0] ^= (unsigned char) rng();
+    stored[1] ^= (unsigned char) rng();
+    stored[2] ^= (unsigned char) rng();
+    ecm_sector_rebuild(1, stored, expect);
+    for (engine = ECC_ENGINE_SCALAR; engine <= ECC_ENGINE_NEON; engine++) {
+        unsigned char delta[8];
+        unsigned char moved[2352];
+        ecc_uint32 edc;
+        if (!ecc_select((enum ecc_engine) engine)) continue;
+        memcpy(moved, sector, sizeof(moved));
+        for (i = 0; i < 3; i++) delta[i] = sector[0xC + i] ^ stored[i];
+        delta[3] = 0;
+        edc = edc_mode1_address_delta(delta);
+        for (i = 0; i < 4; i++) delta[4 + i] = (unsigned char) (edc >> (8 * i));
+        ecc_patch(moved, delta);
+        if (memcmp(moved, expect, sizeof(moved))) return differs("ecc patch", ecc_engine_name((enum ecc_engine) engine));
+    }
+    return 0;
+}
+
+/* Give a raw sector of type 1-3 the EDC and parity of what it now holds */
+static void sector_reseal(unsigned char *sector, unsigned type) {
+    unsigned char *body = sector + 0x10;
+    ecc_uint32 edc;
+    if (type == 1) {
+        edc = edc_partial_computeblock(0, sector, 0x810);
+        sector[0x810] = (unsigned char) edc;
+        sector[0x811] = (unsigned char) (edc >> 8);
+        sector[0x812] = (unsigned char) (edc >> 16);
+        sector[0x813] = (unsigned char) (edc >> 24);
+        ecc_compute_p(sector + 0xC, body, body + 0x80C);
+        ecc_compute_q(sector + 0xC, body, body + 0x8B8);
+    } else if (type == 2) {
+        edc = edc_partial_computeblock(0, body, 0x808);
+        body[0x808] = (unsigned char) edc;
+        body[0x809] = (unsigned char) (edc >> 8);
+        body[0x80A] = (unsigned char) (edc >> 16);
+        body[0x80B] = (unsigned char) (edc >> 24);
+        ecc_compute_p(NULL, body, body + 0x80C);
+        ecc_compute_q(NULL, body, body + 0x8B8);
+    } else {
+        edc = edc_partial_computeblock(0, body, 0x91C);
+        body[0x91C] = (unsigned char) edc;
+        body[0x91D] = (unsigned char) (edc >> 8);
+        body[0x91E] = (unsigned char) (edc >> 16);
+        body[0x91F] = (unsigned char) (edc >> 24);
+    }
+}
+
+/*
+** A random image of at most size bytes: runs of sectors of every type, empty
+** or not, with addresses in and out of sequence, both raw and as bare Mode 2
+** bodies, and in between near misses: sectors with one byte changed, cut
+** short, or with a byte of their sync, mode, reserved bytes or subheader
+** changed and the EDC and parity made to match, zeros, and junk with bits
+** of sync patterns and repeated subheaders planted in it
+*/
+static size_t make_difftest_image(unsigned char *p, size_t size) {
+    unsigned char sector[2352];
+    unsigned lba = rng() % 1000;
+    size_t n = 0;
+    while (n + 16 * 2352 + 5000 <= size) {
+        unsigned kind = rng() % 10;
+        unsigned type = 1 + rng() % 3;
+        int bare = (type != 1) && (rng() & 1);
+        size_t len = bare ? 2336 : 2352;
+        unsigned count = 1 + rng() % 16;
+        int empty = !(rng() % 6);
+        unsigned i;
+        if (kind == 8) {
+            size_t junk = 1 + rng() % 3000;
+            fill_random(p + n, junk);
+            for (i = rng() % 8; i; i--) {
+                size_t at = rng() % junk;
+                if (rng() & 1) {
+                    p[n + at] = 0x00;
+                    if (at + 1 < junk) p[n + at + 1] = 0xFF;
+                } else if (at + 8 <= junk) {
+                    memcpy(p + n + at + 4, p + n + at, 4);
+                }
+            }
+            n += junk;
+            continue;
+        }
+        if (kind == 9) {
+            size_t zeros = 1 + rng() % 5000;
+            memset(p + n, 0, zeros);
+            n += zeros;
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            unsigned char *s = bare ? sector + 0x10 : sector;
+            size_t keep = len;
+            make_sector(sector, type, (rng() % 8) ? lba++ : rng() % 300000, empty);
+            if ((kind == 5) && !(rng() % 4)) s[rng() % len] ^= (unsigned char) (1 + rng() % 255);
+            if ((kind == 6) && !(rng() % 4)) keep = rng() % len;
+            if ((kind == 7) && !(rng() % 4)) {
+                static const unsigned short fixed[] = {0x00, 0x01, 0x05, 0x0B, 0x0F, 0x814, 0x819, 0x81B};
+                unsigned at = (type == 1) ? fixed[rng() % (sizeof(fixed) / sizeof(*fixed))] : 0x10 + rng() % 8;
+                sector[at] ^= (unsigned char) (1 + rng() % 255);
+                sector_reseal(sector, type);
+            }
+            memcpy(p + n, s, keep);
+            n += keep;
+        }
+    }
+    /* A Mode 2 body right at the end, where there's no room to look for Mode 1 */
+    if ((rng() & 1) && (n + 2336 + 15 <= size)) {
+        size_t extra = rng() % 16;
+        make_sector(sector, 2 + (rng() & 1), lba, 0);
+        memcpy(p + n, sector + 0x10, 2336);
+        fill_random(p + n + 2336, extra);
+        n += 2336 + extra;
+    }
+    return n;
+}
+
+/* Encode through pushes and pulls of random sizes */
+static int encode_chunked(struct ecm_encoder *enc, const unsigned char *image, size_t len,
+                          unsigned char *out, size_t outsize, size_t *outlen) {
+    size_t pos = 0;
+    size_t n;
+    *outlen = 0;
+    while (!ecm_encoder_status(enc) && (pos < len)) {
+        n = chunk_size();
+        if (n > len - pos) n = len - pos;
+        pos += ecm_encoder_push(enc, image + pos, n);
+        n = chunk_size();
+        if (n > outsize - *outlen) n = outsize - *outlen;
+        *outlen += ecm_encoder_pull(enc, out + *outlen, n);
+    }
+    ecm_encoder_finish(enc);
+    while ((n = ecm_encoder_pull(enc, out + *outlen, outsize - *outlen)) > 0) *outlen += n;
+    return ecm_encoder_status(enc);
+}
+
+/* Decode through random mixes of pushes, pulls and decodes of random sizes */
+static int decode_chunked(struct ecm_decoder *dec, const unsigned char *ecm, size_t len,
+                          unsigned char *out, size_t outsize, size_t *outlen) {
+    size_t pos = 0;
+    size_t n;
+    *outlen = 0;
+    while (!ecm_decoder_status(dec) && (pos < len) && (*outlen < outsize)) {
+        size_t room = chunk_size();
+        size_t used;
+        n = chunk_size();
+        if (n > len - pos) n = len - pos;
+        if (room > outsize - *outlen) room = outsize - *outlen;
+        if (rng() % 4) {
+            *outlen += ecm_decoder_decode(dec, ecm + pos, n, &used, out + *outlen, room);
+        } else {
+            used = ecm_decoder_push(dec, ecm + pos, n);
+            *outlen += ecm_decoder_pull(dec, out + *outlen, room);
+        }
+        pos += used;
+    }
+    ecm_decoder_finish(dec);
+    while ((n = ecm_decoder_pull(dec, out + *outlen, outsize - *outlen)) > 0) *outlen += n;
+    return ecm_decoder_status(dec);
+}
+
+static int difftest_decode(const unsigned char *ecm, size_t ecmlen, const unsigned char *image, size_t len,
+                           unsigned char *back, unsigned threads, int chunked, const char *variant) {
+    struct ecm_decoder_options o;
+    struct ecm_decoder *dec;
+    size_t backlen = 0;
+    int status;
+    memset(&o, 0, sizeof(o));
+    o.threads = threads;
+    dec = ecm_decoder_create(&o);
+    if (!dec) return differs("decode", "create");
+    status = chunked ? decode_chunked(dec, ecm, ecmlen, back, len + 1, &backlen)
+                     : ecm_decoder_decode_buffer(dec, ecm, ecmlen, back, len, &backlen);
+    ecm_decoder_destroy(dec);
+    if ((status != ECM_DONE) || (backlen != len) || memcmp(back, image, len)) return differs("decode", variant);
+    return 0;
+}
+
+static int difftest_image(const unsigned char *image, size_t len, unsigned maxthreads, unsigned version) {
+    enum edc_engine edc_saved = edc_selected();
+    enum ecc_engine ecc_saved = ecc_selected();
+    struct ecm_encoder_options eo;
+    struct ecm_extent literal[3];
+    struct runlist found = {NULL, 0, 0};
+    struct runlist walked = {NULL, 0, 0};
+    size_t bound = ecm_encode_bound(len, 1);
+    unsigned char *ref = malloc(bound);
+    unsigned char *out = malloc(bound);
+    unsigned char *back = malloc(len + 1);
+    unsigned long long decoded = 0;
+    size_t reflen = 0;
+    size_t records = 0;
+    int edc, ecc;
+    unsigned pass;
+    size_t i;
+    int r = 0;
+    if (!ref || !out || !back) {
+        fprintf(stderr, "Out of memory\n");
+        r = 1;
+        goto done;
+    }
+    memset(&eo, 0, sizeof(eo));
+    eo.version = rng() % (version + 1);
+    eo.index = rng() & 1;
+    if (!(rng() % 3)) eo.merge = 1 + rng() % ECM_MERGE_MAX;
+    if (!(rng() % 4) && len) {
+        unsigned long long at = 0;
+        for (i = 0; i < 3; i++) {
+            literal[i].offset = at + rng() % (len / 3 + 1);
+            literal[i].length = rng() % (len / 6 + 1);
+            at = literal[i].offset + literal[i].length;
+        }
+        eo.literal = literal;
+        eo.literal_count = 3;
+    }
+
+    /*
+    ** One thread, in one go: first on the reference engines, then on each
+    ** engine paired with the best one of the other kind
+    */
+    for (edc = EDC_ENGINE_TABLE; !r && (edc <= EDC_ENGINE_CLMUL); edc++) {
+        if (!edc_select((enum edc_engine) edc)) continue;
+        for (ecc = ECC_ENGINE_SCALAR; !r && (ecc <= ECC_ENGINE_NEON); ecc++) {
+            unsigned char *dst = reflen ? out : ref;
+            char variant[64];
+            struct ecm_encoder *enc;
+            size_t outlen = 0;
+            int status;
+            if (reflen && (edc != (int) edc_saved) && (ecc != (int) ecc_saved)) continue;
+            if (!ecc_select((enum ecc_engine) ecc)) continue;
+            sprintf(variant, "%s/%s", edc_engine_name((enum edc_engine) edc), ecc_engine_name((enum ecc_engine) ecc));
+            enc = ecm_encoder_create(&eo);
+            status = enc ? ecm_encoder_encode_buffer(enc, image, len, dst, bound, &outlen) : ECM_ERROR_MEMORY;
+            ecm_encoder_destroy(enc);
+            if (status != ECM_DONE) {
+                r = differs("encode", variant);
+            } else if (!reflen) {
+                reflen = outlen;
+            } else if ((outlen != reflen) || memcmp(out, ref, reflen)) {
+                r = differs("encode", variant);
+            }
+            if (!r) r = difftest_decode(dst, outlen, image, len, back, 1, 0, variant);
+        }
+    }
+    edc_select(edc_saved);
+    ecc_select(ecc_saved);
+    if (r) goto done;
+
+    /* What was found, against the original walk */
+    if (!eo.merge && !eo.literal_count) {
+        ref_walk(image, len, &walked);
+        if (!ecm_walk(ref, reflen, &found, &records)) {
+            r = differs("classification", "records");
+            goto done;
+        }
+        for (i = 0; (i < found.count) && (i < walked.count); i++) {
+            if ((found.runs[i].type != walked.runs[i].type) || (found.runs[i].count != walked.runs[i].count)) break;
+        }
+        if ((i < found.count) || (i < walked.count)) {
+            r = differs("classification", "against the original walk");
+            goto done;
+        }
+        /* Each run one record, as the original writes it */
+        if (!eo.version && !eo.index && (records != walked.count)) {
+            r = differs("records", "against the original walk");
+            goto done;
+        }
+    }
+    if ((ecm_decoded_size(ref, reflen, &decoded) != ECM_OK) || (decoded != len)) {
+        r = differs("decoded", "size");
+        goto done;
+    }
+
+    /* Threads, and input and output in random pieces, on the best engines */
+    for (pass = 0; !r && (pass < 4); pass++) {
+        unsigned threads = (pass & 1) ? maxthreads : ((pass & 2) ? 1 : 2);
+        int chunked = (pass >= 2);
+        char variant[64];
+        struct ecm_encoder *enc;
+        size_t outlen = 0;
+        int status;
+        if ((threads > maxthreads) || (threads < 1)) continue;
+        eo.threads = threads;
+        /* Streaming, the window size mustn't matter either */
+        eo.window = (chunked && (rng() & 1)) ? ECM_WINDOW_MIN + rng() % (3 * ECM_WINDOW_MIN) : 0;
+        sprintf(variant, "%ut%s window %lu", threads, chunked ? " chunked" : "", (unsigned long) eo.window);
+        enc = ecm_encoder_create(&eo);
+        if (!enc) {
+            status = ECM_ERROR_MEMORY;
+        } else if (chunked) {
+            status = encode_chunked(enc, image, len, out, bound, &outlen);
+        } else {
+            status = ecm_encoder_encode_buffer(enc, image, len, out, bound, &outlen);
+        }
+        ecm_encoder_destroy(enc);
+        if ((status != ECM_DONE) || (outlen != reflen) || memcmp(out, ref, reflen)) {
+            r = differs("encode", variant);
+        } else {
+            r = difftest_decode(ref, reflen, image, len, back, threads, chunked, variant);
+        }
+    }
+
+done:
+    free(found.runs);
+    free(walked.runs);
+    free(ref);
+    free(out);
+    free(back);
+    return r;
+}
+
+static int difftest(unsigned rounds, size_t size, unsigned maxthreads, unsigned version) {
+    enum edc_engine edc_saved = edc_selected();
+    enum ecc_engine ecc_saved = ecc_selected();
+    unsigned char *image = malloc(size);
+    int r = 0;
+    if (!image) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    ref_edc_init();
+    for (difftest_round = 1; !r && (difftest_round <= rounds); difftest_round++) {
+        /* Now and then a small image, so that the ends come into it more often */
+        size_t most = (rng() % 4) ? size : 1 + size / 64;
+        size_t len = make_difftest_image(image, most);
+        r = difftest_kernels();
+        edc_select(edc_saved);
+        ecc_select(ecc_saved);
+        r = r || difftest_image(image, len, maxthreads, version);
+        if (!r && (!(difftest_round % 10) || (difftest_round == rounds))) {
+            printf("difftest   %u of %u rounds\n", difftest_round, rounds);
+            fflush(stdout);
+        }
+    }
+    free(image);
+    return r;
+}
+
+/***************************************************************************/
+
+static void usage(const char *progname) {
+    fprintf(stderr, "usage: %s [--size MB] [--threads N] [--time S] [--format N] [--write DIR] [--kernels]\n", progname);
+    fprintf(stderr, "       [--image NAME] [--difftest ROUNDS [--seed N]]\n");
+    fprintf(stderr, "  --size MB    size of each synthetic image (default 32, 4 with --difftest)\n");
+    fprintf(stderr, "  --threads N  most threads for the scaling runs (default 4)\n");
+    fprintf(stderr, "  --time S     seconds per measurement, at least (default 0.5)\n");
+    fprintf(stderr, "  --format N   ECM format version to encode to (default %u)\n", ECM_FORMAT_VERSION);
+    fprintf(stderr, "  --write DIR  just write the images to DIR/NAME.bin\n");
+    fprintf(stderr, "  --kernels    only run the kernels\n");
+    fprintf(stderr, "  --image NAME only run the image NAME:");
+    {
+        int i;
+        for (i = 0; i < IMAGE_KINDS; i++) fprintf(stderr, " %s", image_name[i]);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  --difftest ROUNDS  check the fast paths against the reference ones instead\n");
+    fprintf(stderr, "  --seed N     start the random images from N (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+    unsigned long size = 0;
+    unsigned maxthreads = 4;
+    unsigned rounds = 0;
+    unsigned version = ECM_FORMAT_VERSION;
+    const char *writedir = NULL;
+    const char *only = NULL;
+    int kernelsonly = 0;
+    unsigned char *image;
+    int argi = 1;
+    int kind;
+    int r = 0;
+
+    while (argi < argc) {
+        if (!strcmp(argv[argi], "--kernels")) {
+            kernelsonly = 1;
+            argi++;
+        } else if (argi + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        } else if (!strcmp(argv[argi], "--size")) {
+            size = strtoul(argv[argi + 1], NULL, 10);
+            if (!size) {
+                usage(argv[0]);
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--threads")) {
+            maxthreads = (unsigned) strtoul(argv[argi + 1], NULL, 10);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--time")) {
+            bench_time = atof(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--format")) {
+            version = (unsigned) strtoul(argv[argi + 1], NULL, 10);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--write")) {
+            writedir = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--image")) {
+            only = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--difftest")) {
+            rounds = (unsigned) strtoul(argv[argi + 1], NULL, 10);
+            if (!rounds) {
+                usage(argv[0]);
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--seed")) {
+            difftest_seed = strtoull(argv[argi + 1], NULL, 10);
+            argi += 2;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!size) size = rounds ? 4 : 32;
+    if (!maxthreads || (version > ECM_FORMAT_VERSION)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    eccedc_init();
+    if (rounds) {
+        printf("edc engine %s, ecc engine %s\n", edc_engine_name(edc_selected()), ecc_engine_name(ecc_selected()));
+        /* xorshift needs a state that isn't all zero */
+        difftest_seed = difftest_seed ? difftest_seed : 1;
+        rng_state = 0x9E3779B97F4A7C15ULL * difftest_seed;
+        return difftest(rounds, size << 20, maxthreads, version);
+    }
+    if (!writedir) {
+        printf("edc engine %s, ecc engine %s\n", edc_engine_name(edc_selected()), ecc_engine_name(ecc_selected()));
+        if (!only) kernels();
+        if (kernelsonly) return 0;
+    }
+
+    size <<= 20;
+    image = malloc(size);
+    if (!image) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (kind = 0; kind < IMAGE_KINDS; kind++) {
+        size_t len;
+        if (only && strcmp(only, image_name[kind])) continue;
+        len = make_image(image, size, (enum image_kind) kind);
+        if (writedir) {
+            char *path = malloc(strlen(writedir) + strlen(image_name[kind]) + 6);
+            FILE *f;
+            if (!path) abort();
+            sprintf(path, "%s/%s.bin", writedir, image_name[kind]);
+            f = fopen(path, "wb");
+            if (!f) {
+                perror(path);
+                r = 1;
+            } else if ((fwrite(image, 1, len, f) != len) | fclose(f)) {
+                perror(path);
+                r = 1;
+            }
+            free(path);
+        } else {
+            r |= image_bench(image, len, image_name[kind], maxthreads, version);
+        }
+    }
+    free(image);
+    return r;
+}
@@ -0,0 +1,743 @@
+/***************************************************************************/
+/*
+** libecm compressed container
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "ecmformat.h"
+#include "threadpool.h"
+#include "unecm.h"
+
+#if defined(ECM_HAVE_LZMA)
+#include <lzma.h>
+#endif
+
+/***************************************************************************/
+/*
+** The container (see doc/format.txt) carries an ECM stream split four ways,
+** so that each stream holds one kind of data and compresses on its own
+*/
+enum {
+    STREAM_HEADER,    /* Magic, record headers, the EDC and anything after */
+    STREAM_ADDRESS,   /* Mode 1 addresses, less the predicted address */
+    STREAM_SUBHEADER, /* Mode 2 subheaders */
+    STREAM_PAYLOAD,   /* Literal bytes and sector data */
+    STREAM_COUNT
+};
+
+#define BLOCK_HEADER (STREAM_COUNT * 8)
+#define PACK_DEFAULT_LEVEL 6
+
+/*
+** Where the splitter is in the ECM stream.  The same walk drives both
+** directions: the packer follows the ECM bytes it is given, the unpacker the
+** ECM bytes it rebuilds.  Anything that isn't a valid record sends the rest
+** of the stream to STREAM_HEADER untouched, so any input survives the
+** round trip.
+*/
+enum {
+    SPLIT_MAGIC,
+    SPLIT_RECORD,
+    SPLIT_PREFIX,
+    SPLIT_DATA,
+    SPLIT_EDC,
+    SPLIT_TAIL
+};
+
+struct split_state {
+    int stage;
+    unsigned pos;               /* Bytes into the magic, header, prefix, unit or EDC */
+    unsigned version;           /* Format version, from the magic */
+    unsigned type;
+    unsigned num;
+    unsigned remaining;         /* Units left in the record */
+    unsigned char current[3];   /* Mode 1 address being read */
+    unsigned char predicted[3]; /* Previous address plus one frame */
+};
+
+/* Predict the address that follows a (minutes:seconds:frames in BCD) */
+static void address_predict(const unsigned char *a, unsigned char *p) {
+    memcpy(p, a, 3);
+    ecm_address_next(p);
+}
+
+static void split_init(struct split_state *s) {
+    static const unsigned char before_first[3] = {0x00, 0x01, 0x74};
+    memset(s, 0, sizeof(*s));
+    address_predict(before_first, s->predicted);
+}
+
+/*
+** Which stream the next bytes of the ECM stream go to, and how many of them
+** in a row
+*/
+static size_t split_next(const struct split_state *s, int *stream) {
+    *stream = STREAM_HEADER;
+    switch (s->stage) {
+        case SPLIT_MAGIC:
+        case SPLIT_EDC:
+            return 4 - s->pos;
+        case SPLIT_RECORD:
+            return 1;
+        case SPLIT_PREFIX:
+            *stream = (s->type >= 6) ? STREAM_SUBHEADER : STREAM_ADDRESS;
+            return ecm_prefix_size(s->type) - s->pos;
+        case SPLIT_DATA:
+            if (!s->type) {
+                *stream = STREAM_PAYLOAD;
+                return s->remaining;
+            }
+            if ((s->type == 1) && (s->pos < 3)) {
+                *stream = STREAM_ADDRESS;
+                return 3 - s->pos;
+            }
+            if (((s->type == 2) || (s->type == 3)) && (s->pos < 4)) {
+                *stream = STREAM_SUBHEADER;
+                return 4 - s->pos;
+            }
+            *stream = STREAM_PAYLOAD;
+            return ecm_stored_size(s->type) - s->pos;
+    }
+    return (size_t) -1;
+}
+
+/* Move past the next n ECM bytes p, which split_next() said belong together */
+static void split_advance(struct split_state *s, const unsigned char *p, size_t n) {
+    unsigned c;
+    switch (s->stage) {
+        case SPLIT_MAGIC:
+            s->pos += (unsigned) n;
+            if (s->pos == 4) {
+                s->version = p[n - 1];
+                s->stage = (s->version > ECM_FORMAT_VERSION) ? SPLIT_TAIL : SPLIT_RECORD;
+                s->pos = 0;
+            }
+            break;
+        case SPLIT_RECORD:
+            /* The same rules as the decoder's parse_type_count() */
+            c = p[0];
+            if (s->pos) {
+                s->num |= (c & 0x7F) << (7 * s->pos - (s->version ? 3 : 2));
+            } else if (s->version) {
+                s->type = c & 7;
+                s->num = (c >> 3) & 0x0F;
+            } else {
+                s->type = c & 3;
+                s->num = (c >> 2) & 0x1F;
+            }
+            s->pos++;
+            if (c & 0x80) {
+                if (s->pos == 5) s->stage = SPLIT_TAIL;
+                break;
+            }
+            s->pos = 0;
+            if (s->num == 0xFFFFFFFF) {
+                s->stage = SPLIT_EDC;
+            } else if ((s->num >= 0x7FFFFFFF) || (s->type >= ECM_RECORD_TYPES(s->version))) {
+                s->stage = SPLIT_TAIL;
+            } else {
+                s->remaining = s->num + 1;
+                s->stage = ecm_prefix_size(s->type) ? SPLIT_PREFIX : SPLIT_DATA;
+            }
+            break;
+        case SPLIT_PREFIX:
+            /*
+            ** The first address of a type 4 or 5 record, which the rest
+            ** follow on from, or the flags of a type 6 or 7 record
+            */
+            if (s->type < 6) memcpy(s->current + s->pos, p, n);
+            s->pos += (unsigned) n;
+            if (s->pos < ecm_prefix_size(s->type)) break;
+            s->pos = 0;
+            s->stage = SPLIT_DATA;
+            if (s->type == 4) memcpy(s->predicted, s->current, 3);
+            if (ecm_stored_size(s->type)) break;
+            /* Empty sectors store nothing after the prefix */
+            if (s->type == 5) {
+                memcpy(s->predicted, s->current, 3);
+                ecm_address_advance(s->predicted, s->remaining);
+            }
+            s->stage = SPLIT_RECORD;
+            break;
+        case SPLIT_DATA:
+            if (!s->type) {
+                s->remaining -= (unsigned) n;
+                if (!s->remaining) s->stage = SPLIT_RECORD;
+                break;
+            }
+            if ((s->type == 1) && (s->pos < 3)) {
+                memcpy(s->current + s->pos, p, n);
+                if (s->pos + n == 3) address_predict(s->current, s->predicted);
+            }
+            s->pos += (unsigned) n;
+            if (s->pos == ecm_stored_size(s->type)) {
+                if (s->type == 4) ecm_address_next(s->predicted);
+                s->pos = 0;
+                if (!--s->remaining) s->stage = SPLIT_RECORD;
+            }
+            break;
+        case SPLIT_EDC:
+            s->pos += (unsigned) n;
+            if (s->pos == 4) s->stage = SPLIT_TAIL;
+            break;
+    }
+}
+
+/***************************************************************************/
+/*
+** Buffers and blocks
+*/
+
+struct pack_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+};
+
+/* Make room for n more bytes; returns 0 if out of memory */
+static int buf_reserve(struct pack_buf *b, size_t n) {
+    unsigned char *p;
+    size_t size;
+    if (n <= b->size - b->len) return 1;
+    size = b->size ? b->size : 65536;
+    while (n > size - b->len) size *= 2;
+    p = realloc(b->data, size);
+    if (!p) return 0;
+    b->data = p;
+    b->size = size;
+    return 1;
+}
+
+struct pack_block {
+    struct pack_buf raw[STREAM_COUNT];
+    struct pack_buf packed[STREAM_COUNT];
+    int error[STREAM_COUNT];
+    /* Unpacker: sizes from the block header, and where the block starts */
+    size_t rawsize[STREAM_COUNT];
+    size_t packedsize[STREAM_COUNT];
+    size_t offset;
+};
+
+static struct pack_block *blocks_create(unsigned n) {
+    return calloc(n, sizeof(struct pack_block));
+}
+
+static void blocks_destroy(struct pack_block *blocks, unsigned n) {
+    unsigned i, j;
+    if (!blocks) return;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < STREAM_COUNT; j++) {
+            free(blocks[i].raw[j].data);
+            free(blocks[i].packed[j].data);
+        }
+    }
+    free(blocks);
+}
+
+static void put_le32(unsigned char *p, size_t v) {
+    p[0] = (v >> 0) & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static size_t get_le32(const unsigned char *p) {
+    return p[0] | ((size_t) p[1] << 8) | ((size_t) p[2] << 16) | ((size_t) p[3] << 24);
+}
+
+/***************************************************************************/
+/*
+** LZMA
+*/
+
+#if defined(ECM_HAVE_LZMA)
+
+int ecm_pack_supported(void) {
+    return 1;
+}
+
+static size_t pack_bound(size_t n) {
+    return lzma_stream_buffer_bound(n);
+}
+
+static int pack_compress(const struct pack_buf *raw, struct pack_buf *packed, unsigned level) {
+    lzma_options_lzma options;
+    lzma_filter filters[2];
+    unsigned dict = 4096;
+    size_t pos = 0;
+    if (lzma_lzma_preset(&options, level)) return ECM_ERROR_MEMORY;
+    /* No block is bigger than ECM_PACK_BLOCK, so a bigger dictionary is wasted memory */
+    while (dict < raw->len) dict *= 2;
+    if (dict < options.dict_size) options.dict_size = dict;
+    filters[0].id = LZMA_FILTER_LZMA2;
+    filters[0].options = &options;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    filters[1].options = NULL;
+    packed->len = 0;
+    if (!buf_reserve(packed, pack_bound(raw->len))) return ECM_ERROR_MEMORY;
+    if (lzma_stream_buffer_encode(
+            filters, LZMA_CHECK_CRC32, NULL, raw->data, raw->len, packed->data, &pos, packed->size
+    ) != LZMA_OK) {
+        return ECM_ERROR_MEMORY;
+    }
+    packed->len = pos;
+    return ECM_OK;
+}
+
+static int pack_decompress(const unsigned char *src, size_t srclen, struct pack_buf *raw, size_t rawlen) {
+    uint64_t memlimit = UINT64_MAX;
+    size_t inpos = 0;
+    size_t outpos = 0;
+    lzma_ret r;
+    raw->len = 0;
+    if (!buf_reserve(raw, rawlen)) return ECM_ERROR_MEMORY;
+    r = lzma_stream_buffer_decode(&memlimit, 0, NULL, src, &inpos, srclen, raw->data, &outpos, rawlen);
+    if (r == LZMA_MEM_ERROR) return ECM_ERROR_MEMORY;
+    if ((r != LZMA_OK) || (inpos != srclen) || (outpos != rawlen)) return ECM_ERROR_CORRUPT;
+    raw->len = rawlen;
+    return ECM_OK;
+}
+
+#else
+
+int ecm_pack_supported(void) {
+    return 0;
+}
+
+static size_t pack_bound(size_t n) {
+    return n;
+}
+
+static int pack_compress(const struct pack_buf *raw, struct pack_buf *packed, unsigned level) {
+    (void) raw;
+    (void) packed;
+    (void) level;
+    return ECM_ERROR_UNSUPPORTED;
+}
+
+static int pack_decompress(const unsigned char *src, size_t srclen, struct pack_buf *raw, size_t rawlen) {
+    (void) src;
+    (void) srclen;
+    (void) raw;
+    (void) rawlen;
+    return ECM_ERROR_UNSUPPORTED;
+}
+
+#endif
+
+/***************************************************************************/
+/*
+** Packer: ECM stream in, container out.  Blocks are filled one after the
+** other; once every block is full they are all compressed at once, one
+** stream per task on the pool.
+*/
+
+struct ecm_packer {
+    struct ecm_pack_options options;
+    struct threadpool *pool;
+    struct split_state split;
+    struct pack_block *blocks;
+    unsigned nblocks;
+    unsigned current;     /* Block being filled */
+    size_t current_len;   /* ECM bytes in it */
+    struct pack_buf out;
+    size_t outpos;
+    int finished;
+    int ended;
+    int status;
+    unsigned long long in_bytes;
+    unsigned long long out_bytes;
+};
+
+struct ecm_packer *ecm_packer_create(const struct ecm_pack_options *options) {
+    struct ecm_packer *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    if (options) p->options = *options;
+    if (!p->options.level) p->options.level = PACK_DEFAULT_LEVEL;
+    split_init(&p->split);
+    p->nblocks = 1;
+    if (p->options.threads > 1) {
+        p->pool = threadpool_create(p->options.threads);
+        if (!p->pool) {
+            ecm_packer_destroy(p);
+            return NULL;
+        }
+        p->nblocks = p->options.threads;
+    }
+    p->blocks = blocks_create(p->nblocks);
+    if (!p->blocks || !buf_reserve(&p->out, 4)) {
+        ecm_packer_destroy(p);
+        return NULL;
+    }
+    memcpy(p->out.data, "ECMZ", 4);
+    p->out.len = 4;
+    return p;
+}
+
+void ecm_packer_destroy(struct ecm_packer *pk) {
+    if (!pk) return;
+    threadpool_destroy(pk->pool);
+    blocks_destroy(pk->blocks, pk->nblocks);
+    free(pk->out.data);
+    free(pk);
+}
+
+static void pack_task(void *arg, unsigned index) {
+    struct ecm_packer *p = arg;
+    struct pack_block *b = p->blocks + index / STREAM_COUNT;
+    unsigned s = index % STREAM_COUNT;
+    b->error[s] = ECM_OK;
+    b->packed[s].len = 0;
+    if (b->raw[s].len) b->error[s] = pack_compress(b->raw + s, b->packed + s, p->options.level);
+}
+
+/* Compress the first n blocks and queue them for output */
+static void pack_flush(struct ecm_packer *p, unsigned n) {
+    unsigned i, s;
+    threadpool_run(p->pool, pack_task, p, n * STREAM_COUNT);
+    for (i = 0; (i < n) && !p->status; i++) {
+        struct pack_block *b = p->blocks + i;
+        size_t total = BLOCK_HEADER;
+        for (s = 0; s < STREAM_COUNT; s++) {
+            if (b->error[s] && !p->status) p->status = b->error[s];
+            total += b->packed[s].len;
+        }
+        if (p->status) break;
+        if (!buf_reserve(&p->out, total)) {
+            p->status = ECM_ERROR_MEMORY;
+            break;
+        }
+        for (s = 0; s < STREAM_COUNT; s++) {
+            put_le32(p->out.data + p->out.len + 8 * s, b->raw[s].len);
+            put_le32(p->out.data + p->out.len + 8 * s + 4, b->packed[s].len);
+        }
+        p->out.len += BLOCK_HEADER;
+        for (s = 0; s < STREAM_COUNT; s++) {
+            if (b->packed[s].len) memcpy(p->out.data + p->out.len, b->packed[s].data, b->packed[s].len);
+            p->out.len += b->packed[s].len;
+            b->raw[s].len = 0;
+        }
+    }
+    p->current = 0;
+    p->current_len = 0;
+}
+
+size_t ecm_packer_push(struct ecm_packer *pk, const void *buf, size_t len) {
+    const unsigned char *in = buf;
+    size_t used = 0;
+    if (pk->status || pk->finished || (pk->outpos < pk->out.len)) return 0;
+    while (used < len) {
+        struct pack_block *b = pk->blocks + pk->current;
+        int stream;
+        size_t n = split_next(&pk->split, &stream);
+        struct pack_buf *raw = b->raw + stream;
+        if (n > len - used) n = len - used;
+        if (n > ECM_PACK_BLOCK - pk->current_len) n = ECM_PACK_BLOCK - pk->current_len;
+        if (!buf_reserve(raw, n)) {
+            pk->status = ECM_ERROR_MEMORY;
+            break;
+        }
+        if (stream == STREAM_ADDRESS) {
+            size_t i;
+            for (i = 0; i < n; i++) {
+                raw->data[raw->len + i] = in[used + i] - pk->split.predicted[pk->split.pos + i];
+            }
+        } else {
+            memcpy(raw->data + raw->len, in + used, n);
+        }
+        raw->len += n;
+        split_advance(&pk->split, in + used, n);
+        used += n;
+        pk->current_len += n;
+        if (pk->current_len == ECM_PACK_BLOCK) {
+            pk->current_len = 0;
+            if (++pk->current == pk->nblocks) {
+                pack_flush(pk, pk->nblocks);
+                break;
+            }
+        }
+    }
+    pk->in_bytes += used;
+    return used;
+}
+
+void ecm_packer_finish(struct ecm_packer *pk) {
+    pk->finished = 1;
+}
+
+size_t ecm_packer_pull(struct ecm_packer *pk, void *buf, size_t len) {
+    size_t n;
+    if (pk->status < 0) return 0;
+    if (pk->finished && !pk->ended && (pk->outpos == pk->out.len)) {
+        pk->outpos = 0;
+        pk->out.len = 0;
+        pack_flush(pk, pk->current + (pk->current_len != 0));
+        /* End marker: a block with every size zero */
+        if (!pk->status) {
+            if (buf_reserve(&pk->out, BLOCK_HEADER)) {
+                memset(pk->out.data + pk->out.len, 0, BLOCK_HEADER);
+                pk->out.len += BLOCK_HEADER;
+            } else {
+                pk->status = ECM_ERROR_MEMORY;
+            }
+        }
+        pk->ended = 1;
+        if (pk->status) return 0;
+    }
+    n = pk->out.len - pk->outpos;
+    if (n > len) n = len;
+    memcpy(buf, pk->out.data + pk->outpos, n);
+    pk->outpos += n;
+    pk->out_bytes += n;
+    if (pk->outpos == pk->out.len) {
+        pk->outpos = 0;
+        pk->out.len = 0;
+        if (pk->ended) pk->status = ECM_DONE;
+    }
+    return n;
+}
+
+int ecm_packer_status(const struct ecm_packer *pk) {
+    return pk->status;
+}
+
+void ecm_packer_stats(const struct ecm_packer *pk, struct ecm_pack_stats *stats) {
+    stats->in_bytes = pk->in_bytes;
+    stats->out_bytes = pk->out_bytes;
+}
+
+/***************************************************************************/
+/*
+** Unpacker: container in, ECM stream out.  Whole blocks are collected from
+** the input, as many as the pool has threads; they are decompressed
+** together and then joined back into the ECM stream in order.
+*/
+
+struct ecm_unpacker {
+    struct ecm_pack_options options;
+    struct threadpool *pool;
+    struct split_state split;
+    struct pack_block *blocks;
+    unsigned nblocks;
+    /* Container input not unpacked yet; blocks[0, ready) start at or after head */
+    struct pack_buf in;
+    size_t head;
+    size_t scan;          /* Where the next block header is expected */
+    unsigned ready;
+    int started;
+    int seen_end;
+    int finished;
+    int status;
+    struct pack_buf out;
+    size_t outpos;
+    unsigned long long in_bytes;
+    unsigned long long out_bytes;
+};
+
+struct ecm_unpacker *ecm_unpacker_create(const struct ecm_pack_options *options) {
+    struct ecm_unpacker *u = calloc(1, sizeof(*u));
+    if (!u) return NULL;
+    if (options) u->options = *options;
+    split_init(&u->split);
+    u->nblocks = 1;
+    if (u->options.threads > 1) {
+        u->pool = threadpool_create(u->options.threads);
+        if (!u->pool) {
+            ecm_unpacker_destroy(u);
+            return NULL;
+        }
+        u->nblocks = u->options.threads;
+    }
+    u->blocks = blocks_create(u->nblocks);
+    if (!u->blocks) {
+        ecm_unpacker_destroy(u);
+        return NULL;
+    }
+    return u;
+}
+
+void ecm_unpacker_destroy(struct ecm_unpacker *up) {
+    if (!up) return;
+    threadpool_destroy(up->pool);
+    blocks_destroy(up->blocks, up->nblocks);
+    free(up->in.data);
+    free(up->out.data);
+    free(up);
+}
+
+/* Find the complete blocks in the input, up to nblocks of them */
+static void unpack_scan(struct ecm_unpacker *u) {
+    if (!u->started) {
+        if (u->in.len < 4) return;
+        if (memcmp(u->in.data, "ECMZ", 4)) {
+            u->status = ECM_ERROR_HEADER;
+            return;
+        }
+        u->started = 1;
+        u->scan = 4;
+    }
+    while (!u->seen_end && (u->ready < u->nblocks)) {
+        struct pack_block *b = u->blocks + u->ready;
+        const unsigned char *p = u->in.data + u->scan;
+        size_t rawtotal = 0;
+        size_t total = BLOCK_HEADER;
+        unsigned s;
+        if (u->in.len - u->scan < BLOCK_HEADER) return;
+        for (s = 0; s < STREAM_COUNT; s++) {
+            b->rawsize[s] = get_le32(p + 8 * s);
+            b->packedsize[s] = get_le32(p + 8 * s + 4);
+            if (
+                    (!b->rawsize[s] != !b->packedsize[s]) ||
+                    (b->rawsize[s] > ECM_PACK_BLOCK) ||
+                    (b->packedsize[s] > pack_bound(ECM_PACK_BLOCK))
+                    ) {
+                u->status = ECM_ERROR_CORRUPT;
+                return;
+            }
+            rawtotal += b->rawsize[s];
+            total += b->packedsize[s];
+        }
+        if (rawtotal > ECM_PACK_BLOCK) {
+            u->status = ECM_ERROR_CORRUPT;
+            return;
+        }
+        if (!rawtotal) {
+            u->scan += BLOCK_HEADER;
+            u->seen_end = 1;
+            return;
+        }
+        if (u->in.len - u->scan < total) return;
+        b->offset = u->scan + BLOCK_HEADER;
+        u->scan += total;
+        u->ready++;
+    }
+}
+
+static void unpack_task(void *arg, unsigned index) {
+    struct ecm_unpacker *u = arg;
+    struct pack_block *b = u->blocks + index / STREAM_COUNT;
+    unsigned s = index % STREAM_COUNT;
+    size_t offset = b->offset;
+    unsigned i;
+    for (i = 0; i < s; i++) offset += b->packedsize[i];
+    b->error[s] = ECM_OK;
+    b->raw[s].len = 0;
+    if (b->rawsize[s]) {
+        b->error[s] = pack_decompress(u->in.data + offset, b->packedsize[s], b->raw + s, b->rawsize[s]);
+    }
+}
+
+/* Put the ECM stream of one decompressed block back together */
+static int unpack_join(struct ecm_unpacker *u, struct pack_block *b) {
+    size_t pos[STREAM_COUNT] = {0};
+    size_t left = 0;
+    unsigned s;
+    for (s = 0; s < STREAM_COUNT; s++) left += b->raw[s].len;
+    if (!buf_reserve(&u->out, left)) return ECM_ERROR_MEMORY;
+    while (left) {
+        int stream;
+        size_t n = split_next(&u->split, &stream);
+        size_t have = b->raw[stream].len - pos[stream];
+        const unsigned char *src = b->raw[stream].data + pos[stream];
+        unsigned char *dst = u->out.data + u->out.len;
+        /* Streams that don't run out together weren't split from one ECM stream */
+        if (!have) return ECM_ERROR_CORRUPT;
+        if (n > have) n = have;
+        if (stream == STREAM_ADDRESS) {
+            size_t i;
+            for (i = 0; i < n; i++) dst[i] = src[i] + u->split.predicted[u->split.pos + i];
+        } else {
+            memcpy(dst, src, n);
+        }
+        split_advance(&u->split, dst, n);
+        pos[stream] += n;
+        u->out.len += n;
+        left -= n;
+    }
+    return ECM_OK;
+}
+
+static void unpack_flush(struct ecm_unpacker *u) {
+    unsigned i, s;
+    threadpool_run(u->pool, unpack_task, u, u->ready * STREAM_COUNT);
+    for (i = 0; (i < u->ready) && !u->status; i++) {
+        for (s = 0; s < STREAM_COUNT; s++) {
+            if (u->blocks[i].error[s] && !u->status) u->status = u->blocks[i].error[s];
+        }
+        if (!u->status) u->status = unpack_join(u, u->blocks + i);
+    }
+    u->ready = 0;
+    /* Drop the input that has been unpacked */
+    memmove(u->in.data, u->in.data + u->scan, u->in.len - u->scan);
+    u->in.len -= u->scan;
+    u->scan = 0;
+}
+
+size_t ecm_unpacker_push(struct ecm_unpacker *up, const void *buf, size_t len) {
+    if (up->seen_end) return len;
+    if (up->status || up->finished || (up->ready == up->nblocks) || !len) return 0;
+    if (!buf_reserve(&up->in, len)) {
+        up->status = ECM_ERROR_MEMORY;
+        return 0;
+    }
+    memcpy(up->in.data + up->in.len, buf, len);
+    up->in.len += len;
+    up->in_bytes += len;
+    unpack_scan(up);
+    return len;
+}
+
+void ecm_unpacker_finish(struct ecm_unpacker *up) {
+    up->finished = 1;
+}
+
+size_t ecm_unpacker_pull(struct ecm_unpacker *up, void *buf, size_t len) {
+    size_t n;
+    if (up->status < 0) return 0;
+    if ((up->outpos == up->out.len) && up->ready &&
+        ((up->ready == up->nblocks) || up->seen_end || up->finished)) {
+        up->outpos = 0;
+        up->out.len = 0;
+        unpack_flush(up);
+        if (!up->status) unpack_scan(up);
+        if (up->status) return 0;
+    }
+    n = up->out.len - up->outpos;
+    if (n > len) n = len;
+    if (n) memcpy(buf, up->out.data + up->outpos, n);
+    up->outpos += n;
+    up->out_bytes += n;
+    if ((up->outpos == up->out.len) && !up->ready) {
+        if (up->seen_end) {
+            up->status = ECM_DONE;
+        } else if (up->finished) {
+            up->status = up->started ? ECM_ERROR_TRUNCATED : ECM_ERROR_HEADER;
+        }
+    }
+    return n;
+}
+
+int ecm_unpacker_status(const struct ecm_unpacker *up) {
+    return up->status;
+}
+
+void ecm_unpacker_stats(const struct ecm_unpacker *up, struct ecm_pack_stats *stats) {
+    stats->in_bytes = up->in_bytes;
+    stats->out_bytes = up->out_bytes;
+}
@@ -0,0 +1,970 @@
+/***************************************************************************/
+/*
+** libecm decoder
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "eccedc.h"
+#include "ecmformat.h"
+#include "stopwatch.h"
+#include "threadpool.h"
+#include "unecm.h"
+
+/***************************************************************************/
+/*
+** Compute EDC for a block
+*/
+static void edc_computeblock(
+        const ecc_uint8 *src,
+        ecc_uint16 size,
+        ecc_uint8 *dest
+) {
+    ecc_uint32 edc = edc_partial_computeblock(0, src, size);
+    dest[0] = (edc >> 0) & 0xFF;
+    dest[1] = (edc >> 8) & 0xFF;
+    dest[2] = (edc >> 16) & 0xFF;
+    dest[3] = (edc >> 24) & 0xFF;
+}
+
+/***************************************************************************/
+/*
+** Generate ECC P and Q codes for a block; data is sector + 0x10
+*/
+static void ecc_generate(
+        const ecc_uint8 *address,
+        ecc_uint8 *data
+) {
+    /* Compute ECC P code */
+    ecc_compute_p(address, data, data + 0x80C);
+    /* Compute ECC Q code */
+    ecc_compute_q(address, data, data + 0x8B8);
+}
+
+/***************************************************************************/
+/*
+** Generate ECC/EDC information for a Mode 2 sector body (the 2336 bytes from
+** sector offset 0x10)
+*/
+static void eccedc_generate_mode2(ecc_uint8 *body, int type) {
+    switch (type) {
+        case 2: /* Mode 2 form 1 */
+            /* Compute EDC */
+            edc_computeblock(body, 0x808, body + 0x808);
+            /* Generate ECC P/Q codes */
+            ecc_generate(NULL, body);
+            break;
+        case 3: /* Mode 2 form 2 */
+            /* Compute EDC */
+            edc_computeblock(body, 0x91C, body + 0x91C);
+            break;
+    }
+}
+
+/*
+** Generate ECC/EDC information for one unit of a record type: a whole
+** 2352-byte sector for types 1, 4 and 5, a 2336-byte body for types 2, 3,
+** 6 and 7
+*/
+static void eccedc_generate(ecc_uint8 *unit, int type) {
+    switch (type) {
+        case 1: /* Mode 1 */
+        case 4:
+        case 5:
+            /* Compute EDC */
+            edc_computeblock(unit + 0x00, 0x810, unit + 0x810);
+            /* Write out zero bytes */
+            memset(unit + 0x814, 0, 8);
+            /* Generate ECC P/Q codes */
+            ecc_generate(unit + 0xC, unit + 0x10);
+            break;
+        case 2: /* Mode 2 form 1 */
+        case 3: /* Mode 2 form 2 */
+            eccedc_generate_mode2(unit, type);
+            break;
+        case 6:
+        case 7:
+            eccedc_generate_mode2(unit, type - 4);
+            break;
+    }
+}
+
+/*
+** The same for n contiguous units.  The EDC goes a sector at a time, and
+** the ECC of the whole run is handed to the batch kernels.
+*/
+static void eccedc_generate_batch(ecc_uint8 *sectors, size_t n, int type) {
+    size_t i;
+    switch (type) {
+        case 1:
+        case 4:
+        case 5:
+            for (i = 0; i < n; i++) {
+                ecc_uint8 *sector = sectors + i * 0x930;
+                edc_computeblock(sector, 0x810, sector + 0x810);
+                memset(sector + 0x814, 0, 8);
+            }
+            ecc_generate_batch(sectors + 0x10, 0x930, n, 1);
+            break;
+        case 2:
+        case 6:
+            for (i = 0; i < n; i++) edc_computeblock(sectors + i * 0x920, 0x808, sectors + i * 0x920 + 0x808);
+            ecc_generate_batch(sectors, 0x920, n, 0);
+            break;
+        case 3:
+        case 7:
+            for (i = 0; i < n; i++) edc_computeblock(sectors + i * 0x920, 0x91C, sectors + i * 0x920 + 0x91C);
+            break;
+    }
+}
+
+/***************************************************************************/
+/*
+** Bytes each record type stores ahead of its units, per unit, and bytes
+** each unit decodes to
+*/
+static const unsigned prefix_size[8] = {0, 0, 0, 0, 3, 3, 4, 4};
+static const unsigned stored_size[8] = {1, 0x803, 0x804, 0x918, 0x800, 0, 0, 0};
+static const unsigned sector_size[8] = {1, 2352, 2336, 2336, 2352, 2352, 2336, 2336};
+
+/* How edc_sectors() sees the sectors of each record type */
+static const enum edc_sector sector_layout[8] = {
+        EDC_SECTOR_MODE1, EDC_SECTOR_MODE1, EDC_SECTOR_MODE2_FORM1, EDC_SECTOR_MODE2_FORM2,
+        EDC_SECTOR_MODE1, EDC_SECTOR_MODE1, EDC_SECTOR_MODE2_FORM1, EDC_SECTOR_MODE2_FORM2
+};
+
+/* Data of the empty sectors in types 5-7 */
+static const unsigned char empty_data[0x914];
+
+unsigned ecm_prefix_size(unsigned type) {
+    return prefix_size[type & 7];
+}
+
+unsigned ecm_stored_size(unsigned type) {
+    return stored_size[type & 7];
+}
+
+unsigned ecm_decoded_unit(unsigned type) {
+    return sector_size[type & 7];
+}
+
+void ecm_address_next(unsigned char *address) {
+    static const unsigned char last[3] = {0x99, 0x59, 0x74};
+    int i;
+    for (i = 2; i >= 0; i--) {
+        unsigned char b = address[i];
+        if (b == last[i]) {
+            address[i] = 0;
+            continue;
+        }
+        if (((b & 0x0F) <= 9) && ((b >> 4) <= 9)) address[i] = ((b & 0x0F) == 9) ? b + 7 : b + 1;
+        break;
+    }
+}
+
+/* Whether b is a BCD field below limit, and its value */
+static int bcd_value(unsigned char b, unsigned limit, unsigned *value) {
+    if (((b & 0x0F) > 9) || ((b >> 4) > 9)) return 0;
+    *value = (b >> 4) * 10 + (b & 0x0F);
+    return *value < limit;
+}
+
+static unsigned char bcd_byte(unsigned value) {
+    return (unsigned char) (((value / 10) << 4) | (value % 10));
+}
+
+void ecm_address_advance(unsigned char *address, unsigned long long n) {
+    unsigned m, s, f;
+    unsigned char before[3];
+    if (bcd_value(address[0], 100, &m) && bcd_value(address[1], 60, &s) && bcd_value(address[2], 75, &f)) {
+        /* The usual case: count frames, wrapping after 99:59:74 */
+        unsigned frame = (unsigned) (((m * 60 + s) * 75 + f + n % 450000) % 450000);
+        address[0] = bcd_byte(frame / 4500);
+        address[1] = bcd_byte(frame / 75 % 60);
+        address[2] = bcd_byte(frame % 75);
+        return;
+    }
+    /* Otherwise step, until the address settles or becomes the usual kind */
+    while (n--) {
+        memcpy(before, address, 3);
+        ecm_address_next(address);
+        if (!memcmp(before, address, 3)) return;
+        if (bcd_value(address[0], 100, &m) && bcd_value(address[1], 60, &s) && bcd_value(address[2], 75, &f)) {
+            ecm_address_advance(address, n);
+            return;
+        }
+    }
+}
+
+/* Step a record's prefix on to the next unit: types 4 and 5 count up the address */
+static void prefix_next(unsigned type, unsigned char *prefix) {
+    if ((type == 4) || (type == 5)) ecm_address_next(prefix);
+}
+
+static void prefix_advance(unsigned type, unsigned char *prefix, unsigned long long n) {
+    if ((type == 4) || (type == 5)) ecm_address_advance(prefix, n);
+}
+
+/* Lay out a Mode 1 sector from its address and data */
+static void sector_layout_mode1(const unsigned char *address, const unsigned char *data, unsigned char *sector) {
+    sector[0x00] = 0x00;
+    memset(sector + 1, 0xFF, 10);
+    sector[0x0B] = 0x00;
+    memcpy(sector + 0x00C, address, 0x003);
+    sector[0x0F] = 0x01;
+    memcpy(sector + 0x010, data, 0x800);
+}
+
+/* Lay out a Mode 2 sector body from its flags and data */
+static void sector_layout_mode2(const unsigned char *flags, const unsigned char *data, unsigned type, unsigned char *body) {
+    memcpy(body, flags, 4);
+    memcpy(body + 4, flags, 4);
+    memcpy(body + 8, data, (type == 2) ? 0x800 : 0x914);
+}
+
+/*
+** Lay out the stored bytes of one unit of a record, from the record's
+** prefix and the unit's own bytes, leaving the ECC/EDC to be generated
+*/
+static void unit_layout(unsigned type, const unsigned char *prefix, const unsigned char *src, unsigned char *sector) {
+    switch (type) {
+        case 1:
+            sector_layout_mode1(src, src + 0x003, sector);
+            break;
+        case 2:
+        case 3:
+            sector_layout_mode2(src, src + 0x004, type, sector);
+            break;
+        case 4:
+            sector_layout_mode1(prefix, src, sector);
+            break;
+        case 5:
+            sector_layout_mode1(prefix, empty_data, sector);
+            break;
+        case 6:
+        case 7:
+            sector_layout_mode2(prefix, empty_data, type - 4, sector);
+            break;
+    }
+}
+
+void ecm_sector_rebuild(unsigned type, const unsigned char *stored, unsigned char *sector) {
+    type &= 7;
+    unit_layout(type, stored, stored + prefix_size[type], sector);
+    eccedc_generate(sector, (int) type);
+}
+
+const char *ecm_status_string(int status) {
+    switch (status) {
+        case ECM_OK: return "OK";
+        case ECM_DONE: return "Done";
+        case ECM_ERROR_MEMORY: return "Out of memory";
+        case ECM_ERROR_HEADER: return "Header not found";
+        case ECM_ERROR_CORRUPT: return "Corrupt ECM file";
+        case ECM_ERROR_TRUNCATED: return "Unexpected EOF";
+        case ECM_ERROR_EDC: return "EDC error";
+        case ECM_ERROR_SPACE: return "Output buffer too small";
+        case ECM_ERROR_STATE: return "Invalid call";
+        case ECM_ERROR_UNSUPPORTED: return "Not supported by this build";
+        case ECM_ERROR_IO: return "Temporary file error";
+    }
+    return "Unknown error";
+}
+
+/*
+** Parse a type/count combo from the avail bytes at p, in the given format
+** version.  Returns the number of bytes used, 0 if more are needed, or -1
+** if it is malformed.
+*/
+static int parse_type_count(const unsigned char *p, size_t avail, int version, unsigned *type, unsigned *num) {
+    size_t i = 0;
+    int bits = version ? 4 : 5;
+    int c;
+    if (!avail) return 0;
+    c = p[i++];
+    if (version) {
+        *type = c & 7;
+        *num = (c >> 3) & 0x0F;
+    } else {
+        *type = c & 3;
+        *num = (c >> 2) & 0x1F;
+    }
+    while (c & 0x80) {
+        if (i == avail) return 0;
+        if (i == 5) return -1;
+        c = p[i++];
+        *num |= ((unsigned) (c & 0x7F)) << bits;
+        bits += 7;
+    }
+    return (int) i;
+}
+
+/***************************************************************************/
+/*
+** Decoder context
+*/
+
+#define ECM_DECODER_BUFFER 0x40000
+/* Larger with a pool, so each pull has enough sectors to spread around */
+#define ECM_DECODER_BUFFER_THREADED 0x400000
+/* ecm_decoder_decode() input copied at a time to finish a cut-off unit: one header and unit */
+#define ECM_DECODER_TOPUP 0x920
+
+/*
+** Sectors are rebuilt in items of up to DECODE_ITEM_SECTORS, and handed to
+** the pool up to DECODE_BATCH items at a time.  Streaming decode only uses
+** the pool for runs of at least DECODE_MIN_SECTORS.
+*/
+#define DECODE_ITEM_SECTORS 32
+#define DECODE_BATCH 1024
+#define DECODE_MIN_SECTORS 8
+
+/*
+** A run of units of one record type to rebuild from src into dst.  The EDC
+** of each item starts from 0, and is folded into the running EDC with
+** edc_combine() once the batch is done, in file order.
+*/
+struct decode_item {
+    const unsigned char *src;
+    unsigned char *dst;
+    unsigned type;
+    unsigned count;
+    unsigned edc;
+    unsigned char prefix[4];   /* The record prefix, as of the first unit */
+};
+
+/*
+** Move a rebuilt Mode 1 sector to another address.  Only the header, the
+** EDC and the parity that depends on them change, so they are patched
+** rather than generated again.
+*/
+static void sector_readdress(unsigned char *sector, const unsigned char *address) {
+    unsigned char delta[8];
+    ecc_uint32 edc;
+    delta[0] = sector[0x00C] ^ address[0];
+    delta[1] = sector[0x00D] ^ address[1];
+    delta[2] = sector[0x00E] ^ address[2];
+    delta[3] = 0;
+    edc = edc_mode1_address_delta(delta);
+    delta[4] = (edc >> 0) & 0xFF;
+    delta[5] = (edc >> 8) & 0xFF;
+    delta[6] = (edc >> 16) & 0xFF;
+    delta[7] = (edc >> 24) & 0xFF;
+    ecc_patch(sector, delta);
+}
+
+/*
+** The sectors of a record of type 5-7 all have the same data, so one is
+** rebuilt as a template and the rest are copied from it: those of types 6
+** and 7 are identical, and so is their EDC, and those of type 5 are moved
+** to their own addresses.  Returns the EDC of the template.
+*/
+static unsigned empty_build(unsigned type, const unsigned char *prefix, unsigned char *sector) {
+    unit_layout(type, prefix, NULL, sector);
+    eccedc_generate(sector, (int) type);
+    return edc_sectors(0, sector, 1, sector_layout[type]);
+}
+
+/* Copy n sectors from the template, the first at prefix, and continue edc over them */
+static unsigned empty_copy(
+        unsigned type,
+        const unsigned char *sector,
+        unsigned sectoredc,
+        unsigned char *prefix,
+        unsigned char *dst,
+        size_t n,
+        unsigned edc
+) {
+    size_t size = sector_size[type];
+    size_t i;
+    for (i = 0; i < n; i++) {
+        unsigned char *d = dst + i * size;
+        memcpy(d, sector, size);
+        if (type == 5) {
+            sector_readdress(d, prefix);
+            ecm_address_next(prefix);
+            edc = edc_sectors(edc, d, 1, EDC_SECTOR_MODE1);
+        } else {
+            edc = edc_combine(edc, sectoredc, size);
+        }
+    }
+    return edc;
+}
+
+static void decode_item_run(void *arg, unsigned index) {
+    struct decode_item *item = (struct decode_item *) arg + index;
+    size_t size = sector_size[item->type];
+    const unsigned char *src = item->src;
+    unsigned char *dst = item->dst;
+    unsigned char prefix[4];
+    unsigned i;
+    if (!item->type) {
+        memcpy(dst, src, item->count);
+        item->edc = edc_partial_computeblock(0, dst, item->count);
+        return;
+    }
+    memcpy(prefix, item->prefix, 4);
+    if (item->type >= 5) {
+        unsigned sectoredc = empty_build(item->type, prefix, dst);
+        prefix_next(item->type, prefix);
+        item->edc = empty_copy(item->type, dst, sectoredc, prefix, dst + size, item->count - 1, sectoredc);
+        return;
+    }
+    for (i = 0; i < item->count; i++) {
+        unit_layout(item->type, prefix, src, dst + i * size);
+        prefix_next(item->type, prefix);
+        src += stored_size[item->type];
+    }
+    eccedc_generate_batch(dst, item->count, (int) item->type);
+    item->edc = edc_sectors(0, dst, item->count, sector_layout[item->type]);
+}
+
+enum {
+    DECODE_MAGIC,
+    DECODE_RECORD,
+    DECODE_PREFIX,
+    DECODE_DATA,
+    DECODE_EDC,
+    DECODE_END
+};
+
+struct ecm_decoder {
+    struct ecm_decoder_options options;
+    struct threadpool *pool;
+    struct decode_item *items;
+    /* Pushed input not decoded yet */
+    unsigned char *buffer;
+    size_t bufsize;
+    size_t head;
+    size_t tail;
+    int stage;
+    int version;
+    int finished;
+    int started;
+    int status;
+    /* Record being decoded, and its prefix as of the next unit */
+    unsigned type;
+    unsigned remaining;
+    unsigned char prefix[4];
+    /* Template for the units of a record of type 5-7 */
+    unsigned char empty[2352];
+    unsigned empty_edc;
+    /* Decoded sector that didn't fit in the caller's buffer */
+    unsigned char sector[2352];
+    size_t sectorpos;
+    size_t sectorlen;
+    unsigned edc;
+    unsigned stored_edc;
+    unsigned long long in_bytes;
+    unsigned long long out_bytes;
+    unsigned long long progress_next;
+    unsigned long long count[8];
+    /* Time in the decoder calls so far, and when the current one started */
+    double run_seconds;
+    double run_start;
+};
+
+void ecm_decoder_stats(const struct ecm_decoder *dec, struct ecm_decoder_stats *stats) {
+    stats->in_bytes = dec->in_bytes;
+    stats->out_bytes = dec->out_bytes;
+    stats->edc = dec->edc;
+    stats->stored_edc = dec->stored_edc;
+    memcpy(stats->count, dec->count, sizeof(stats->count));
+    stats->decode_seconds = dec->run_seconds;
+    if (dec->run_start) stats->decode_seconds += stopwatch_now() - dec->run_start;
+}
+
+static void decoder_progress(struct ecm_decoder *d) {
+    struct ecm_decoder_stats stats;
+    double start;
+    if (!d->options.progress || (d->in_bytes < d->progress_next)) return;
+    d->progress_next = d->in_bytes + ECM_PROGRESS_STEP;
+    ecm_decoder_stats(d, &stats);
+    start = stopwatch_now();
+    d->options.progress(d->options.opaque, &stats);
+    /* The callback's own time isn't the decoder's */
+    if (d->run_start) d->run_start += stopwatch_now() - start;
+}
+
+static void decoder_clock_start(struct ecm_decoder *d) {
+    d->run_start = stopwatch_now();
+}
+
+static void decoder_clock_stop(struct ecm_decoder *d) {
+    d->run_seconds += stopwatch_now() - d->run_start;
+    d->run_start = 0;
+}
+
+/* Run the first n items and fold their EDCs in, in order */
+static void decoder_run_items(struct ecm_decoder *d, unsigned n) {
+    unsigned i;
+    threadpool_run(d->pool, decode_item_run, d->items, n);
+    for (i = 0; i < n; i++) {
+        const struct decode_item *item = d->items + i;
+        d->edc = edc_combine(d->edc, item->edc, (unsigned long long) item->count * sector_size[item->type]);
+    }
+}
+
+static int decoder_alloc_items(struct ecm_decoder *d) {
+    if (!d->items) d->items = malloc(DECODE_BATCH * sizeof(*d->items));
+    return d->items != NULL;
+}
+
+static int decoder_check_edc(struct ecm_decoder *d, const unsigned char *p) {
+    d->stored_edc = p[0] | ((unsigned) p[1] << 8) | ((unsigned) p[2] << 16) | ((unsigned) p[3] << 24);
+    d->in_bytes += 4;
+    d->stage = DECODE_END;
+    if (d->options.progress) {
+        d->progress_next = 0;
+        decoder_progress(d);
+    }
+    return (d->stored_edc == d->edc) ? ECM_DONE : ECM_ERROR_EDC;
+}
+
+struct ecm_decoder *ecm_decoder_create(const struct ecm_decoder_options *options) {
+    struct ecm_decoder *d = calloc(1, sizeof(*d));
+    if (!d) return NULL;
+    eccedc_init();
+    if (options) d->options = *options;
+    d->edc = d->options.edc;
+    d->bufsize = ECM_DECODER_BUFFER;
+    if (d->options.threads > 1) {
+        d->pool = threadpool_create(d->options.threads);
+        if (!d->pool || !decoder_alloc_items(d)) {
+            ecm_decoder_destroy(d);
+            return NULL;
+        }
+        d->bufsize = ECM_DECODER_BUFFER_THREADED;
+    }
+    return d;
+}
+
+void ecm_decoder_destroy(struct ecm_decoder *dec) {
+    if (!dec) return;
+    threadpool_destroy(dec->pool);
+    free(dec->items);
+    free(dec->buffer);
+    free(dec);
+}
+
+static int decoder_buffer(struct ecm_decoder *dec) {
+    if (!dec->buffer) {
+        dec->buffer = malloc(dec->bufsize);
+        if (!dec->buffer) {
+            dec->status = ECM_ERROR_MEMORY;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+size_t ecm_decoder_push(struct ecm_decoder *dec, const void *buf, size_t len) {
+    size_t n;
+    dec->started = 1;
+    if (dec->stage == DECODE_END) return len;
+    if (dec->status || dec->finished || !decoder_buffer(dec)) return 0;
+    if ((len > dec->bufsize - dec->tail) && dec->head) {
+        memmove(dec->buffer, dec->buffer + dec->head, dec->tail - dec->head);
+        dec->tail -= dec->head;
+        dec->head = 0;
+    }
+    n = dec->bufsize - dec->tail;
+    if (n > len) n = len;
+    memcpy(dec->buffer + dec->tail, buf, n);
+    dec->tail += n;
+    return n;
+}
+
+void ecm_decoder_finish(struct ecm_decoder *dec) {
+    dec->finished = 1;
+}
+
+/*
+** Decode from the input in[*head, tail) into out, which has room for len
+** bytes, moving *head past what was used.  Returns the bytes produced.
+*/
+static size_t decoder_run(
+        struct ecm_decoder *dec,
+        const unsigned char *in,
+        size_t *head,
+        size_t tail,
+        unsigned char *out,
+        size_t len
+) {
+    size_t produced = 0;
+    while ((produced < len) && (dec->sectorpos < dec->sectorlen)) {
+        size_t n = dec->sectorlen - dec->sectorpos;
+        if (n > len) n = len;
+        memcpy(out, dec->sector + dec->sectorpos, n);
+        dec->sectorpos += n;
+        produced += n;
+    }
+    while ((produced < len) && !dec->status) {
+        const unsigned char *p = in + *head;
+        size_t avail = tail - *head;
+        int used;
+        if (dec->stage == DECODE_MAGIC) {
+            if (avail < 4) break;
+            if (memcmp(p, "ECM", 3) || (p[3] > ECM_FORMAT_VERSION)) {
+                dec->status = ECM_ERROR_HEADER;
+                break;
+            }
+            dec->version = p[3];
+            *head += 4;
+            dec->in_bytes += 4;
+            dec->stage = DECODE_RECORD;
+        } else if (dec->stage == DECODE_RECORD) {
+            used = parse_type_count(p, avail, dec->version, &dec->type, &dec->remaining);
+            if (used < 0) dec->status = ECM_ERROR_CORRUPT;
+            if (used <= 0) break;
+            *head += used;
+            dec->in_bytes += used;
+            if (dec->remaining == 0xFFFFFFFF) {
+                dec->stage = DECODE_EDC;
+                continue;
+            }
+            dec->remaining++;
+            if ((dec->remaining >= 0x80000000) || (dec->type >= ECM_RECORD_TYPES(dec->version))) {
+                dec->status = ECM_ERROR_CORRUPT;
+                break;
+            }
+            dec->count[dec->type] += dec->remaining;
+            if (dec->options.record) dec->options.record(dec->options.opaque, dec->type, dec->out_bytes, dec->remaining);
+            dec->stage = prefix_size[dec->type] ? DECODE_PREFIX : DECODE_DATA;
+        } else if (dec->stage == DECODE_PREFIX) {
+            size_t n = prefix_size[dec->type];
+            if (avail < n) break;
+            memcpy(dec->prefix, p, n);
+            if (dec->type >= 5) dec->empty_edc = empty_build(dec->type, dec->prefix, dec->empty);
+            *head += n;
+            dec->in_bytes += n;
+            dec->stage = DECODE_DATA;
+        } else if (dec->stage == DECODE_DATA) {
+            size_t size = sector_size[dec->type];
+            if (!dec->type) {
+                size_t n = dec->remaining;
+                if (n > avail) n = avail;
+                if (n > len - produced) n = len - produced;
+                if (!n) break;
+                memcpy(out + produced, p, n);
+                dec->edc = edc_partial_computeblock(dec->edc, p, n);
+                *head += n;
+                dec->in_bytes += n;
+                dec->remaining -= n;
+                produced += n;
+                dec->out_bytes += n;
+            } else if ((dec->type >= 5) && (len - produced >= size)) {
+                /* Copies of the template; no need for the pool */
+                size_t n = dec->remaining;
+                if (n > (len - produced) / size) n = (len - produced) / size;
+                dec->edc = empty_copy(
+                        dec->type, dec->empty, dec->empty_edc, dec->prefix,
+                        out + produced, n, dec->edc
+                );
+                dec->remaining -= (unsigned) n;
+                dec->out_bytes += n * size;
+                produced += n * size;
+            } else if (dec->pool && (len - produced >= DECODE_MIN_SECTORS * size) &&
+                       (avail >= DECODE_MIN_SECTORS * stored_size[dec->type]) &&
+                       (dec->remaining >= DECODE_MIN_SECTORS)) {
+                /* Enough whole sectors on hand to share them out */
+                size_t n = dec->remaining;
+                unsigned per, items, i;
+                if (stored_size[dec->type] && (n > avail / stored_size[dec->type])) {
+                    n = avail / stored_size[dec->type];
+                }
+                if (n > (len - produced) / size) n = (len - produced) / size;
+                per = (unsigned) (n / (threadpool_size(dec->pool) * 4));
+                if (per < 1) per = 1;
+                if (per > DECODE_ITEM_SECTORS) per = DECODE_ITEM_SECTORS;
+                if (n > (size_t) per * DECODE_BATCH) n = (size_t) per * DECODE_BATCH;
+                items = (unsigned) ((n + per - 1) / per);
+                for (i = 0; i < items; i++) {
+                    struct decode_item *item = dec->items + i;
+                    item->src = p + (size_t) i * per * stored_size[dec->type];
+                    item->dst = out + produced + (size_t) i * per * size;
+                    item->type = dec->type;
+                    item->count = (i == items - 1) ? (unsigned) (n - (size_t) i * per) : per;
+                    memcpy(item->prefix, dec->prefix, 4);
+                    prefix_advance(dec->type, dec->prefix, item->count);
+                }
+                decoder_run_items(dec, items);
+                *head += n * stored_size[dec->type];
+                dec->in_bytes += n * stored_size[dec->type];
+                dec->remaining -= (unsigned) n;
+                dec->out_bytes += n * size;
+                produced += n * size;
+            } else if (!dec->pool && (len - produced >= 2 * size) &&
+                       (avail >= 2 * stored_size[dec->type]) && (dec->remaining >= 2)) {
+                /* A run of whole sectors on hand, for the batch ECC */
+                struct decode_item item;
+                size_t n = dec->remaining;
+                if (n > avail / stored_size[dec->type]) n = avail / stored_size[dec->type];
+                if (n > (len - produced) / size) n = (len - produced) / size;
+                if (n > DECODE_ITEM_SECTORS) n = DECODE_ITEM_SECTORS;
+                item.src = p;
+                item.dst = out + produced;
+                item.type = dec->type;
+                item.count = (unsigned) n;
+                memcpy(item.prefix, dec->prefix, 4);
+                prefix_advance(dec->type, dec->prefix, item.count);
+                decode_item_run(&item, 0);
+                dec->edc = edc_combine(dec->edc, item.edc, (unsigned long long) n * size);
+                *head += n * stored_size[dec->type];
+                dec->in_bytes += n * stored_size[dec->type];
+                dec->remaining -= (unsigned) n;
+                dec->out_bytes += n * size;
+                produced += n * size;
+            } else {
+                unsigned char *sector = (len - produced >= size) ? out + produced : dec->sector;
+                if (avail < stored_size[dec->type]) break;
+                unit_layout(dec->type, dec->prefix, p, sector);
+                eccedc_generate(sector, (int) dec->type);
+                prefix_next(dec->type, dec->prefix);
+                dec->edc = edc_sectors(dec->edc, sector, 1, sector_layout[dec->type]);
+                *head += stored_size[dec->type];
+                dec->in_bytes += stored_size[dec->type];
+                dec->remaining--;
+                dec->out_bytes += size;
+                if (sector == dec->sector) {
+                    dec->sectorpos = len - produced;
+                    dec->sectorlen = size;
+                    memcpy(out + produced, sector, dec->sectorpos);
+                    produced = len;
+                } else {
+                    produced += size;
+                }
+            }
+            if (!dec->remaining) dec->stage = DECODE_RECORD;
+        } else if (dec->stage == DECODE_EDC) {
+            if (avail < 4) break;
+            dec->status = decoder_check_edc(dec, p);
+            *head += 4;
+        } else {
+            break;
+        }
+    }
+    return produced;
+}
+
+/* Out of input with nothing more coming */
+static void decoder_check_end(struct ecm_decoder *dec, size_t produced, size_t len) {
+    if (!dec->status && dec->finished && (produced < len) && (dec->stage != DECODE_END)) {
+        dec->status = (dec->stage == DECODE_MAGIC) ? ECM_ERROR_HEADER : ECM_ERROR_TRUNCATED;
+    }
+}
+
+size_t ecm_decoder_pull(struct ecm_decoder *dec, void *buf, size_t len) {
+    size_t produced;
+    decoder_clock_start(dec);
+    produced = decoder_run(dec, dec->buffer, &dec->head, dec->tail, buf, len);
+    if (dec->head == dec->tail) {
+        dec->head = 0;
+        dec->tail = 0;
+    }
+    decoder_check_end(dec, produced, len);
+    decoder_progress(dec);
+    decoder_clock_stop(dec);
+    return produced;
+}
+
+size_t ecm_decoder_decode(
+        struct ecm_decoder *dec,
+        const void *in,
+        size_t inlen,
+        size_t *used,
+        void *out,
+        size_t outlen
+) {
+    const unsigned char *src = in;
+    unsigned char *dst = out;
+    size_t produced = 0;
+    size_t head = 0;
+    *used = 0;
+    dec->started = 1;
+    decoder_clock_start(dec);
+    if (dec->tail > dec->head) {
+        /*
+        ** Finish what is waiting in the decoder's buffer with a little of
+        ** the new input; whatever of that is left over afterwards is taken
+        ** back, and stays the caller's
+        */
+        size_t n = (inlen < ECM_DECODER_TOPUP) ? inlen : ECM_DECODER_TOPUP;
+        size_t left;
+        if (dec->head) {
+            memmove(dec->buffer, dec->buffer + dec->head, dec->tail - dec->head);
+            dec->tail -= dec->head;
+            dec->head = 0;
+        }
+        if (n > dec->bufsize - dec->tail) n = dec->bufsize - dec->tail;
+        memcpy(dec->buffer + dec->tail, src, n);
+        dec->tail += n;
+        produced = decoder_run(dec, dec->buffer, &dec->head, dec->tail, dst, outlen);
+        left = dec->tail - dec->head;
+        if (left <= n) {
+            head = n - left;
+            dec->head = 0;
+            dec->tail = 0;
+        } else {
+            head = n;
+        }
+    }
+    if ((dec->tail == dec->head) && (produced < outlen)) {
+        produced += decoder_run(dec, src, &head, inlen, dst + produced, outlen - produced);
+        /* A header or unit cut off by the end of the input waits in the decoder's buffer */
+        if ((produced < outlen) && !dec->status && (inlen - head <= dec->bufsize) && decoder_buffer(dec)) {
+            memcpy(dec->buffer, src + head, inlen - head);
+            dec->head = 0;
+            dec->tail = inlen - head;
+            head = inlen;
+        }
+    }
+    /* Anything after the file EDC is ignored */
+    *used = (dec->stage == DECODE_END) ? inlen : head;
+    decoder_check_end(dec, produced, outlen);
+    decoder_progress(dec);
+    decoder_clock_stop(dec);
+    return produced;
+}
+
+int ecm_decoder_status(const struct ecm_decoder *dec) {
+    return dec->status;
+}
+
+/***************************************************************************/
+/*
+** Decode an ECM file held in memory.  With out == NULL, only walk the
+** records and set *outlen to the size of the decoded data, so the output
+** can be sized before anything is written; otherwise decode straight into
+** out.  Decoding walks the record headers and queues the data as items,
+** which are rebuilt a batch at a time (on the pool, if there is one).
+*/
+static int decode_memory(
+        struct ecm_decoder *d,
+        const unsigned char *in,
+        size_t insize,
+        unsigned char *out,
+        size_t outsize,
+        unsigned long long *outlen
+) {
+    const unsigned char *p = in;
+    const unsigned char *end = in + insize;
+    unsigned long long pos = 0;
+    unsigned nitems = 0;
+    unsigned char prefix[4] = {0};
+    unsigned type;
+    unsigned num;
+    int version;
+    int r = ECM_OK;
+    if ((insize < 4) || memcmp(in, "ECM", 3) || (in[3] > ECM_FORMAT_VERSION)) return ECM_ERROR_HEADER;
+    if (out && !decoder_alloc_items(d)) return ECM_ERROR_MEMORY;
+    version = in[3];
+    p += 4;
+    for (;;) {
+        int used = parse_type_count(p, end - p, version, &type, &num);
+        if (used <= 0) {
+            r = used ? ECM_ERROR_CORRUPT : ECM_ERROR_TRUNCATED;
+            break;
+        }
+        p += used;
+        if (num == 0xFFFFFFFF) break;
+        num++;
+        if ((num >= 0x80000000) || (type >= ECM_RECORD_TYPES(version))) {
+            r = ECM_ERROR_CORRUPT;
+            break;
+        }
+        if ((size_t) (end - p) < prefix_size[type]) {
+            r = ECM_ERROR_TRUNCATED;
+            break;
+        }
+        d->count[type] += num;
+        if (out && d->options.record) d->options.record(d->options.opaque, type, pos, num);
+        memcpy(prefix, p, prefix_size[type]);
+        p += prefix_size[type];
+        if (stored_size[type] && ((size_t) (end - p) / stored_size[type] < num)) {
+            r = ECM_ERROR_TRUNCATED;
+            break;
+        }
+        if (!out) {
+            p += (size_t) num * stored_size[type];
+            pos += (unsigned long long) num * sector_size[type];
+            continue;
+        }
+        if ((unsigned long long) num * sector_size[type] > outsize - pos) {
+            r = ECM_ERROR_SPACE;
+            break;
+        }
+        while (num) {
+            struct decode_item *item = d->items + nitems++;
+            unsigned n = type ? DECODE_ITEM_SECTORS : DECODE_ITEM_SECTORS * 2352;
+            if (n > num) n = num;
+            item->src = p;
+            item->dst = out + pos;
+            item->type = type;
+            item->count = n;
+            memcpy(item->prefix, prefix, 4);
+            prefix_advance(type, prefix, n);
+            p += (size_t) n * stored_size[type];
+            pos += (unsigned long long) n * sector_size[type];
+            num -= n;
+            if (nitems == DECODE_BATCH) {
+                decoder_run_items(d, nitems);
+                nitems = 0;
+                d->in_bytes = p - in;
+                d->out_bytes = pos;
+                decoder_progress(d);
+            }
+        }
+    }
+    /* Whatever was queued before an error still gets written out */
+    if (nitems) decoder_run_items(d, nitems);
+    if (r) return r;
+    if (end - p < 4) return ECM_ERROR_TRUNCATED;
+    *outlen = pos;
+    if (!out) return ECM_OK;
+    d->in_bytes = p - in;
+    d->out_bytes = pos;
+    return decoder_check_edc(d, p);
+}
+
+int ecm_decoded_size(const void *in, size_t len, unsigned long long *size) {
+    struct ecm_decoder d;
+    memset(&d, 0, sizeof(d));
+    return decode_memory(&d, in, len, NULL, 0, size);
+}
+
+int ecm_decoder_decode_buffer(
+        struct ecm_decoder *dec,
+        const void *in,
+        size_t len,
+        void *out,
+        size_t outsize,
+        size_t *outlen
+) {
+    unsigned long long size = 0;
+    /* An empty image decodes to a NULL buffer, which would mean "size only" */
+    static unsigned char empty;
+    if (dec->started || dec->status) return dec->status = ECM_ERROR_STATE;
+    dec->started = 1;
+    decoder_clock_start(dec);
+    dec->status = decode_memory(dec, in, len, out ? out : &empty, outsize, &size);
+    decoder_clock_stop(dec);
+    *outlen = (size_t) size;
+    return dec->status;
+}
@@ -0,0 +1,744 @@
+/***************************************************************************/
+/*
+** ECC engine shared by the ECM tools
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+/*
+** The P and Q codes are computed over "major" columns of the sector,
+** each one an independent chain of minor_count steps:
+**
+**     a = f(a ^ byte), b ^= byte         f = multiply by alpha in GF(2^8)
+**
+** followed by a multiply by 1/(1+alpha).  The vector engines run many
+** majors side by side, one per byte lane: f is a shift and a conditional
+** xor, and the final constant multiply is two nibble table lookups.
+**
+** P majors are consecutive bytes of each row, so rows can be loaded
+** directly.  Q majors walk diagonals through the sector; their bytes are
+** first gathered into a row-major staging block so that each Q row becomes
+** one contiguous load as well.
+**
+** For runs of sectors, the x86 engines can instead give each sector a byte
+** lane (see ecc_generate_batch()).  The sectors are transposed 16 bytes at
+** a time, so that row r of a lane-major block holds byte r of every
+** sector, and every major, P or Q, is then a walk down rows of that block:
+** the diagonals are just row numbers, and no lanes are left over.
+*/
+/***************************************************************************/
+
+#include <string.h>
+#include "eccedc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ECC_HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define ECC_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/***************************************************************************/
+
+/* LUTs used for computing ECC */
+static ecc_uint8 ecc_f_lut[256];
+static ecc_uint8 ecc_b_lut[256];
+
+/* ecc_b_lut split into low and high nibble halves for the vector engines */
+static ecc_uint8 ecc_b_nib[2][16];
+
+static void ecc_compute_p_scalar(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *p);
+static void ecc_compute_q_scalar(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *q);
+
+static void (*ecc_p_impl)(const ecc_uint8 *, const ecc_uint8 *, ecc_uint8 *) = ecc_compute_p_scalar;
+static void (*ecc_q_impl)(const ecc_uint8 *, const ecc_uint8 *, ecc_uint8 *) = ecc_compute_q_scalar;
+
+/*
+** Lane-major batches: rows of the block (header and data, then P parity,
+** then Q parity, padded to whole 16-row transposes), and the parity
+** transposed back out for each sector
+*/
+#define ECC_BATCH_ROWS 2352
+#define ECC_BATCH_PARITY 288
+
+typedef void (*ecc_lanes_fn)(const ecc_uint8 *const *head, const ecc_uint8 *const *data,
+                             ecc_uint8 (*parity)[ECC_BATCH_PARITY]);
+
+/* How many sectors the engine's batch kernel takes at once, if it has one */
+static ecc_lanes_fn ecc_lanes_impl;
+static ecc_uint32 ecc_lanes;
+static enum ecc_engine ecc_current = ECC_ENGINE_SCALAR;
+
+/***************************************************************************/
+/*
+** Compute ECC for a block (can do either P or Q)
+*/
+static void ecc_computeblock(
+        const ecc_uint8 *src,
+        ecc_uint32 major_count,
+        ecc_uint32 minor_count,
+        ecc_uint32 major_mult,
+        ecc_uint32 minor_inc,
+        ecc_uint8 *dest
+) {
+    ecc_uint32 size = major_count * minor_count;
+    ecc_uint32 major, minor;
+    for (major = 0; major < major_count; major++) {
+        ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
+        ecc_uint8 ecc_a = 0;
+        ecc_uint8 ecc_b = 0;
+        for (minor = 0; minor < minor_count; minor++) {
+            ecc_uint8 temp = src[index];
+            index += minor_inc;
+            if (index >= size) index -= size;
+            ecc_a ^= temp;
+            ecc_b ^= temp;
+            ecc_a = ecc_f_lut[ecc_a];
+        }
+        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
+        dest[major] = ecc_a;
+        dest[major + major_count] = ecc_a ^ ecc_b;
+    }
+}
+
+/* Lay the header and data out contiguously, as ecc_computeblock() wants */
+static void ecc_gather(
+        const ecc_uint8 *address,
+        const ecc_uint8 *data,
+        size_t size,
+        ecc_uint8 *buf
+) {
+    if (address) memcpy(buf, address, 4);
+    else memset(buf, 0, 4);
+    memcpy(buf + 4, data, size);
+}
+
+static void ecc_compute_p_scalar(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *p) {
+    ecc_uint8 buf[4 + 2060];
+    ecc_gather(address, data, 2060, buf);
+    ecc_computeblock(buf, 86, 24, 2, 86, p);
+}
+
+static void ecc_compute_q_scalar(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *q) {
+    ecc_uint8 buf[4 + 2232];
+    ecc_gather(address, data, 2232, buf);
+    ecc_computeblock(buf, 52, 43, 86, 88, q);
+}
+
+/***************************************************************************/
+/*
+** Row layout shared by the vector engines
+*/
+
+#if defined(ECC_HAVE_X86) || defined(ECC_HAVE_NEON)
+
+/* The first P row starts with the header, the rest come straight from data */
+static void ecc_p_row0(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *row) {
+    ecc_gather(address, data, 86 - 4, row);
+}
+
+#define ecc_p_row(row0, data, k) ((k) ? (data) + 86 * (k) - 4 : (row0))
+
+/*
+** Gather the Q diagonals into rows.  Viewing the header-plus-data block as
+** 26 rows of 43 16-bit words, step k of Q major pair j reads word k of row
+** (j + k) mod 26; row k of the staging block therefore holds column k of
+** that matrix, rotated so that lane pair j lines up with major pair j.
+*/
+#define ECC_Q_STRIDE 64
+
+static void ecc_q_stage(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *stage) {
+    static const ecc_uint8 zero[4];
+    const ecc_uint8 *header = address ? address : zero;
+    ecc_uint32 j, k, r;
+    for (k = 0; k < 43; k++) {
+        ecc_uint8 *row = stage + k * ECC_Q_STRIDE;
+        ecc_uint32 first = k % 26;
+        if (k < 2) {
+            /* Word k of row 0 comes from the header */
+            for (j = 0; j < 26; j++) {
+                r = (j + first) % 26;
+                if (r) memcpy(row + 2 * j, data + (86 * r + 2 * k - 4), 2);
+                else memcpy(row + 2 * j, header + 2 * k, 2);
+            }
+            continue;
+        }
+        for (j = 0, r = first; r < 26; j++, r++) memcpy(row + 2 * j, data + (86 * r + 2 * k - 4), 2);
+        for (r = 0; j < 26; j++, r++) memcpy(row + 2 * j, data + (86 * r + 2 * k - 4), 2);
+    }
+}
+
+/*
+** Lane offsets covering all majors; the last block overlaps the one before
+** it rather than running past the end
+*/
+static const ecc_uint32 ecc_p_lanes16[6] = {0, 16, 32, 48, 64, 70};
+static const ecc_uint32 ecc_q_lanes16[4] = {0, 16, 32, 36};
+static const ecc_uint32 ecc_p_lanes32[3] = {0, 32, 54};
+static const ecc_uint32 ecc_q_lanes32[2] = {0, 20};
+
+#endif
+
+/***************************************************************************/
+
+#if defined(ECC_HAVE_X86)
+
+#define ECC_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define ECC_TARGET_AVX2 __attribute__((target("avx2")))
+
+/* Multiply every lane by alpha */
+static inline ECC_TARGET_SSSE3 __m128i ecc_mulx_ssse3(__m128i v) {
+    __m128i carry = _mm_cmpgt_epi8(_mm_setzero_si128(), v);
+    return _mm_xor_si128(_mm_add_epi8(v, v), _mm_and_si128(carry, _mm_set1_epi8(0x1D)));
+}
+
+/* Finish a block of majors and store both halves of the parity */
+static inline ECC_TARGET_SSSE3 void ecc_finish_ssse3(
+        __m128i a,
+        __m128i b,
+        ecc_uint8 *dest,
+        ecc_uint32 major_count
+) {
+    __m128i lo = _mm_loadu_si128((const __m128i *) ecc_b_nib[0]);
+    __m128i hi = _mm_loadu_si128((const __m128i *) ecc_b_nib[1]);
+    __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i y = _mm_xor_si128(ecc_mulx_ssse3(a), b);
+    a = _mm_xor_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(y, mask)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(y, 4), mask))
+    );
+    _mm_storeu_si128((__m128i *) dest, a);
+    _mm_storeu_si128((__m128i *) (dest + major_count), _mm_xor_si128(a, b));
+}
+
+ECC_TARGET_SSSE3
+static void ecc_compute_p_ssse3(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *p) {
+    ecc_uint8 row0[86];
+    ecc_uint32 i, k;
+    ecc_p_row0(address, data, row0);
+    for (i = 0; i < 6; i++) {
+        ecc_uint32 lane = ecc_p_lanes16[i];
+        __m128i a = _mm_setzero_si128();
+        __m128i b = _mm_setzero_si128();
+        for (k = 0; k < 24; k++) {
+            __m128i t = _mm_loadu_si128((const __m128i *) (ecc_p_row(row0, data, k) + lane));
+            a = ecc_mulx_ssse3(_mm_xor_si128(a, t));
+            b = _mm_xor_si128(b, t);
+        }
+        ecc_finish_ssse3(a, b, p + lane, 86);
+    }
+}
+
+ECC_TARGET_SSSE3
+static void ecc_compute_q_ssse3(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *q) {
+    ecc_uint8 stage[43 * ECC_Q_STRIDE];
+    ecc_uint32 i, k;
+    ecc_q_stage(address, data, stage);
+    for (i = 0; i < 4; i++) {
+        ecc_uint32 lane = ecc_q_lanes16[i];
+        __m128i a = _mm_setzero_si128();
+        __m128i b = _mm_setzero_si128();
+        for (k = 0; k < 43; k++) {
+            __m128i t = _mm_loadu_si128((const __m128i *) (stage + k * ECC_Q_STRIDE + lane));
+            a = ecc_mulx_ssse3(_mm_xor_si128(a, t));
+            b = _mm_xor_si128(b, t);
+        }
+        ecc_finish_ssse3(a, b, q + lane, 52);
+    }
+}
+
+static inline ECC_TARGET_AVX2 __m256i ecc_mulx_avx2(__m256i v) {
+    __m256i carry = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+    return _mm256_xor_si256(_mm256_add_epi8(v, v), _mm256_and_si256(carry, _mm256_set1_epi8(0x1D)));
+}
+
+static inline ECC_TARGET_AVX2 void ecc_finish_avx2(
+        __m256i a,
+        __m256i b,
+        ecc_uint8 *dest,
+        ecc_uint32 major_count
+) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) ecc_b_nib[0]));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) ecc_b_nib[1]));
+    __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256i y = _mm256_xor_si256(ecc_mulx_avx2(a), b);
+    a = _mm256_xor_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(y, mask)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(y, 4), mask))
+    );
+    _mm256_storeu_si256((__m256i *) dest, a);
+    _mm256_storeu_si256((__m256i *) (dest + major_count), _mm256_xor_si256(a, b));
+}
+
+ECC_TARGET_AVX2
+static void ecc_compute_p_avx2(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *p) {
+    ecc_uint8 row0[86];
+    ecc_uint32 i, k;
+    ecc_p_row0(address, data, row0);
+    for (i = 0; i < 3; i++) {
+        ecc_uint32 lane = ecc_p_lanes32[i];
+        __m256i a = _mm256_setzero_si256();
+        __m256i b = _mm256_setzero_si256();
+        for (k = 0; k < 24; k++) {
+            __m256i t = _mm256_loadu_si256((const __m256i *) (ecc_p_row(row0, data, k) + lane));
+            a = ecc_mulx_avx2(_mm256_xor_si256(a, t));
+            b = _mm256_xor_si256(b, t);
+        }
+        ecc_finish_avx2(a, b, p + lane, 86);
+    }
+}
+
+ECC_TARGET_AVX2
+static void ecc_compute_q_avx2(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *q) {
+    ecc_uint8 stage[43 * ECC_Q_STRIDE];
+    ecc_uint32 i, k;
+    ecc_q_stage(address, data, stage);
+    for (i = 0; i < 2; i++) {
+        ecc_uint32 lane = ecc_q_lanes32[i];
+        __m256i a = _mm256_setzero_si256();
+        __m256i b = _mm256_setzero_si256();
+        for (k = 0; k < 43; k++) {
+            __m256i t = _mm256_loadu_si256((const __m256i *) (stage + k * ECC_Q_STRIDE + lane));
+            a = ecc_mulx_avx2(_mm256_xor_si256(a, t));
+            b = _mm256_xor_si256(b, t);
+        }
+        ecc_finish_avx2(a, b, q + lane, 52);
+    }
+}
+
+/*
+** Lane-major batch kernels.  head[i] is the first 16 bytes of sector i's
+** block (its header and the start of its data); the rest comes from
+** data[i], from offset 12 on.  Row r of the block is rows[r].
+*/
+
+/* Transpose 16 rows of 16 bytes (in each 128-bit half, for AVX2) */
+#define ECC_TRANSPOSE(v, t, lo, hi) do { \
+        ecc_uint32 round_, k_; \
+        for (round_ = 0; round_ < 4; round_++) { \
+            for (k_ = 0; k_ < 8; k_++) { \
+                (t)[2 * k_] = lo((v)[k_], (v)[k_ + 8]); \
+                (t)[2 * k_ + 1] = hi((v)[k_], (v)[k_ + 8]); \
+            } \
+            memcpy((v), (t), sizeof(t)); \
+        } \
+    } while (0)
+
+ECC_TARGET_SSSE3
+static void ecc_lanes_ssse3(const ecc_uint8 *const *head, const ecc_uint8 *const *data,
+                            ecc_uint8 (*parity)[ECC_BATCH_PARITY]) {
+    __m128i rows[ECC_BATCH_ROWS];
+    __m128i v[16], t[16];
+    ecc_uint32 c, i, k, m;
+    for (c = 0; c < 129; c++) {
+        for (i = 0; i < 16; i++) {
+            v[i] = _mm_loadu_si128((const __m128i *) (c ? data[i] + 16 * c - 4 : head[i]));
+        }
+        ECC_TRANSPOSE(v, t, _mm_unpacklo_epi8, _mm_unpackhi_epi8);
+        memcpy(rows + 16 * c, v, sizeof(v));
+    }
+    for (m = 0; m < 86; m++) {
+        __m128i a = _mm_setzero_si128();
+        __m128i b = _mm_setzero_si128();
+        for (k = 0; k < 24; k++) {
+            __m128i x = rows[m + 86 * k];
+            a = ecc_mulx_ssse3(_mm_xor_si128(a, x));
+            b = _mm_xor_si128(b, x);
+        }
+        ecc_finish_ssse3(a, b, (ecc_uint8 *) (rows + 2064 + m), 86 * sizeof(__m128i));
+    }
+    for (m = 0; m < 52; m++) {
+        ecc_uint32 index = (m >> 1) * 86 + (m & 1);
+        __m128i a = _mm_setzero_si128();
+        __m128i b = _mm_setzero_si128();
+        for (k = 0; k < 43; k++) {
+            __m128i x = rows[index];
+            a = ecc_mulx_ssse3(_mm_xor_si128(a, x));
+            b = _mm_xor_si128(b, x);
+            index += 88;
+            if (index >= 2236) index -= 2236;
+        }
+        ecc_finish_ssse3(a, b, (ecc_uint8 *) (rows + 2236 + m), 52 * sizeof(__m128i));
+    }
+    for (i = 2340; i < ECC_BATCH_ROWS; i++) rows[i] = _mm_setzero_si128();
+    for (c = 0; c < ECC_BATCH_PARITY / 16; c++) {
+        memcpy(v, rows + 2064 + 16 * c, sizeof(v));
+        ECC_TRANSPOSE(v, t, _mm_unpacklo_epi8, _mm_unpackhi_epi8);
+        for (i = 0; i < 16; i++) _mm_storeu_si128((__m128i *) (parity[i] + 16 * c), v[i]);
+    }
+}
+
+/* Two 16-lane batches side by side, one in each 128-bit half */
+ECC_TARGET_AVX2
+static void ecc_lanes_avx2(const ecc_uint8 *const *head, const ecc_uint8 *const *data,
+                           ecc_uint8 (*parity)[ECC_BATCH_PARITY]) {
+    __m256i rows[ECC_BATCH_ROWS];
+    __m256i v[16], t[16];
+    ecc_uint32 c, i, k, m;
+    for (c = 0; c < 129; c++) {
+        for (i = 0; i < 16; i++) {
+            const ecc_uint8 *lo = c ? data[i] + 16 * c - 4 : head[i];
+            const ecc_uint8 *hi = c ? data[i + 16] + 16 * c - 4 : head[i + 16];
+            v[i] = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) lo)),
+                    _mm_loadu_si128((const __m128i *) hi), 1);
+        }
+        ECC_TRANSPOSE(v, t, _mm256_unpacklo_epi8, _mm256_unpackhi_epi8);
+        memcpy(rows + 16 * c, v, sizeof(v));
+    }
+    for (m = 0; m < 86; m++) {
+        __m256i a = _mm256_setzero_si256();
+        __m256i b = _mm256_setzero_si256();
+        for (k = 0; k < 24; k++) {
+            __m256i x = rows[m + 86 * k];
+            a = ecc_mulx_avx2(_mm256_xor_si256(a, x));
+            b = _mm256_xor_si256(b, x);
+        }
+        ecc_finish_avx2(a, b, (ecc_uint8 *) (rows + 2064 + m), 86 * sizeof(__m256i));
+    }
+    for (m = 0; m < 52; m++) {
+        ecc_uint32 index = (m >> 1) * 86 + (m & 1);
+        __m256i a = _mm256_setzero_si256();
+        __m256i b = _mm256_setzero_si256();
+        for (k = 0; k < 43; k++) {
+            __m256i x = rows[index];
+            a = ecc_mulx_avx2(_mm256_xor_si256(a, x));
+            b = _mm256_xor_si256(b, x);
+            index += 88;
+            if (index >= 2236) index -= 2236;
+        }
+        ecc_finish_avx2(a, b, (ecc_uint8 *) (rows + 2236 + m), 52 * sizeof(__m256i));
+    }
+    for (i = 2340; i < ECC_BATCH_ROWS; i++) rows[i] = _mm256_setzero_si256();
+    for (c = 0; c < ECC_BATCH_PARITY / 16; c++) {
+        memcpy(v, rows + 2064 + 16 * c, sizeof(v));
+        ECC_TRANSPOSE(v, t, _mm256_unpacklo_epi8, _mm256_unpackhi_epi8);
+        for (i = 0; i < 16; i++) {
+            _mm_storeu_si128((__m128i *) (parity[i] + 16 * c), _mm256_castsi256_si128(v[i]));
+            _mm_storeu_si128((__m128i *) (parity[i + 16] + 16 * c), _mm256_extracti128_si256(v[i], 1));
+        }
+    }
+}
+
+static int ecc_supported(enum ecc_engine engine) {
+    __builtin_cpu_init();
+    switch (engine) {
+        case ECC_ENGINE_SSSE3:
+            return __builtin_cpu_supports("ssse3");
+        case ECC_ENGINE_AVX2:
+            return __builtin_cpu_supports("avx2");
+        default:
+            return 0;
+    }
+}
+
+#elif defined(ECC_HAVE_NEON)
+
+static inline uint8x16_t ecc_mulx_neon(uint8x16_t v) {
+    uint8x16_t carry = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7));
+    return veorq_u8(vshlq_n_u8(v, 1), vandq_u8(carry, vdupq_n_u8(0x1D)));
+}
+
+static inline void ecc_finish_neon(
+        uint8x16_t a,
+        uint8x16_t b,
+        ecc_uint8 *dest,
+        ecc_uint32 major_count
+) {
+    uint8x16_t lo = vld1q_u8(ecc_b_nib[0]);
+    uint8x16_t hi = vld1q_u8(ecc_b_nib[1]);
+    uint8x16_t y = veorq_u8(ecc_mulx_neon(a), b);
+    a = veorq_u8(
+            vqtbl1q_u8(lo, vandq_u8(y, vdupq_n_u8(0x0F))),
+            vqtbl1q_u8(hi, vshrq_n_u8(y, 4))
+    );
+    vst1q_u8(dest, a);
+    vst1q_u8(dest + major_count, veorq_u8(a, b));
+}
+
+static void ecc_compute_p_neon(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *p) {
+    ecc_uint8 row0[86];
+    ecc_uint32 i, k;
+    ecc_p_row0(address, data, row0);
+    for (i = 0; i < 6; i++) {
+        ecc_uint32 lane = ecc_p_lanes16[i];
+        uint8x16_t a = vdupq_n_u8(0);
+        uint8x16_t b = vdupq_n_u8(0);
+        for (k = 0; k < 24; k++) {
+            uint8x16_t t = vld1q_u8(ecc_p_row(row0, data, k) + lane);
+            a = ecc_mulx_neon(veorq_u8(a, t));
+            b = veorq_u8(b, t);
+        }
+        ecc_finish_neon(a, b, p + lane, 86);
+    }
+}
+
+static void ecc_compute_q_neon(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *q) {
+    ecc_uint8 stage[43 * ECC_Q_STRIDE];
+    ecc_uint32 i, k;
+    ecc_q_stage(address, data, stage);
+    for (i = 0; i < 4; i++) {
+        ecc_uint32 lane = ecc_q_lanes16[i];
+        uint8x16_t a = vdupq_n_u8(0);
+        uint8x16_t b = vdupq_n_u8(0);
+        for (k = 0; k < 43; k++) {
+            uint8x16_t t = vld1q_u8(stage + k * ECC_Q_STRIDE + lane);
+            a = ecc_mulx_neon(veorq_u8(a, t));
+            b = veorq_u8(b, t);
+        }
+        ecc_finish_neon(a, b, q + lane, 52);
+    }
+}
+
+static int ecc_supported(enum ecc_engine engine) {
+    return engine == ECC_ENGINE_NEON;
+}
+
+#else
+
+static int ecc_supported(enum ecc_engine engine) {
+    (void) engine;
+    return 0;
+}
+
+#endif
+
+/***************************************************************************/
+/*
+** Incremental ECC.  P and Q are linear: xoring delta into one byte of the
+** block they cover xors each parity byte with a fixed multiple of delta,
+** and only a few of those multiples are nonzero (two from the byte's P
+** major, two from its Q major, and the Q bytes that the changed P bytes
+** feed).  ecc_patch_init() finds them for each byte ecc_patch() can change
+** and tabulates every multiple.
+*/
+#define ECC_PATCH_BYTES 8
+#define ECC_PATCH_TERMS 8
+
+/* Offsets of the patchable bytes from sector offset 0xC: header, then EDC */
+static const ecc_uint16 ecc_patch_offset[ECC_PATCH_BYTES] = {
+        0x000, 0x001, 0x002, 0x003, 0x804, 0x805, 0x806, 0x807
+};
+
+static ecc_uint8 ecc_patch_count[ECC_PATCH_BYTES];
+static ecc_uint16 ecc_patch_parity[ECC_PATCH_BYTES][ECC_PATCH_TERMS];  /* From offset 0x81C */
+static ecc_uint8 ecc_patch_mult[ECC_PATCH_BYTES][ECC_PATCH_TERMS][256];
+
+static void ecc_patch_init(void) {
+    ecc_uint8 sector[2352];
+    ecc_uint32 i, j, k, v;
+    memset(sector, 0, sizeof(sector));
+    for (i = 0; i < ECC_PATCH_BYTES; i++) {
+        ecc_uint8 *byte = sector + 0xC + ecc_patch_offset[i];
+        ecc_uint8 *parity = sector + 0x81C;
+        /* The parity of a block that is all zero but for a 1 */
+        *byte = 1;
+        ecc_compute_p_scalar(sector + 0xC, sector + 0x10, parity);
+        ecc_compute_q_scalar(sector + 0xC, sector + 0x10, parity + 172);
+        *byte = 0;
+        for (j = 0; j < 276; j++) {
+            ecc_uint8 m = parity[j];
+            if (!m) continue;
+            k = ecc_patch_count[i]++;
+            ecc_patch_parity[i][k] = (ecc_uint16) j;
+            /* Multiples of m, built up a bit at a time */
+            ecc_patch_mult[i][k][0] = 0;
+            for (v = 1; v < 256; v <<= 1) {
+                ecc_uint32 u;
+                for (u = 0; u < v; u++) ecc_patch_mult[i][k][v + u] = ecc_patch_mult[i][k][u] ^ m;
+                m = ecc_f_lut[m];
+            }
+            parity[j] = 0;
+        }
+    }
+}
+
+void ecc_patch(ecc_uint8 *sector, const ecc_uint8 *delta) {
+    ecc_uint32 i, k;
+    for (i = 0; i < ECC_PATCH_BYTES; i++) {
+        ecc_uint8 d = delta[i];
+        if (!d) continue;
+        sector[0xC + ecc_patch_offset[i]] ^= d;
+        for (k = 0; k < ecc_patch_count[i]; k++) {
+            sector[0x81C + ecc_patch_parity[i][k]] ^= ecc_patch_mult[i][k][d];
+        }
+    }
+}
+
+/***************************************************************************/
+
+void ecc_init(void) {
+    ecc_uint32 i, j;
+    for (i = 0; i < 256; i++) {
+        j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
+        ecc_f_lut[i] = j;
+        ecc_b_lut[i ^ j] = i;
+    }
+    for (i = 0; i < 16; i++) {
+        ecc_b_nib[0][i] = ecc_b_lut[i];
+        ecc_b_nib[1][i] = ecc_b_lut[i << 4];
+    }
+    ecc_patch_init();
+    if (!ecc_select(ECC_ENGINE_AVX2) && !ecc_select(ECC_ENGINE_SSSE3) && !ecc_select(ECC_ENGINE_NEON)) {
+        ecc_select(ECC_ENGINE_SCALAR);
+    }
+}
+
+int ecc_select(enum ecc_engine engine) {
+    if ((engine != ECC_ENGINE_SCALAR) && !ecc_supported(engine)) return 0;
+    switch (engine) {
+        case ECC_ENGINE_SCALAR:
+            ecc_p_impl = ecc_compute_p_scalar;
+            ecc_q_impl = ecc_compute_q_scalar;
+            ecc_lanes_impl = NULL;
+            break;
+#if defined(ECC_HAVE_X86)
+        case ECC_ENGINE_SSSE3:
+            ecc_p_impl = ecc_compute_p_ssse3;
+            ecc_q_impl = ecc_compute_q_ssse3;
+            ecc_lanes_impl = ecc_lanes_ssse3;
+            ecc_lanes = 16;
+            break;
+        case ECC_ENGINE_AVX2:
+            ecc_p_impl = ecc_compute_p_avx2;
+            ecc_q_impl = ecc_compute_q_avx2;
+            ecc_lanes_impl = ecc_lanes_avx2;
+            ecc_lanes = 32;
+            break;
+#elif defined(ECC_HAVE_NEON)
+        case ECC_ENGINE_NEON:
+            ecc_p_impl = ecc_compute_p_neon;
+            ecc_q_impl = ecc_compute_q_neon;
+            ecc_lanes_impl = NULL;
+            break;
+#endif
+        default:
+            return 0;
+    }
+    ecc_current = engine;
+    return 1;
+}
+
+enum ecc_engine ecc_selected(void) {
+    return ecc_current;
+}
+
+const char *ecc_engine_name(enum ecc_engine engine) {
+    switch (engine) {
+        case ECC_ENGINE_SCALAR:
+            return "scalar";
+        case ECC_ENGINE_SSSE3:
+            return "ssse3";
+        case ECC_ENGINE_AVX2:
+            return "avx2";
+        case ECC_ENGINE_NEON:
+            return "neon";
+    }
+    return "unknown";
+}
+
+/***************************************************************************/
+
+void ecc_compute_p(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *p) {
+    ecc_p_impl(address, data, p);
+}
+
+void ecc_compute_q(const ecc_uint8 *address, const ecc_uint8 *data, ecc_uint8 *q) {
+    ecc_q_impl(address, data, q);
+}
+
+int ecc_verify(const ecc_uint8 *address, const ecc_uint8 *data) {
+    ecc_uint8 ecc[172];
+    ecc_compute_p(address, data, ecc);
+    if (memcmp(ecc, data + 0x80C, 172)) return 0;
+    ecc_compute_q(address, data, ecc);
+    return !memcmp(ecc, data + 0x8B8, 104);
+}
+
+/*
+** Fewest sectors worth a batch kernel call; for fewer, the lanes left idle
+** cost more than the sector at a time loop
+*/
+#define ECC_BATCH_MIN 4
+
+/*
+** Generate (or with verify, check) the parity of n sectors; returns how
+** many from the first have it right when verifying
+*/
+static size_t ecc_batch(ecc_uint8 *data, size_t stride, size_t n, int address, int verify) {
+    ecc_uint8 head[32][16];
+    ecc_uint8 parity[32][ECC_BATCH_PARITY];
+    const ecc_uint8 *headp[32];
+    const ecc_uint8 *datap[32];
+    size_t done = 0;
+    while (done < n) {
+        size_t count = n - done;
+        ecc_uint32 lanes = ecc_lanes;
+        ecc_lanes_fn lanes_impl = ecc_lanes_impl;
+        ecc_uint32 i;
+        if (!lanes_impl || (count < ECC_BATCH_MIN)) break;
+#if defined(ECC_HAVE_X86)
+        /* Not enough for both halves of an AVX2 batch */
+        if ((lanes == 32) && (count <= 16)) {
+            lanes_impl = ecc_lanes_ssse3;
+            lanes = 16;
+        }
+#endif
+        if (count > lanes) count = lanes;
+        /* Spare lanes repeat the last sector */
+        for (i = 0; i < lanes; i++) {
+            const ecc_uint8 *d = data + (done + ((i < count) ? i : count - 1)) * stride;
+            if (address) {
+                memcpy(head[i], d - 4, 16);
+            } else {
+                memset(head[i], 0, 4);
+                memcpy(head[i] + 4, d, 12);
+            }
+            headp[i] = head[i];
+            datap[i] = d;
+        }
+        lanes_impl(headp, datap, parity);
+        for (i = 0; i < count; i++) {
+            ecc_uint8 *d = data + (done + i) * stride;
+            if (!verify) memcpy(d + 0x80C, parity[i], 276);
+            else if (memcmp(d + 0x80C, parity[i], 276)) return done + i;
+        }
+        done += count;
+    }
+    for (; done < n; done++) {
+        ecc_uint8 *d = data + done * stride;
+        const ecc_uint8 *a = address ? d - 4 : NULL;
+        if (verify) {
+            if (!ecc_verify(a, d)) break;
+        } else {
+            ecc_compute_p(a, d, d + 0x80C);
+            ecc_compute_q(a, d, d + 0x8B8);
+        }
+    }
+    return done;
+}
+
+void ecc_generate_batch(ecc_uint8 *data, size_t stride, size_t n, int address) {
+    ecc_batch(data, stride, n, address, 0);
+}
+
+size_t ecc_verify_batch(const ecc_uint8 *data, size_t stride, size_t n, int address) {
+    /* Only read when verifying */
+    return ecc_batch((ecc_uint8 *) data, stride, n, address, 1);
+}
+
+/***************************************************************************/
+
+void eccedc_init(void) {
+    static int initialized;
+    if (initialized) return;
+    ecc_init();
+    edc_init();
+    initialized = 1;
+}
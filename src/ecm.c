@@ -32,6 +32,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "asyncio.h"
+#include "batch.h"
+#include "eccedc.h"
+#include "ecmformat.h"
+#include "largefile.h"
+#include "mapfile.h"
+#include "sectormap.h"
+#include "stopwatch.h"
+#include "threadpool.h"
+#include "unecm.h"
+
+#if defined(WIN32) || defined(WIN64)
+#include <fcntl.h>
+#include <io.h>
+#define strcasecmp _stricmp
+#endif
 
 /***************************************************************************/
 
@@ -44,463 +60,799 @@ void banner(void) {
 
 /***************************************************************************/
 
-/* Data types */
-#define ecc_uint8 unsigned char
-#define ecc_uint16 unsigned short
-#define ecc_uint32 unsigned
-
-/* LUTs used for computing ECC/EDC */
-static ecc_uint8 ecc_f_lut[256];
-static ecc_uint8 ecc_b_lut[256];
-static ecc_uint32 edc_lut[256];
-
-/* Init routine */
-static void eccedc_init(void) {
-    ecc_uint32 i, j, edc;
-    for (i = 0; i < 256; i++) {
-        j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
-        ecc_f_lut[i] = j;
-        ecc_b_lut[i ^ j] = i;
-        edc = i;
-        for (j = 0; j < 8; j++) edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
-        edc_lut[i] = edc;
+unsigned long long mycounter_analyze;
+unsigned long long mycounter_encode;
+unsigned long long mycounter_total;
+
+void resetcounter(unsigned long long total) {
+    mycounter_analyze = 0;
+    mycounter_encode = 0;
+    mycounter_total = total;
+}
+
+/* A total of 0 means the size isn't known, as when reading a pipe */
+static void showcounter(unsigned long long analyze, unsigned long long encode) {
+    unsigned long long a = (analyze + 64) / 128;
+    unsigned long long e = (encode + 64) / 128;
+    unsigned long long d = (mycounter_total + 64) / 128;
+    if (!mycounter_total) {
+        fprintf(stderr, "Analyzing (%lluM) Encoding (%lluM)\r", analyze >> 20, encode >> 20);
+        return;
     }
+    if (!d) d = 1;
+    fprintf(stderr, "Analyzing (%02u%%) Encoding (%02u%%)\r",
+            (unsigned) ((100 * a) / d), (unsigned) ((100 * e) / d)
+    );
+}
+
+void setcounter_analyze(unsigned long long n) {
+    if ((n >> 20) != (mycounter_analyze >> 20)) showcounter(n, mycounter_encode);
+    mycounter_analyze = n;
+}
+
+void setcounter_encode(unsigned long long n) {
+    if ((n >> 20) != (mycounter_encode >> 20)) showcounter(mycounter_analyze, n);
+    mycounter_encode = n;
 }
 
-/***************************************************************************/
 /*
-** Compute EDC for a block
+** Open a file, or standard input/output (switched to binary) for "-"
 */
-ecc_uint32 edc_computeblock(
-        ecc_uint32 edc,
-        const ecc_uint8 *src,
-        ecc_uint16 size
-) {
-    while (size--) edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
-    return edc;
+static FILE *open_stream(const char *filename, const char *mode, FILE *std) {
+    if (strcmp(filename, "-")) return fopen(filename, mode);
+#if defined(WIN32) || defined(WIN64)
+    _setmode(_fileno(std), _O_BINARY);
+#endif
+    return std;
 }
 
 /***************************************************************************/
 /*
-** Compute ECC for a block (can do either P or Q)
+** CUE sheets.  Audio tracks hold no sectors, so the encoder is told to store
+** them as they are instead of searching them byte by byte.
 */
-static int ecc_computeblock(
-        ecc_uint8 *src,
-        ecc_uint32 major_count,
-        ecc_uint32 minor_count,
-        ecc_uint32 major_mult,
-        ecc_uint32 minor_inc,
-        ecc_uint8 *dest
-) {
-    ecc_uint32 size = major_count * minor_count;
-    ecc_uint32 major, minor;
-    for (major = 0; major < major_count; major++) {
-        ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
-        ecc_uint8 ecc_a = 0;
-        ecc_uint8 ecc_b = 0;
-        for (minor = 0; minor < minor_count; minor++) {
-            ecc_uint8 temp = src[index];
-            index += minor_inc;
-            if (index >= size) index -= size;
-            ecc_a ^= temp;
-            ecc_b ^= temp;
-            ecc_a = ecc_f_lut[ecc_a];
-        }
-        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-        if (dest[major] != (ecc_a)) return 0;
-        if (dest[major + major_count] != (ecc_a ^ ecc_b)) return 0;
+
+#define CUE_MAX_TRACKS 99
+
+struct cue_track {
+    int file;             /* Which FILE of the sheet the track is in */
+    int audio;
+    unsigned sectorsize;  /* Bytes per sector in the image file */
+    long start;           /* First INDEX, in sectors from the start of the file */
+};
+
+/* The file name part of a path */
+static const char *path_base(const char *path) {
+    const char *p;
+    for (p = path; *p; p++) if ((*p == '/') || (*p == '\\')) path = p + 1;
+    return path;
+}
+
+/* Split off the next word of a line, or a "quoted string" */
+static char *cue_word(char **line) {
+    char *p = *line;
+    char *word;
+    while ((*p == ' ') || (*p == '\t')) p++;
+    if (*p == '"') {
+        word = ++p;
+        while (*p && (*p != '"')) p++;
+    } else {
+        word = p;
+        while (*p && (*p != ' ') && (*p != '\t') && (*p != '\r') && (*p != '\n')) p++;
     }
-    return 1;
+    if (*p) *p++ = 0;
+    *line = p;
+    return word;
 }
 
 /*
-** Generate ECC P and Q codes for a block
+** Read the audio tracks of imagename from a CUE sheet, as extents of the
+** image.  If the sheet names more than one FILE, only the tracks of the one
+** with the same name as the image count.  Returns the number of extents,
+** put in *extents, or -1 if the sheet can't be read.
 */
-static int ecc_generate(
-        ecc_uint8 *sector,
-        int zeroaddress,
-        ecc_uint8 *dest
-) {
-    int r;
-    ecc_uint8 address[4], i;
-    /* Save the address and zero it out */
-    if (zeroaddress)
-        for (i = 0; i < 4; i++) {
-            address[i] = sector[12 + i];
-            sector[12 + i] = 0;
+static int cue_audio(const char *cuefilename, const char *imagename, struct ecm_extent **extents) {
+    struct cue_track track[CUE_MAX_TRACKS];
+    char line[1024];
+    int ntracks = 0;
+    int nfiles = 0;
+    int file = -1;
+    int overflow = 0;
+    int i, n = 0;
+    int first = 1;
+    unsigned long long offset = 0;
+    FILE *f = fopen(cuefilename, "r");
+    *extents = NULL;
+    if (!f) {
+        perror(cuefilename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *rest = line;
+        char *word = cue_word(&rest);
+        if (!strcmp(word, "FILE")) {
+            if (!strcmp(cue_word(&rest), path_base(imagename))) file = nfiles;
+            nfiles++;
+        } else if (!strcmp(word, "TRACK") && nfiles) {
+            char *mode;
+            if (ntracks == CUE_MAX_TRACKS) {
+                overflow = 1;
+                break;
+            }
+            cue_word(&rest);
+            mode = cue_word(&rest);
+            track[ntracks].file = nfiles - 1;
+            track[ntracks].audio = !strcmp(mode, "AUDIO");
+            track[ntracks].sectorsize = strchr(mode, '/') ? (unsigned) atoi(strchr(mode, '/') + 1) : 2352;
+            if (!strcmp(mode, "CDG")) track[ntracks].sectorsize = 2448;
+            track[ntracks].start = -1;
+            ntracks++;
+        } else if (!strcmp(word, "INDEX") && ntracks && (track[ntracks - 1].start < 0)) {
+            int m, s, fr;
+            cue_word(&rest);
+            if (sscanf(cue_word(&rest), "%d:%d:%d", &m, &s, &fr) != 3) {
+                ntracks = -1;
+                break;
+            }
+            track[ntracks - 1].start = ((long) m * 60 + s) * 75 + fr;
         }
-    /* Compute ECC P code */
-    if (!(ecc_computeblock(sector + 0xC, 86, 24, 2, 86, dest + 0x81C - 0x81C))) {
-        if (zeroaddress) for (i = 0; i < 4; i++) sector[12 + i] = address[i];
+    }
+    fclose(f);
+    if ((ntracks < 0) || overflow) {
+        fprintf(stderr, "%s: can't read this CUE sheet\n", cuefilename);
+        return -1;
+    }
+    if (nfiles == 1) file = 0;
+    if (file < 0) {
+        fprintf(stderr, "%s doesn't list %s; searching every track\n", cuefilename, path_base(imagename));
         return 0;
     }
-    /* Compute ECC Q code */
-    r = ecc_computeblock(sector + 0xC, 52, 43, 86, 88, dest + 0x8C8 - 0x81C);
-    /* Restore the address */
-    if (zeroaddress) for (i = 0; i < 4; i++) sector[12 + i] = address[i];
-    return r;
+    *extents = malloc(CUE_MAX_TRACKS * sizeof(**extents));
+    if (!*extents) abort();
+    /* Tracks run on to the next one in the same file, or to its end */
+    for (i = 0; i < ntracks; i++) {
+        const struct cue_track *t = track + i;
+        const struct cue_track *next = ((i + 1 < ntracks) && (t[1].file == t->file)) ? t + 1 : NULL;
+        unsigned long long length;
+        if ((t->file != file) || (t->start < 0)) continue;
+        /* The first track of the file need not start at its beginning */
+        if (first) offset = (unsigned long long) t->start * t->sectorsize;
+        first = 0;
+        length = ~0ULL - offset;
+        if (next && (next->start >= t->start)) {
+            length = (unsigned long long) (next->start - t->start) * t->sectorsize;
+        } else {
+            next = NULL;
+        }
+        if (t->audio) {
+            if (n && ((*extents)[n - 1].offset + (*extents)[n - 1].length == offset)) {
+                (*extents)[n - 1].length += length;
+            } else {
+                (*extents)[n].offset = offset;
+                (*extents)[n].length = length;
+                n++;
+            }
+        }
+        if (!next) break;
+        offset += length;
+    }
+    return n;
 }
 
 /***************************************************************************/
-
 /*
-** sector types:
-** 00 - literal bytes
-** 01 - 2352 mode 1         predict sync, mode, reserved, edc, ecc
-** 02 - 2336 mode 2 form 1  predict redundant flags, edc, ecc
-** 03 - 2336 mode 2 form 2  predict redundant flags, edc
+** Statistics for --stats-json, one JSON object per line: one each time the
+** encoder reports progress, then a last one with "done" set.  I/O time is
+** only what the tool spends in stdio; with --mmap, reading and writing the
+** mappings shows up as encoder time instead.
 */
 
-int check_type(unsigned char *sector, int canbetype1) {
-    int canbetype2 = 1;
-    int canbetype3 = 1;
-    ecc_uint32 myedc;
-    /* Check for mode 1 */
-    if (canbetype1) {
-        if (
-                (sector[0x00] != 0x00) ||
-                (sector[0x01] != 0xFF) ||
-                (sector[0x02] != 0xFF) ||
-                (sector[0x03] != 0xFF) ||
-                (sector[0x04] != 0xFF) ||
-                (sector[0x05] != 0xFF) ||
-                (sector[0x06] != 0xFF) ||
-                (sector[0x07] != 0xFF) ||
-                (sector[0x08] != 0xFF) ||
-                (sector[0x09] != 0xFF) ||
-                (sector[0x0A] != 0xFF) ||
-                (sector[0x0B] != 0x00) ||
-                (sector[0x0F] != 0x01) ||
-                (sector[0x814] != 0x00) ||
-                (sector[0x815] != 0x00) ||
-                (sector[0x816] != 0x00) ||
-                (sector[0x817] != 0x00) ||
-                (sector[0x818] != 0x00) ||
-                (sector[0x819] != 0x00) ||
-                (sector[0x81A] != 0x00) ||
-                (sector[0x81B] != 0x00)
-                ) {
-            canbetype1 = 0;
-        }
+static FILE *statsfile;
+static double stats_start;
+static double io_seconds;
+static unsigned long long stats_total;  /* Input size, or 0 if unknown */
+
+static void stats_line(const struct ecm_encoder_stats *s, const char *status) {
+    double elapsed = stopwatch_now() - stats_start;
+    double rate = (elapsed > 0) ? (double) s->analyzed_bytes / elapsed : 0;
+    fprintf(statsfile, "{\"tool\":\"ecm\",\"done\":%s,", status ? "true" : "false");
+    if (status) fprintf(statsfile, "\"status\":\"%s\",", status);
+    fprintf(statsfile, "\"elapsed_seconds\":%.3f,", elapsed);
+    if (stats_total) {
+        fprintf(statsfile, "\"total_bytes\":%llu,", stats_total);
+    } else {
+        fprintf(statsfile, "\"total_bytes\":null,");
     }
-    /* Check for mode 2 */
-    if (
-            (sector[0x0] != sector[0x4]) ||
-            (sector[0x1] != sector[0x5]) ||
-            (sector[0x2] != sector[0x6]) ||
-            (sector[0x3] != sector[0x7])
-            ) {
-        canbetype2 = 0;
-        canbetype3 = 0;
-        if (!canbetype1) return 0;
-    }
-
-    /* Check EDC */
-    myedc = edc_computeblock(0, sector, 0x808);
-    if (canbetype2)
-        if (
-                (sector[0x808] != ((myedc >> 0) & 0xFF)) ||
-                (sector[0x809] != ((myedc >> 8) & 0xFF)) ||
-                (sector[0x80A] != ((myedc >> 16) & 0xFF)) ||
-                (sector[0x80B] != ((myedc >> 24) & 0xFF))
-                ) {
-            canbetype2 = 0;
-        }
-    myedc = edc_computeblock(myedc, sector + 0x808, 8);
-    if (canbetype1)
-        if (
-                (sector[0x810] != ((myedc >> 0) & 0xFF)) ||
-                (sector[0x811] != ((myedc >> 8) & 0xFF)) ||
-                (sector[0x812] != ((myedc >> 16) & 0xFF)) ||
-                (sector[0x813] != ((myedc >> 24) & 0xFF))
-                ) {
-            canbetype1 = 0;
-        }
-    myedc = edc_computeblock(myedc, sector + 0x810, 0x10C);
-    if (canbetype3)
-        if (
-                (sector[0x91C] != ((myedc >> 0) & 0xFF)) ||
-                (sector[0x91D] != ((myedc >> 8) & 0xFF)) ||
-                (sector[0x91E] != ((myedc >> 16) & 0xFF)) ||
-                (sector[0x91F] != ((myedc >> 24) & 0xFF))
-                ) {
-            canbetype3 = 0;
-        }
-    /* Check ECC */
-    if (canbetype1) { if (!(ecc_generate(sector, 0, sector + 0x81C))) { canbetype1 = 0; }}
-    if (canbetype2) { if (!(ecc_generate(sector - 0x10, 1, sector + 0x80C))) { canbetype2 = 0; }}
-    if (canbetype1) return 1;
-    if (canbetype2) return 2;
-    if (canbetype3) return 3;
-    return 0;
+    fprintf(statsfile,
+            "\"in_bytes\":%llu,\"analyzed_bytes\":%llu,\"encoded_bytes\":%llu,\"out_bytes\":%llu,"
+            "\"literal_bytes\":%llu,\"mode1_sectors\":%llu,\"mode2_form1_sectors\":%llu,"
+            "\"mode2_form2_sectors\":%llu,\"mb_per_second\":%.2f,",
+            s->in_bytes, s->analyzed_bytes, s->encoded_bytes, s->out_bytes,
+            s->count[0], s->count[1], s->count[2], s->count[3], rate / 1e6
+    );
+    if (stats_total && (rate > 0) && !status) {
+        fprintf(statsfile, "\"eta_seconds\":%.1f,", (double) (stats_total - s->analyzed_bytes) / rate);
+    } else {
+        fprintf(statsfile, "\"eta_seconds\":%s,", status ? "0" : "null");
+    }
+    fprintf(statsfile, "\"analyze_seconds\":%.3f,\"encode_seconds\":%.3f,\"io_seconds\":%.3f}\n",
+            s->analyze_seconds, s->encode_seconds, io_seconds
+    );
+    fflush(statsfile);
+}
+
+static void progress(void *opaque, const struct ecm_encoder_stats *stats) {
+    (void) opaque;
+    setcounter_analyze(stats->analyzed_bytes);
+    setcounter_encode(stats->encoded_bytes);
+    if (statsfile) stats_line(stats, NULL);
 }
 
-/***************************************************************************/
 /*
-** Encode a type/count combo
+** Input is read and output written on background threads, IO_BUFFERS
+** blocks of IO_BLOCK bytes each way, so the disk and the encoder both keep
+** busy.  The I/O time in the statistics is the time spent waiting on them.
 */
-void write_type_count(
-        FILE *out,
-        unsigned type,
-        unsigned count
-) {
-    count--;
-    fputc(((count >= 32) << 7) | ((count & 31) << 2) | type, out);
-    count >>= 5;
-    while (count) {
-        fputc(((count >= 128) << 7) | (count & 127), out);
-        count >>= 7;
-    }
-}
+#define IO_BLOCK 0x100000
+#define IO_BUFFERS 4
 
-/***************************************************************************/
+/* Largest --buffer-size, in MiB */
+#define ECM_BUFFER_MAX 1024
 
-unsigned mycounter_analyze;
-unsigned mycounter_encode;
-unsigned mycounter_total;
+/*
+** Where ecmify() sends the ECM data: the writer ring, or nowhere for
+** --dry-run.  Each call has its own, so several can run at once.
+*/
+struct output {
+    struct async_ring *ring;
+    unsigned char discard[IO_BLOCK];
+    /* Encoder output on its way to the packer */
+    unsigned char staging[65536];
+};
 
-void resetcounter(unsigned total) {
-    mycounter_analyze = 0;
-    mycounter_encode = 0;
-    mycounter_total = total;
+/* Time spent waiting on I/O; only kept for --stats-json, which has one file */
+static void io_wait(double start) {
+    if (statsfile) io_seconds += stopwatch_now() - start;
 }
 
-void setcounter_analyze(unsigned n) {
-    if ((n >> 20) != (mycounter_analyze >> 20)) {
-        unsigned a = (n + 64) / 128;
-        unsigned e = (mycounter_encode + 64) / 128;
-        unsigned d = (mycounter_total + 64) / 128;
-        if (!d) d = 1;
-        fprintf(stderr, "Analyzing (%02d%%) Encoding (%02d%%)\r",
-                (100 * a) / d, (100 * e) / d
-        );
-    }
-    mycounter_analyze = n;
+static size_t timed_read(struct async_ring *in, const unsigned char **data) {
+    double start = stopwatch_now();
+    size_t n = async_read(in, data);
+    io_wait(start);
+    return n;
 }
 
-void setcounter_encode(unsigned n) {
-    if ((n >> 20) != (mycounter_encode >> 20)) {
-        unsigned a = (mycounter_analyze + 64) / 128;
-        unsigned e = (n + 64) / 128;
-        unsigned d = (mycounter_total + 64) / 128;
-        if (!d) d = 1;
-        fprintf(stderr, "Analyzing (%02d%%) Encoding (%02d%%)\r",
-                (100 * a) / d, (100 * e) / d
-        );
+/*
+** Pull from the packer, or from the encoder if there is none, straight into
+** the output buffers
+*/
+static void pull_out(struct output *out, struct ecm_encoder *enc, struct ecm_packer *pk) {
+    size_t space, m;
+    do {
+        unsigned char *buf = out->discard;
+        space = sizeof(out->discard);
+        if (out->ring) {
+            double start = stopwatch_now();
+            buf = async_buffer(out->ring, &space);
+            io_wait(start);
+        }
+        m = pk ? ecm_packer_pull(pk, buf, space) : ecm_encoder_pull(enc, buf, space);
+        if (out->ring) async_commit(out->ring, m);
+    } while (m == space);
+}
+
+/*
+** Write out what the encoder has, through the packer if there is one.
+** Returns nonzero if the packer failed.
+*/
+static int emit(struct output *out, struct ecm_encoder *enc, struct ecm_packer *pk) {
+    size_t n;
+    if (!pk) {
+        pull_out(out, enc, NULL);
+        return 0;
     }
-    mycounter_encode = n;
+    while ((n = ecm_encoder_pull(enc, out->staging, sizeof(out->staging)))) {
+        const unsigned char *buf = out->staging;
+        while (n) {
+            size_t used = ecm_packer_push(pk, buf, n);
+            buf += used;
+            n -= used;
+            pull_out(out, NULL, pk);
+            if (ecm_packer_status(pk) < 0) return 1;
+        }
+    }
+    return 0;
 }
 
-/***************************************************************************/
 /*
-** Encode a run of sectors/literals of the same type
+** Encode by pushing the input through the encoder in blocks.  Never seeks,
+** so in and out may be pipes.  With out NULL, the output is only counted.
 */
-unsigned in_flush(
-        unsigned edc,
-        unsigned type,
-        unsigned count,
-        FILE *in,
-        FILE *out
-) {
-    unsigned char buf[2352];
-    write_type_count(out, type, count);
-    if (!type) {
-        while (count) {
-            unsigned b = count;
-            if (b > 2352) b = 2352;
-            fread(buf, 1, b, in);
-            edc = edc_computeblock(edc, buf, b);
-            fwrite(buf, 1, b, out);
-            count -= b;
-            setcounter_encode(ftell(in));
+static int ecmify(FILE *in, FILE *out, struct ecm_encoder *enc, struct ecm_packer *pk) {
+    struct async_ring *rin = async_reader_create(in, IO_BLOCK, IO_BUFFERS);
+    struct output *o = malloc(sizeof(*o));
+    const unsigned char *inbuf;
+    size_t n;
+    int r = 1;
+    if (o) o->ring = out ? async_writer_create(out, IO_BLOCK, IO_BUFFERS) : NULL;
+    if (!rin || !o || (out && !o->ring)) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+    while ((n = timed_read(rin, &inbuf))) {
+        size_t used = 0;
+        while (used < n) {
+            used += ecm_encoder_push(enc, inbuf + used, n - used);
+            if (emit(o, enc, pk) || (ecm_encoder_status(enc) < 0)) goto done;
         }
-        return edc;
-    }
-    while (count--) {
-        switch (type) {
-            case 1:
-                fread(buf, 1, 2352, in);
-                edc = edc_computeblock(edc, buf, 2352);
-                fwrite(buf + 0x00C, 1, 0x003, out);
-                fwrite(buf + 0x010, 1, 0x800, out);
-                setcounter_encode(ftell(in));
-                break;
-            case 2:
-                fread(buf, 1, 2336, in);
-                edc = edc_computeblock(edc, buf, 2336);
-                fwrite(buf + 0x004, 1, 0x804, out);
-                setcounter_encode(ftell(in));
-                break;
-            case 3:
-                fread(buf, 1, 2336, in);
-                edc = edc_computeblock(edc, buf, 2336);
-                fwrite(buf + 0x004, 1, 0x918, out);
-                setcounter_encode(ftell(in));
-                break;
+    }
+    if (async_error(rin)) {
+        fprintf(stderr, "Error reading the input\n");
+        goto done;
+    }
+    ecm_encoder_finish(enc);
+    if (emit(o, enc, pk) || (ecm_encoder_status(enc) != ECM_DONE)) goto done;
+    if (pk) {
+        ecm_packer_finish(pk);
+        pull_out(o, NULL, pk);
+        if (ecm_packer_status(pk) < 0) goto done;
+    }
+    r = 0;
+done:
+    async_close(rin);
+    if (o) {
+        if (async_close(o->ring) && !r) {
+            fprintf(stderr, "Error writing the output\n");
+            r = 1;
         }
+        free(o);
     }
-    return edc;
+    return r;
+}
+
+static void report(struct ecm_encoder *enc, struct ecm_packer *pk, int dryrun) {
+    struct ecm_encoder_stats stats;
+    ecm_encoder_stats(enc, &stats);
+    fprintf(stderr, "Literal bytes........... %10llu\n", stats.count[0]);
+    fprintf(stderr, "Mode 1 sectors.......... %10llu\n", stats.count[1]);
+    fprintf(stderr, "Mode 2 form 1 sectors... %10llu\n", stats.count[2]);
+    fprintf(stderr, "Mode 2 form 2 sectors... %10llu\n", stats.count[3]);
+    fprintf(stderr, "%s %llu bytes -> %llu bytes\n", dryrun ? "Would encode" : "Encoded", stats.in_bytes, stats.out_bytes);
+    if (pk) {
+        struct ecm_pack_stats packed;
+        ecm_packer_stats(pk, &packed);
+        fprintf(stderr, "%s to %llu bytes\n", dryrun ? "Would compress" : "Compressed", packed.out_bytes);
+    }
+    fprintf(stderr, "Done.\n");
 }
 
 /***************************************************************************/
+/*
+** --batch: encode every image on a list, each to its name plus .ecm.  The
+** images go largest first to a pool of --threads workers, one image per
+** worker, so small ones are packed in around the large ones.  With fewer
+** images than threads, each one's encoder gets a share of the threads
+** instead.  Everything the process sets up once, such as the ECC/EDC
+** tables, is shared by all of them.
+*/
 
-unsigned char inputqueue[1048576 + 4];
-
-int ecmify(FILE *in, FILE *out) {
-    unsigned inedc = 0;
-    int curtype = -1;
-    int curtypecount = 0;
-    int curtype_in_start = 0;
-    int detecttype;
-    int incheckpos = 0;
-    int inbufferpos = 0;
-    int intotallength;
-    int inqueuestart = 0;
-    int dataavail = 0;
-    int typetally[4];
-    fseek(in, 0, SEEK_END);
-    intotallength = ftell(in);
-    resetcounter(intotallength);
-    typetally[0] = 0;
-    typetally[1] = 0;
-    typetally[2] = 0;
-    typetally[3] = 0;
-    /* Magic identifier */
-    fputc('E', out);
-    fputc('C', out);
-    fputc('M', out);
-    fputc(0x00, out);
-    for (;;) {
-        if ((dataavail < 2352) && (dataavail < (intotallength - inbufferpos))) {
-            int willread = intotallength - inbufferpos;
-            if (willread > ((sizeof(inputqueue) - 4) - dataavail)) willread = (sizeof(inputqueue) - 4) - dataavail;
-            if (inqueuestart) {
-                memmove(inputqueue + 4, inputqueue + 4 + inqueuestart, dataavail);
-                inqueuestart = 0;
-            }
-            if (willread) {
-                setcounter_analyze(inbufferpos);
-                fseek(in, inbufferpos, SEEK_SET);
-                fread(inputqueue + 4 + dataavail, 1, willread, in);
-                inbufferpos += willread;
-                dataavail += willread;
-            }
-        }
-        if (dataavail <= 0) break;
-        if (dataavail < 2336) {
-            detecttype = 0;
-        } else {
-            detecttype = check_type(inputqueue + 4 + inqueuestart, dataavail >= 2352);
-        }
-        if (detecttype != curtype) {
-            if (curtypecount) {
-                fseek(in, curtype_in_start, SEEK_SET);
-                typetally[curtype] += curtypecount;
-                inedc = in_flush(inedc, curtype, curtypecount, in, out);
+struct batch {
+    struct batch_job *jobs;
+    struct ecm_encoder_options options;
+    struct ecm_pack_options packoptions;
+    int usexz;
+    int dryrun;
+};
+
+/* Take every file in a directory except ECM files, CUE sheets and hidden files */
+static int batch_want(const char *name) {
+    size_t n = strlen(name);
+    if (name[0] == '.') return 0;
+    return (n < 4) || (strcasecmp(name + n - 4, ".ecm") && strcasecmp(name + n - 4, ".cue"));
+}
+
+static void batch_encode(void *arg, unsigned index) {
+    struct batch *b = arg;
+    struct batch_job *job = b->jobs + index;
+    struct ecm_encoder *enc = NULL;
+    struct ecm_packer *pk = NULL;
+    char *outfilename = NULL;
+    FILE *fin, *fout = NULL;
+    job->failed = 1;
+    fin = fopen(job->name, "rb");
+    if (!fin) {
+        perror(job->name);
+        return;
+    }
+    if (!b->dryrun) {
+        outfilename = malloc(strlen(job->name) + 5);
+        if (!outfilename) abort();
+        sprintf(outfilename, "%s.ecm", job->name);
+        fout = fopen(outfilename, "wb");
+        if (!fout) perror(outfilename);
+    }
+    if (fout || b->dryrun) {
+        enc = ecm_encoder_create(&b->options);
+        if (enc && b->usexz) pk = ecm_packer_create(&b->packoptions);
+        if (!enc || (b->usexz && !pk)) {
+            fprintf(stderr, "%s: Out of memory\n", job->name);
+        } else if (!ecmify(fin, fout, enc, pk)) {
+            struct ecm_encoder_stats stats;
+            ecm_encoder_stats(enc, &stats);
+            job->in_bytes = stats.in_bytes;
+            job->out_bytes = stats.out_bytes;
+            if (pk) {
+                struct ecm_pack_stats packed;
+                ecm_packer_stats(pk, &packed);
+                job->out_bytes = packed.out_bytes;
             }
-            curtype = detecttype;
-            curtype_in_start = incheckpos;
-            curtypecount = 1;
-        } else {
-            curtypecount++;
+            job->failed = 0;
         }
-        switch (curtype) {
-            case 0:
-                incheckpos += 1;
-                inqueuestart += 1;
-                dataavail -= 1;
-                break;
-            case 1:
-                incheckpos += 2352;
-                inqueuestart += 2352;
-                dataavail -= 2352;
-                break;
-            case 2:
-                incheckpos += 2336;
-                inqueuestart += 2336;
-                dataavail -= 2336;
-                break;
-            case 3:
-                incheckpos += 2336;
-                inqueuestart += 2336;
-                dataavail -= 2336;
-                break;
+        if (job->failed && enc) {
+            int status = ecm_encoder_status(enc);
+            if ((status >= 0) && pk) status = ecm_packer_status(pk);
+            if (status < 0) fprintf(stderr, "%s: %s\n", job->name, ecm_status_string(status));
         }
+        ecm_encoder_destroy(enc);
+        ecm_packer_destroy(pk);
     }
-    if (curtypecount) {
-        fseek(in, curtype_in_start, SEEK_SET);
-        typetally[curtype] += curtypecount;
-        inedc = in_flush(inedc, curtype, curtypecount, in, out);
-    }
-    /* End-of-records indicator */
-    write_type_count(out, 0, 0);
-    /* Input file EDC */
-    fputc((inedc >> 0) & 0xFF, out);
-    fputc((inedc >> 8) & 0xFF, out);
-    fputc((inedc >> 16) & 0xFF, out);
-    fputc((inedc >> 24) & 0xFF, out);
-    /* Show report */
-    fprintf(stderr, "Literal bytes........... %10d\n", typetally[0]);
-    fprintf(stderr, "Mode 1 sectors.......... %10d\n", typetally[1]);
-    fprintf(stderr, "Mode 2 form 1 sectors... %10d\n", typetally[2]);
-    fprintf(stderr, "Mode 2 form 2 sectors... %10d\n", typetally[3]);
-    fprintf(stderr, "Encoded %d bytes -> %ld bytes\n", intotallength, ftell(out));
-    fprintf(stderr, "Done.\n");
-    return 0;
+    if (job->failed) {
+        fprintf(stderr, "%s: failed\n", job->name);
+    } else {
+        fprintf(stderr, "%s: %llu bytes -> %llu bytes\n", job->name, job->in_bytes, job->out_bytes);
+    }
+    if (fout) fclose(fout);
+    fclose(fin);
+    free(outfilename);
+}
+
+static int ecm_batch(const char *list, const struct ecm_encoder_options *options, int usexz, int dryrun) {
+    struct batch b;
+    struct threadpool *pool;
+    unsigned long long in = 0, out = 0;
+    unsigned threads = options->threads;
+    unsigned failed = 0;
+    double start = stopwatch_now();
+    double elapsed;
+    int i, n;
+    n = batch_list(list, batch_want, &b.jobs);
+    if (n < 0) return 1;
+    if (!n) {
+        fprintf(stderr, "No images to encode\n");
+        return 0;
+    }
+    b.options = *options;
+    b.options.threads = ((unsigned) n < threads) ? threads / n : 1;
+    b.options.progress = NULL;
+    memset(&b.packoptions, 0, sizeof(b.packoptions));
+    b.packoptions.threads = b.options.threads;
+    b.usexz = usexz;
+    b.dryrun = dryrun;
+    pool = threadpool_create(((unsigned) n < threads) ? (unsigned) n : threads);
+    if (!pool) {
+        fprintf(stderr, "Out of memory\n");
+        batch_free(b.jobs, n);
+        return 1;
+    }
+    /* The tables have to be built before the workers start using them */
+    eccedc_init();
+    threadpool_run(pool, batch_encode, &b, (unsigned) n);
+    threadpool_destroy(pool);
+    elapsed = stopwatch_now() - start;
+    for (i = 0; i < n; i++) {
+        failed += b.jobs[i].failed;
+        in += b.jobs[i].in_bytes;
+        out += b.jobs[i].out_bytes;
+    }
+    fprintf(stderr, "%s %u of %d images, %llu bytes -> %llu bytes in %.1f seconds (%.2f MB/s)\n",
+            dryrun ? "Would encode" : "Encoded", n - failed, n, in, out, elapsed,
+            (elapsed > 0) ? (double) in / elapsed / 1e6 : 0.0
+    );
+    batch_free(b.jobs, n);
+    return failed != 0;
 }
 
 /***************************************************************************/
 
+static void usage(const char *progname) {
+    fprintf(stderr, "usage: %s [--threads N] [--mmap] [--index] [--xz] [--format N] [--merge N]\n", progname);
+    fprintf(stderr, "       [--buffer-size MB] [--cue cuefile] [--map mapfile] [--map-out mapfile]\n");
+    fprintf(stderr, "       [--stats-json statsfile] cdimagefile [ecmfile]\n");
+    fprintf(stderr, "       %s --dry-run [options] cdimagefile\n", progname);
+    fprintf(stderr, "       %s --batch directory|- [--dry-run] [--threads N] [--index] [--xz] [--format N]\n", progname);
+    fprintf(stderr, "       [--merge N] [--buffer-size MB]\n");
+    fprintf(stderr, "       cdimagefile and ecmfile may be - for standard input and output\n");
+}
+
 int main(int argc, char **argv) {
-    FILE *fin, *fout;
+    FILE *fin = NULL, *fout = NULL;
+    struct mapfile inmap, outmap;
+    struct ecm_encoder_options options;
+    struct ecm_encoder *enc;
+    struct ecm_pack_options packoptions;
+    struct ecm_packer *pk = NULL;
     char *infilename;
-    char *outfilename;
+    char *outfilename = NULL;
+    char *cuefilename = NULL;
+    char *mapfilename = NULL;
+    char *mapoutname = NULL;
+    char *statsfilename = NULL;
+    char *batchlist = NULL;
+    struct ecm_extent *audio = NULL;
+    struct sector_map known, map;
+    int usemmap = 0;
+    int usexz = 0;
+    int dryrun = 0;
+    int argi = 1;
+    int r;
     banner();
-    /*
-    ** Initialize the ECC/EDC tables
-    */
-    eccedc_init();
+    memset(&options, 0, sizeof(options));
+    memset(&known, 0, sizeof(known));
+    memset(&map, 0, sizeof(map));
+    options.threads = 1;
+    options.progress = progress;
     /*
     ** Check command line
     */
-    if ((argc != 2) && (argc != 3)) {
-        fprintf(stderr, "usage: %s cdimagefile [ecmfile]\n", argv[0]);
+    while ((argi < argc) && !strncmp(argv[argi], "--", 2)) {
+        if (!strcmp(argv[argi], "--threads") && (argi + 1 < argc)) {
+            int threads = atoi(argv[argi + 1]);
+            if (threads < 1) {
+                fprintf(stderr, "invalid thread count '%s'\n", argv[argi + 1]);
+                return 1;
+            }
+            options.threads = threads;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--mmap")) {
+            usemmap = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--index")) {
+            options.index = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--xz")) {
+            usexz = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--format") && (argi + 1 < argc)) {
+            int version = atoi(argv[argi + 1]);
+            if ((version < 0) || (version > ECM_FORMAT_VERSION)) {
+                fprintf(stderr, "invalid format version '%s'\n", argv[argi + 1]);
+                return 1;
+            }
+            options.version = version;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--merge") && (argi + 1 < argc)) {
+            int merge = atoi(argv[argi + 1]);
+            if ((merge < 0) || (merge > ECM_MERGE_MAX)) {
+                fprintf(stderr, "invalid merge length '%s' (0 to %d)\n", argv[argi + 1], ECM_MERGE_MAX);
+                return 1;
+            }
+            options.merge = merge;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--buffer-size") && (argi + 1 < argc)) {
+            int mb = atoi(argv[argi + 1]);
+            if ((mb < 1) || (mb > ECM_BUFFER_MAX)) {
+                fprintf(stderr, "invalid buffer size '%s' (1 to %d MiB)\n", argv[argi + 1], ECM_BUFFER_MAX);
+                return 1;
+            }
+            options.window = (size_t) mb << 20;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--cue") && (argi + 1 < argc)) {
+            cuefilename = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--map") && (argi + 1 < argc)) {
+            mapfilename = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--map-out") && (argi + 1 < argc)) {
+            mapoutname = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--stats-json") && (argi + 1 < argc)) {
+            statsfilename = argv[argi + 1];
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--dry-run")) {
+            dryrun = 1;
+            argi++;
+        } else if (!strcmp(argv[argi], "--batch") && (argi + 1 < argc)) {
+            batchlist = argv[argi + 1];
+            argi += 2;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (batchlist) {
+        if ((argc != argi) || usemmap || cuefilename || mapfilename || mapoutname || statsfilename) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (usexz && !ecm_pack_supported()) {
+            fprintf(stderr, "--xz isn't supported by this build\n");
+            return 1;
+        }
+        return ecm_batch(batchlist, &options, usexz, dryrun);
+    }
+    if ((argc - argi != 1) && ((argc - argi != 2) || dryrun)) {
+        usage(argv[0]);
         return 1;
     }
-    infilename = argv[1];
+    infilename = argv[argi];
     /*
     ** Figure out what the output filename should be
     */
-    if (argc == 3) {
-        outfilename = argv[2];
+    if (dryrun) {
+        /* Nothing is written; the output is only counted */
+        if (usemmap) {
+            fprintf(stderr, "--dry-run can't be used with --mmap\n");
+            return 1;
+        }
+    } else if (argc - argi == 2) {
+        outfilename = argv[argi + 1];
+    } else if (!strcmp(infilename, "-")) {
+        outfilename = "-";
     } else {
         outfilename = malloc(strlen(infilename) + 5);
         if (!outfilename) abort();
         sprintf(outfilename, "%s.ecm", infilename);
     }
-    fprintf(stderr, "Encoding %s to %s.\n", infilename, outfilename);
-    /*
-    ** Open both files
-    */
-    fin = fopen(infilename, "rb");
-    if (!fin) {
-        perror(infilename);
+    if (usemmap && (!strcmp(infilename, "-") || !strcmp(outfilename, "-"))) {
+        fprintf(stderr, "--mmap needs files, not standard input or output\n");
         return 1;
     }
-    fout = fopen(outfilename, "wb");
-    if (!fout) {
-        perror(outfilename);
-        fclose(fin);
+    if (usexz && (usemmap || !ecm_pack_supported())) {
+        fprintf(stderr, usemmap ? "--xz can't be used with --mmap\n" : "--xz isn't supported by this build\n");
         return 1;
     }
+    if (statsfilename && outfilename && !strcmp(statsfilename, "-") && !strcmp(outfilename, "-")) {
+        fprintf(stderr, "--stats-json can't share standard output with the ECM data\n");
+        return 1;
+    }
+    if (cuefilename) {
+        int n = cue_audio(cuefilename, infilename, &audio);
+        if (n < 0) return 1;
+        options.literal = audio;
+        options.literal_count = (unsigned) n;
+    }
+    if (mapfilename) {
+        FILE *f;
+        long long size = -1;
+        if (cuefilename) {
+            fprintf(stderr, "--map can't be used with --cue\n");
+            return 1;
+        }
+        if (!sector_map_load(&known, mapfilename)) return 1;
+        /* A map of some other image would only make a larger file */
+        if (strcmp(infilename, "-") && (f = fopen(infilename, "rb"))) {
+            if (!file_seek(f, 0, SEEK_END)) size = file_tell(f);
+            fclose(f);
+        }
+        if ((size >= 0) && ((unsigned long long) size != sector_map_size(&known))) {
+            fprintf(stderr, "%s is a map of a %llu-byte image, not of %s\n",
+                    mapfilename, sector_map_size(&known), infilename);
+            sector_map_free(&known);
+            return 1;
+        }
+        /* Sectors are still checked, but the literal runs aren't searched again */
+        options.literal_count = sector_map_literal(&known, &audio);
+        options.literal = audio;
+    }
+    if (mapoutname) {
+        options.record = sector_map_record;
+        options.opaque = &map;
+    }
+    if (statsfilename) {
+        statsfile = open_stream(statsfilename, "w", stdout);
+        if (!statsfile) {
+            perror(statsfilename);
+            return 1;
+        }
+    }
+    stats_start = stopwatch_now();
+    if (dryrun) {
+        fprintf(stderr, "Analyzing %s without writing anything.\n", infilename);
+    } else {
+        fprintf(stderr, "Encoding %s to %s.\n", infilename, outfilename);
+    }
+    /*
+    ** Open both files
+    */
+    if (usemmap) {
+        if (mapfile_open_read(&inmap, infilename)) {
+            perror(infilename);
+            return 1;
+        }
+        if (mapfile_create(&outmap, outfilename, ecm_encode_bound(inmap.size, options.index))) {
+            perror(outfilename);
+            mapfile_close(&inmap, 0);
+            return 1;
+        }
+        resetcounter(inmap.size);
+        stats_total = inmap.size;
+    } else {
+        fin = open_stream(infilename, "rb", stdin);
+        if (!fin) {
+            perror(infilename);
+            return 1;
+        }
+        if (!dryrun) {
+            fout = open_stream(outfilename, "wb", stdout);
+            if (!fout) {
+                perror(outfilename);
+                fclose(fin);
+                return 1;
+            }
+        }
+        /* Only a file can be measured for the progress display */
+        resetcounter(0);
+        if ((fin != stdin) && !file_seek(fin, 0, SEEK_END) && (file_tell(fin) > 0)) {
+            stats_total = (unsigned long long) file_tell(fin);
+            resetcounter(stats_total);
+            file_seek(fin, 0, SEEK_SET);
+        }
+    }
     /*
     ** Encode
     */
-    ecmify(fin, fout);
+    enc = ecm_encoder_create(&options);
+    if (enc && usexz) {
+        memset(&packoptions, 0, sizeof(packoptions));
+        packoptions.threads = options.threads;
+        pk = ecm_packer_create(&packoptions);
+        if (!pk) {
+            ecm_encoder_destroy(enc);
+            enc = NULL;
+        }
+    }
+    if (!enc) {
+        fprintf(stderr, "Out of memory\n");
+        r = 1;
+    } else if (usemmap) {
+        size_t outlen = 0;
+        r = ecm_encoder_encode_buffer(enc, inmap.data, inmap.size, outmap.data, outmap.size, &outlen) != ECM_DONE;
+        if (mapfile_close(&outmap, outlen)) {
+            perror(outfilename);
+            r = 1;
+        }
+    } else {
+        r = ecmify(fin, fout, enc, pk);
+    }
+    if (enc) {
+        if (ecm_encoder_status(enc) < 0) {
+            fprintf(stderr, "%s\n", ecm_status_string(ecm_encoder_status(enc)));
+        } else if (pk && (ecm_packer_status(pk) < 0)) {
+            fprintf(stderr, "%s\n", ecm_status_string(ecm_packer_status(pk)));
+        } else if (!r) {
+            report(enc, pk, dryrun);
+        }
+        if (statsfile) {
+            struct ecm_encoder_stats stats;
+            int status = ecm_encoder_status(enc);
+            if ((status >= 0) && pk && (ecm_packer_status(pk) < 0)) status = ecm_packer_status(pk);
+            ecm_encoder_stats(enc, &stats);
+            stats_line(&stats, (status < 0) ? ecm_status_string(status) : r ? "Failed" : ecm_status_string(ECM_DONE));
+        }
+        ecm_encoder_destroy(enc);
+        ecm_packer_destroy(pk);
+    }
     /*
     ** Close everything
     */
-    fclose(fout);
-    fclose(fin);
-    return 0;
+    if (usemmap) {
+        if (!enc) mapfile_close(&outmap, 0);
+        mapfile_close(&inmap, 0);
+    } else {
+        if (fout) fclose(fout);
+        fclose(fin);
+    }
+    if (statsfile && (statsfile != stdout)) fclose(statsfile);
+    if (mapoutname && !r) {
+        FILE *f = fopen(mapoutname, "w");
+        int ok = f && sector_map_save(&map, f);
+        if ((f && fclose(f)) || !ok) {
+            perror(mapoutname);
+            r = 1;
+        }
+    }
+    sector_map_free(&known);
+    sector_map_free(&map);
+    free(audio);
+    return r;
 }
@@ -0,0 +1,414 @@
+/***************************************************************************/
+/*
+** EDC engine shared by the ECM tools
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+/*
+** Three interchangeable implementations of the same CRC:
+**
+** - table:   the original byte-at-a-time loop, kept as the reference
+** - slice16: 16 lookup tables, one 16-byte step per iteration
+** - clmul:   folds 64 bytes per iteration with carry-less multiplies,
+**            picked at run time when the CPU has PCLMULQDQ (x86) or
+**            PMULL (AArch64)
+**
+** All of them read the data a byte at a time or through unaligned vector
+** loads, so the portability notes of the tools still hold.
+*/
+/***************************************************************************/
+
+#include "eccedc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EDC_HAVE_X86_CLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN) && \
+    (defined(__linux__) || defined(__APPLE__))
+#define EDC_HAVE_ARM_PMULL
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL (1 << 4)
+#endif
+#endif
+#if defined(__clang__)
+#define EDC_TARGET_PMULL __attribute__((target("aes")))
+#else
+#define EDC_TARGET_PMULL __attribute__((target("+crypto")))
+#endif
+#endif
+
+/***************************************************************************/
+
+/* edc_slice[0] is the classic byte-at-a-time table */
+static ecc_uint32 edc_slice[16][256];
+#define edc_lut (edc_slice[0])
+
+/*
+** Folding constants for the carry-less multiply engine, in bit-reflected
+** form: [0] folds the low (higher order) half of a 128-bit lane forward,
+** [1] the high half
+*/
+static unsigned long long edc_fold512[2];
+static unsigned long long edc_fold128[2];
+
+/* edc_x2n[k] is x^(2^k) mod P, reflected, for shifting an EDC by 2^k bits */
+static ecc_uint32 edc_x2n[32];
+
+/* EDC change of a Mode 1 sector for each value xored into each address byte */
+static ecc_uint32 edc_address[3][256];
+
+/*
+** For each sector layout: where the sector's EDC ends, and, by byte of the
+** running EDC, what running that many bytes through it multiplies it by
+*/
+static const unsigned edc_sector_head[3] = {0x814, 0x80C, 0x920};
+static const unsigned edc_sector_size[3] = {0x930, 0x920, 0x920};
+static ecc_uint32 edc_sector_shift[3][4][256];
+
+static ecc_uint32 edc_update_table(ecc_uint32 edc, const ecc_uint8 *src, size_t size);
+
+static ecc_uint32 (*edc_update)(ecc_uint32, const ecc_uint8 *, size_t) = edc_update_table;
+static enum edc_engine edc_current = EDC_ENGINE_TABLE;
+
+/***************************************************************************/
+
+static ecc_uint32 edc_update_table(
+        ecc_uint32 edc,
+        const ecc_uint8 *src,
+        size_t size
+) {
+    while (size--) edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
+    return edc;
+}
+
+static ecc_uint32 edc_update_slice16(
+        ecc_uint32 edc,
+        const ecc_uint8 *src,
+        size_t size
+) {
+    while (size >= 16) {
+        ecc_uint32 a = edc ^ (
+                ((ecc_uint32) src[0] << 0) |
+                ((ecc_uint32) src[1] << 8) |
+                ((ecc_uint32) src[2] << 16) |
+                ((ecc_uint32) src[3] << 24)
+        );
+        edc = edc_slice[15][(a >> 0) & 0xFF] ^
+              edc_slice[14][(a >> 8) & 0xFF] ^
+              edc_slice[13][(a >> 16) & 0xFF] ^
+              edc_slice[12][(a >> 24) & 0xFF] ^
+              edc_slice[11][src[4]] ^
+              edc_slice[10][src[5]] ^
+              edc_slice[9][src[6]] ^
+              edc_slice[8][src[7]] ^
+              edc_slice[7][src[8]] ^
+              edc_slice[6][src[9]] ^
+              edc_slice[5][src[10]] ^
+              edc_slice[4][src[11]] ^
+              edc_slice[3][src[12]] ^
+              edc_slice[2][src[13]] ^
+              edc_slice[1][src[14]] ^
+              edc_slice[0][src[15]];
+        src += 16;
+        size -= 16;
+    }
+    return edc_update_table(edc, src, size);
+}
+
+/***************************************************************************/
+/*
+** Carry-less multiply folding
+**
+** The running state is kept as 128-bit lanes that are congruent, modulo
+** the EDC polynomial, to everything consumed so far.  Moving a lane
+** forward by d bits costs two 64x64 carry-less multiplies by x^(d+63) and
+** x^(d-1) mod P (the -1 makes up for the reflected product coming out one
+** bit short).  Whatever is left at the end is run through the tables as an
+** ordinary 16-byte message.
+*/
+
+#if defined(EDC_HAVE_X86_CLMUL)
+
+__attribute__((target("pclmul,sse2")))
+static __m128i edc_fold_x86(__m128i x, __m128i k, __m128i next) {
+    return _mm_xor_si128(
+            _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)),
+            next
+    );
+}
+
+__attribute__((target("pclmul,sse2")))
+static ecc_uint32 edc_update_clmul(
+        ecc_uint32 edc,
+        const ecc_uint8 *src,
+        size_t size
+) {
+    __m128i x0, x1, x2, x3, k;
+    ecc_uint8 lane[16];
+    if (size < 64) return edc_update_slice16(edc, src, size);
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + 0)), _mm_cvtsi32_si128((int) edc));
+    x1 = _mm_loadu_si128((const __m128i *) (src + 16));
+    x2 = _mm_loadu_si128((const __m128i *) (src + 32));
+    x3 = _mm_loadu_si128((const __m128i *) (src + 48));
+    src += 64;
+    size -= 64;
+    k = _mm_set_epi64x((long long) edc_fold512[1], (long long) edc_fold512[0]);
+    while (size >= 64) {
+        x0 = edc_fold_x86(x0, k, _mm_loadu_si128((const __m128i *) (src + 0)));
+        x1 = edc_fold_x86(x1, k, _mm_loadu_si128((const __m128i *) (src + 16)));
+        x2 = edc_fold_x86(x2, k, _mm_loadu_si128((const __m128i *) (src + 32)));
+        x3 = edc_fold_x86(x3, k, _mm_loadu_si128((const __m128i *) (src + 48)));
+        src += 64;
+        size -= 64;
+    }
+    k = _mm_set_epi64x((long long) edc_fold128[1], (long long) edc_fold128[0]);
+    x0 = edc_fold_x86(x0, k, x1);
+    x0 = edc_fold_x86(x0, k, x2);
+    x0 = edc_fold_x86(x0, k, x3);
+    while (size >= 16) {
+        x0 = edc_fold_x86(x0, k, _mm_loadu_si128((const __m128i *) src));
+        src += 16;
+        size -= 16;
+    }
+    _mm_storeu_si128((__m128i *) lane, x0);
+    edc = edc_update_slice16(0, lane, 16);
+    return edc_update_slice16(edc, src, size);
+}
+
+static int edc_clmul_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+}
+
+#elif defined(EDC_HAVE_ARM_PMULL)
+
+EDC_TARGET_PMULL
+static uint64x2_t edc_fold_arm(uint64x2_t x, uint64x2_t k, uint64x2_t next) {
+    poly128_t lo = vmull_p64(
+            (poly64_t) vgetq_lane_u64(x, 0),
+            (poly64_t) vgetq_lane_u64(k, 0)
+    );
+    poly128_t hi = vmull_p64(
+            (poly64_t) vgetq_lane_u64(x, 1),
+            (poly64_t) vgetq_lane_u64(k, 1)
+    );
+    return veorq_u64(veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi)), next);
+}
+
+#define edc_load_arm(p) vreinterpretq_u64_u8(vld1q_u8(p))
+
+EDC_TARGET_PMULL
+static ecc_uint32 edc_update_clmul(
+        ecc_uint32 edc,
+        const ecc_uint8 *src,
+        size_t size
+) {
+    uint64x2_t x0, x1, x2, x3, k;
+    ecc_uint8 lane[16];
+    if (size < 64) return edc_update_slice16(edc, src, size);
+    x0 = veorq_u64(edc_load_arm(src + 0), vcombine_u64(vcreate_u64(edc), vcreate_u64(0)));
+    x1 = edc_load_arm(src + 16);
+    x2 = edc_load_arm(src + 32);
+    x3 = edc_load_arm(src + 48);
+    src += 64;
+    size -= 64;
+    k = vcombine_u64(vcreate_u64(edc_fold512[0]), vcreate_u64(edc_fold512[1]));
+    while (size >= 64) {
+        x0 = edc_fold_arm(x0, k, edc_load_arm(src + 0));
+        x1 = edc_fold_arm(x1, k, edc_load_arm(src + 16));
+        x2 = edc_fold_arm(x2, k, edc_load_arm(src + 32));
+        x3 = edc_fold_arm(x3, k, edc_load_arm(src + 48));
+        src += 64;
+        size -= 64;
+    }
+    k = vcombine_u64(vcreate_u64(edc_fold128[0]), vcreate_u64(edc_fold128[1]));
+    x0 = edc_fold_arm(x0, k, x1);
+    x0 = edc_fold_arm(x0, k, x2);
+    x0 = edc_fold_arm(x0, k, x3);
+    while (size >= 16) {
+        x0 = edc_fold_arm(x0, k, edc_load_arm(src));
+        src += 16;
+        size -= 16;
+    }
+    vst1q_u8(lane, vreinterpretq_u8_u64(x0));
+    edc = edc_update_slice16(0, lane, 16);
+    return edc_update_slice16(edc, src, size);
+}
+
+static int edc_clmul_supported(void) {
+#if defined(__APPLE__)
+    return 1;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#endif
+}
+
+#else
+
+#define edc_update_clmul edc_update_slice16
+
+static int edc_clmul_supported(void) {
+    return 0;
+}
+
+#endif
+
+/***************************************************************************/
+
+/* x^n mod P, in normal (not reflected) bit order */
+static ecc_uint32 edc_xpow(unsigned n) {
+    unsigned long long r = 1;
+    while (n--) {
+        r <<= 1;
+        if (r & 0x100000000ULL) r ^= 0x18001801BULL;
+    }
+    return (ecc_uint32) r;
+}
+
+/* Reflect a remainder into the top half of a 64-bit multiplier */
+static unsigned long long edc_reflect64(ecc_uint32 v) {
+    unsigned long long r = 0;
+    int i;
+    for (i = 0; i < 32; i++) if (v & (1U << i)) r |= 1ULL << (63 - i);
+    return r;
+}
+
+/* a * b mod P, both reflected */
+static ecc_uint32 edc_multmodp(ecc_uint32 a, ecc_uint32 b) {
+    ecc_uint32 m = 1U << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xD8018001 : b >> 1;
+    }
+    return p;
+}
+
+/* What running size zero bytes through the EDC multiplies it by, reflected */
+static ecc_uint32 edc_zeros(unsigned long long size) {
+    ecc_uint32 p = 1U << 31;
+    unsigned k = 3;
+    for (; size; size >>= 1, k++) {
+        if (size & 1) p = edc_multmodp(edc_x2n[k & 31], p);
+    }
+    return p;
+}
+
+void edc_init(void) {
+    ecc_uint32 i, j, k, edc;
+    for (i = 0; i < 256; i++) {
+        edc = i;
+        for (j = 0; j < 8; j++) edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
+        edc_slice[0][i] = edc;
+    }
+    for (j = 1; j < 16; j++) {
+        for (i = 0; i < 256; i++) {
+            edc = edc_slice[j - 1][i];
+            edc_slice[j][i] = (edc >> 8) ^ edc_slice[0][edc & 0xFF];
+        }
+    }
+    edc_fold512[0] = edc_reflect64(edc_xpow(512 + 63));
+    edc_fold512[1] = edc_reflect64(edc_xpow(512 - 1));
+    edc_fold128[0] = edc_reflect64(edc_xpow(128 + 63));
+    edc_fold128[1] = edc_reflect64(edc_xpow(128 - 1));
+    edc_x2n[0] = 1U << 30;
+    for (i = 1; i < 32; i++) edc_x2n[i] = edc_multmodp(edc_x2n[i - 1], edc_x2n[i - 1]);
+    /* The EDC covers sector offsets 0-0x80F, and the address is at 0xC */
+    for (j = 0; j < 3; j++) {
+        ecc_uint32 shift = edc_zeros(0x810 - 0xC - 1 - j);
+        for (i = 0; i < 256; i++) edc_address[j][i] = edc_multmodp(shift, edc_slice[0][i]);
+    }
+    for (k = 0; k < 3; k++) {
+        ecc_uint32 shift = edc_zeros(edc_sector_head[k]);
+        for (j = 0; j < 4; j++) {
+            for (i = 0; i < 256; i++) edc_sector_shift[k][j][i] = edc_multmodp(shift, i << (8 * j));
+        }
+    }
+    if (!edc_select(EDC_ENGINE_CLMUL)) edc_select(EDC_ENGINE_SLICE16);
+}
+
+int edc_select(enum edc_engine engine) {
+    switch (engine) {
+        case EDC_ENGINE_TABLE:
+            edc_update = edc_update_table;
+            break;
+        case EDC_ENGINE_SLICE16:
+            edc_update = edc_update_slice16;
+            break;
+        case EDC_ENGINE_CLMUL:
+            if (!edc_clmul_supported()) return 0;
+            edc_update = edc_update_clmul;
+            break;
+        default:
+            return 0;
+    }
+    edc_current = engine;
+    return 1;
+}
+
+enum edc_engine edc_selected(void) {
+    return edc_current;
+}
+
+const char *edc_engine_name(enum edc_engine engine) {
+    switch (engine) {
+        case EDC_ENGINE_TABLE:
+            return "table";
+        case EDC_ENGINE_SLICE16:
+            return "slice16";
+        case EDC_ENGINE_CLMUL:
+            return "clmul";
+    }
+    return "unknown";
+}
+
+/***************************************************************************/
+/*
+** Compute EDC for a block
+*/
+ecc_uint32 edc_partial_computeblock(
+        ecc_uint32 edc,
+        const ecc_uint8 *src,
+        size_t size
+) {
+    return edc_update(edc, src, size);
+}
+
+/*
+** EDC of two blocks joined together, from the EDC of each and the length
+** of the second
+*/
+ecc_uint32 edc_combine(ecc_uint32 edc1, ecc_uint32 edc2, unsigned long long size2) {
+    return edc_multmodp(edc_zeros(size2), edc1) ^ edc2;
+}
+
+ecc_uint32 edc_sectors(ecc_uint32 edc, const ecc_uint8 *sectors, size_t n, enum edc_sector layout) {
+    const ecc_uint32 (*shift)[256] = edc_sector_shift[layout];
+    size_t head = edc_sector_head[layout];
+    size_t size = edc_sector_size[layout];
+    size_t i;
+    /* Nothing follows the EDC of a form 2 sector */
+    if (head == size) return edc_combine(edc, 0, (unsigned long long) n * size);
+    for (i = 0; i < n; i++) {
+        edc = shift[0][edc & 0xFF] ^ shift[1][(edc >> 8) & 0xFF] ^
+              shift[2][(edc >> 16) & 0xFF] ^ shift[3][edc >> 24];
+        edc = edc_update(edc, sectors + i * size + head, size - head);
+    }
+    return edc;
+}
+
+ecc_uint32 edc_mode1_address_delta(const ecc_uint8 *delta) {
+    return edc_address[0][delta[0]] ^ edc_address[1][delta[1]] ^ edc_address[2][delta[2]];
+}
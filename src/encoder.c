@@ -0,0 +1,1284 @@
+/***************************************************************************/
+/*
+** libecm encoder
+** Copyright (C) 2002 Neill Corlett
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/***************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eccedc.h"
+#include "ecmformat.h"
+#include "stopwatch.h"
+#include "threadpool.h"
+#include "unecm.h"
+
+/***************************************************************************/
+
+/*
+** sector types:
+** 00 - literal bytes
+** 01 - 2352 mode 1         predict sync, mode, reserved, edc, ecc
+** 02 - 2336 mode 2 form 1  predict redundant flags, edc, ecc
+** 03 - 2336 mode 2 form 2  predict redundant flags, edc
+*/
+
+static int check_type(const unsigned char *sector, int canbetype1) {
+    int canbetype2 = 1;
+    int canbetype3 = 1;
+    ecc_uint32 myedc;
+    /* Check for mode 1 */
+    if (canbetype1) {
+        if (
+                (sector[0x00] != 0x00) ||
+                (sector[0x01] != 0xFF) ||
+                (sector[0x02] != 0xFF) ||
+                (sector[0x03] != 0xFF) ||
+                (sector[0x04] != 0xFF) ||
+                (sector[0x05] != 0xFF) ||
+                (sector[0x06] != 0xFF) ||
+                (sector[0x07] != 0xFF) ||
+                (sector[0x08] != 0xFF) ||
+                (sector[0x09] != 0xFF) ||
+                (sector[0x0A] != 0xFF) ||
+                (sector[0x0B] != 0x00) ||
+                (sector[0x0F] != 0x01) ||
+                (sector[0x814] != 0x00) ||
+                (sector[0x815] != 0x00) ||
+                (sector[0x816] != 0x00) ||
+                (sector[0x817] != 0x00) ||
+                (sector[0x818] != 0x00) ||
+                (sector[0x819] != 0x00) ||
+                (sector[0x81A] != 0x00) ||
+                (sector[0x81B] != 0x00)
+                ) {
+            canbetype1 = 0;
+        }
+    }
+    /* Check for mode 2 */
+    if (
+            (sector[0x0] != sector[0x4]) ||
+            (sector[0x1] != sector[0x5]) ||
+            (sector[0x2] != sector[0x6]) ||
+            (sector[0x3] != sector[0x7])
+            ) {
+        canbetype2 = 0;
+        canbetype3 = 0;
+        if (!canbetype1) return 0;
+    }
+
+    /*
+    ** Check EDC and ECC.  A lower type wins over a higher one, so each type
+    ** is settled as soon as its own EDC is known, and the EDC is only
+    ** extended as far as the types still in the running need.
+    */
+    myedc = edc_partial_computeblock(0, sector, 0x808);
+    if (canbetype2)
+        if (
+                (sector[0x808] != ((myedc >> 0) & 0xFF)) ||
+                (sector[0x809] != ((myedc >> 8) & 0xFF)) ||
+                (sector[0x80A] != ((myedc >> 16) & 0xFF)) ||
+                (sector[0x80B] != ((myedc >> 24) & 0xFF))
+                ) {
+            canbetype2 = 0;
+        }
+    myedc = edc_partial_computeblock(myedc, sector + 0x808, 8);
+    if (canbetype1)
+        if (
+                (sector[0x810] != ((myedc >> 0) & 0xFF)) ||
+                (sector[0x811] != ((myedc >> 8) & 0xFF)) ||
+                (sector[0x812] != ((myedc >> 16) & 0xFF)) ||
+                (sector[0x813] != ((myedc >> 24) & 0xFF))
+                ) {
+            canbetype1 = 0;
+        }
+    if (canbetype1 && ecc_verify(sector + 0xC, sector + 0x10)) return 1;
+    if (canbetype2 && ecc_verify(NULL, sector)) return 2;
+    if (!canbetype3) return 0;
+    myedc = edc_partial_computeblock(myedc, sector + 0x810, 0x10C);
+    if (
+            (sector[0x91C] != ((myedc >> 0) & 0xFF)) ||
+            (sector[0x91D] != ((myedc >> 8) & 0xFF)) ||
+            (sector[0x91E] != ((myedc >> 16) & 0xFF)) ||
+            (sector[0x91F] != ((myedc >> 24) & 0xFF))
+            ) {
+        return 0;
+    }
+    return 3;
+}
+
+/* Whether the 4 bytes at p are edc, least significant first */
+static int edc_stored(const unsigned char *p, ecc_uint32 edc) {
+    return (p[0] == ((edc >> 0) & 0xFF)) &&
+           (p[1] == ((edc >> 8) & 0xFF)) &&
+           (p[2] == ((edc >> 16) & 0xFF)) &&
+           (p[3] == ((edc >> 24) & 0xFF));
+}
+
+static const unsigned char mode1_sync[12] = {
+        0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+};
+static const unsigned char mode1_reserved[8];
+
+/*
+** How many of n sectors laid out stride bytes apart would check_type()
+** find to be of the given type (1-3), counting from the first.  Sectors
+** are checked as far as their EDC first, and then the ECC of all those
+** that pass is verified in one batch.  A sector that could be of a lower
+** type ends the run, whatever it turns out to be.  (A Mode 1 sync can't
+** pass the Mode 2 subheader check, so those only come up for type 3.)
+*/
+static int check_type_run(const unsigned char *sectors, size_t stride, int n, int type) {
+    int i;
+    for (i = 0; i < n; i++) {
+        const unsigned char *sector = sectors + (size_t) i * stride;
+        ecc_uint32 myedc;
+        if (type == 1) {
+            if (
+                    memcmp(sector, mode1_sync, 12) ||
+                    (sector[0x0F] != 0x01) ||
+                    memcmp(sector + 0x814, mode1_reserved, 8) ||
+                    !edc_stored(sector + 0x810, edc_partial_computeblock(0, sector, 0x810))
+                    ) {
+                break;
+            }
+            continue;
+        }
+        if (memcmp(sector, sector + 4, 4)) break;
+        myedc = edc_partial_computeblock(0, sector, 0x808);
+        if (type == 2) {
+            if (!edc_stored(sector + 0x808, myedc)) break;
+            continue;
+        }
+        if (edc_stored(sector + 0x808, myedc)) break;
+        myedc = edc_partial_computeblock(myedc, sector + 0x808, 0x114);
+        if (!edc_stored(sector + 0x91C, myedc)) break;
+    }
+    if (type == 1) return (int) ecc_verify_batch(sectors + 0x10, stride, (size_t) i, 1);
+    if (type == 2) return (int) ecc_verify_batch(sectors, stride, (size_t) i, 0);
+    return i;
+}
+
+/***************************************************************************/
+/*
+** Pre-filter for check_type()
+**
+** Every sector type needs either the start of a Mode 1 sync pattern
+** (00 FF) or a repeated XA subheader (bytes 0-3 equal to bytes 4-7), so
+** any offset with neither is a literal byte without looking further.
+** literal_span() returns how many of the next maxspan offsets are like
+** that.  The data must extend at least 20 bytes past offset maxspan.
+*/
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static int literal_candidate(const unsigned char *p) {
+    return ((p[0] == 0x00) && (p[1] == 0xFF)) ||
+           ((p[0] == p[4]) && (p[1] == p[5]) && (p[2] == p[6]) && (p[3] == p[7]));
+}
+
+static int literal_span(const unsigned char *p, int maxspan) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i ff = _mm_set1_epi8((char) 0xFF);
+    while (i + 16 <= maxspan) {
+        const unsigned char *q = p + i;
+        __m128i a = _mm_loadu_si128((const __m128i *) q);
+        unsigned eq = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_loadu_si128((const __m128i *) (q + 4)))) |
+                      ((unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(
+                              _mm_loadu_si128((const __m128i *) (q + 16)),
+                              _mm_loadu_si128((const __m128i *) (q + 20))
+                      )) << 16);
+        unsigned sync = (unsigned) _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(a, _mm_setzero_si128()),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (q + 1)), ff)
+        ));
+        unsigned hit = ((eq & (eq >> 1) & (eq >> 2) & (eq >> 3)) | sync) & 0xFFFF;
+        if (hit) return i + __builtin_ctz(hit);
+        i += 16;
+    }
+#endif
+    while ((i < maxspan) && !literal_candidate(p + i)) i++;
+    return i;
+}
+
+
+/***************************************************************************/
+/*
+** Encoder output queue.  Normally this is a buffer that grows as needed
+** and is drained by ecm_encoder_pull(); for one-shot encoding it is the
+** caller's buffer, and running out of room there is an error.
+*/
+struct ecm_sink {
+    unsigned char *buf;
+    size_t size;
+    size_t head;               /* Next byte to hand out */
+    size_t pos;                /* End of the data written */
+    size_t split;              /* Where a spilled record's body goes (see record_close()) */
+    int fixed;
+    int error;
+    unsigned long long total;  /* Bytes written since the start */
+};
+
+static int sink_reserve(struct ecm_sink *o, size_t n) {
+    unsigned char *p;
+    size_t size;
+    if (o->head) {
+        memmove(o->buf, o->buf + o->head, o->pos - o->head);
+        o->pos -= o->head;
+        o->split -= (o->split > o->head) ? o->head : o->split;
+        o->head = 0;
+        if (n <= o->size - o->pos) return 1;
+    }
+    if (o->fixed) {
+        o->error = ECM_ERROR_SPACE;
+        return 0;
+    }
+    size = o->size ? o->size : 65536;
+    while (n > size - o->pos) size *= 2;
+    p = realloc(o->buf, size);
+    if (!p) {
+        o->error = ECM_ERROR_MEMORY;
+        return 0;
+    }
+    o->buf = p;
+    o->size = size;
+    return 1;
+}
+
+static void sink_write(struct ecm_sink *o, const void *src, size_t n) {
+    if (o->error) return;
+    if ((n > o->size - o->pos) && !sink_reserve(o, n)) return;
+    memcpy(o->buf + o->pos, src, n);
+    o->pos += n;
+    o->total += n;
+}
+
+/***************************************************************************/
+/*
+** Encode a type/count combo in the given format version
+*/
+static void write_type_count(
+        struct ecm_sink *out,
+        unsigned version,
+        unsigned type,
+        unsigned count
+) {
+    unsigned char buf[5];
+    size_t n = 0;
+    count--;
+    if (version) {
+        buf[n++] = ((count >= 16) << 7) | ((count & 15) << 3) | type;
+        count >>= 4;
+    } else {
+        buf[n++] = ((count >= 32) << 7) | ((count & 31) << 2) | type;
+        count >>= 5;
+    }
+    while (count) {
+        buf[n++] = ((count >= 128) << 7) | (count & 127);
+        count >>= 7;
+    }
+    sink_write(out, buf, n);
+}
+
+/***************************************************************************/
+/*
+** Optional seek index trailer (see doc/format.txt).  There is one entry for
+** the first record starting at or past every ECM_INDEX_INTERVAL bytes of
+** input, holding the record's offset in the input and in the ECM file.
+** Ahead of the entries goes the table of block checksums.  Each block's EDC
+** is worked out from the input EDC at either end of it, which the encoder
+** has anyway.
+*/
+
+struct ecm_index {
+    unsigned char *entries;
+    unsigned char *checks;
+    size_t count;
+    size_t capacity;
+    unsigned long long next;
+    /* Input offset and input EDC at the last entry */
+    unsigned long long lastpos;
+    unsigned lastedc;
+};
+
+static void put_le64(unsigned char *p, unsigned long long v) {
+    int i;
+    for (i = 0; i < 8; i++) p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static void put_le32(unsigned char *p, unsigned v) {
+    p[0] = (v >> 0) & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+/* Close the block of the last entry, which ends at inpos with the input EDC at edc */
+static void index_check(struct ecm_index *x, unsigned long long inpos, unsigned edc) {
+    unsigned block = edc ^ edc_combine(x->lastedc, 0, inpos - x->lastpos);
+    if (x->count) put_le32(x->checks + (x->count - 1) * ECM_CHECKSUM_ENTRY, block);
+}
+
+/* Returns 0 if out of memory */
+static int index_add(struct ecm_index *x, unsigned long long inpos, unsigned long long outpos, unsigned edc) {
+    if (inpos < x->next) return 1;
+    if (x->count == x->capacity) {
+        size_t capacity = x->capacity ? x->capacity * 2 : 64;
+        unsigned char *p = realloc(x->entries, capacity * ECM_INDEX_ENTRY);
+        if (!p) return 0;
+        x->entries = p;
+        p = realloc(x->checks, capacity * ECM_CHECKSUM_ENTRY);
+        if (!p) return 0;
+        x->checks = p;
+        x->capacity = capacity;
+    }
+    index_check(x, inpos, edc);
+    put_le64(x->entries + x->count * ECM_INDEX_ENTRY, inpos);
+    put_le64(x->entries + x->count * ECM_INDEX_ENTRY + 8, outpos);
+    x->count++;
+    x->next = (inpos / ECM_INDEX_INTERVAL + 1) * ECM_INDEX_INTERVAL;
+    x->lastpos = inpos;
+    x->lastedc = edc;
+    return 1;
+}
+
+static void index_write(struct ecm_index *x, struct ecm_sink *out, unsigned long long total, unsigned edc) {
+    unsigned char footer[ECM_INDEX_FOOTER];
+    index_check(x, total, edc);
+    if (x->count) sink_write(out, x->checks, x->count * ECM_CHECKSUM_ENTRY);
+    put_le32(footer, (unsigned) x->count);
+    memcpy(footer + 4, "ECMC", 4);
+    sink_write(out, footer, ECM_CHECKSUM_FOOTER);
+    if (x->count) sink_write(out, x->entries, x->count * ECM_INDEX_ENTRY);
+    put_le64(footer, total);
+    footer[8] = (x->count >> 0) & 0xFF;
+    footer[9] = (x->count >> 8) & 0xFF;
+    footer[10] = (x->count >> 16) & 0xFF;
+    footer[11] = (x->count >> 24) & 0xFF;
+    memcpy(footer + 12, "ECMI", 4);
+    sink_write(out, footer, ECM_INDEX_FOOTER);
+}
+
+/***************************************************************************/
+
+/* How edc_sectors() sees the sectors of each record type */
+static const enum edc_sector sector_layout[8] = {
+        EDC_SECTOR_MODE1, EDC_SECTOR_MODE1, EDC_SECTOR_MODE2_FORM1, EDC_SECTOR_MODE2_FORM2,
+        EDC_SECTOR_MODE1, EDC_SECTOR_MODE1, EDC_SECTOR_MODE2_FORM1, EDC_SECTOR_MODE2_FORM2
+};
+
+/* Input bytes per unit of each record type */
+static const unsigned recordstride[8] = {1, 2352, 2336, 2336, 2352, 2352, 2336, 2336};
+
+/*
+** Encode the body of count sectors/literals of a record type, straight
+** from the input data in memory.  check_type() has already matched the EDC
+** of every sector, so the running EDC only has to read the bytes after it.
+*/
+static unsigned in_flush(
+        unsigned edc,
+        unsigned type,
+        unsigned count,
+        const unsigned char *src,
+        struct ecm_sink *out
+) {
+    if (!type) {
+        edc = edc_partial_computeblock(edc, src, count);
+        sink_write(out, src, count);
+        return edc;
+    }
+    edc = edc_sectors(edc, src, count, sector_layout[type]);
+    /* Empty sectors store nothing more */
+    if (type >= 5) return edc;
+    while (count--) {
+        switch (type) {
+            case 1:
+                sink_write(out, src + 0x00C, 0x003);
+                sink_write(out, src + 0x010, 0x800);
+                src += 2352;
+                break;
+            case 2:
+                sink_write(out, src + 0x004, 0x804);
+                src += 2336;
+                break;
+            case 3:
+                sink_write(out, src + 0x004, 0x918);
+                src += 2336;
+                break;
+            case 4:
+                sink_write(out, src + 0x010, 0x800);
+                src += 2352;
+                break;
+        }
+    }
+    return edc;
+}
+
+/*
+** Sequential addresses (format version 1).  A run of Mode 1 sectors whose
+** addresses count up one frame at a time only needs the first address; it
+** is written as type 4 if it is at least SEQUENTIAL_MIN sectors long, which
+** more than pays for the extra record header.
+**
+** Empty sectors (format version 2).  A sector whose data is all zero needs
+** no data at all: runs of them are written as type 5 (Mode 1, with
+** consecutive addresses) or types 6 and 7 (Mode 2, with the same flags),
+** however short.
+*/
+#define SEQUENTIAL_MIN 4
+
+/* Whether the data of a sector of type 1-3 is all zero */
+static int sector_empty(const unsigned char *src, unsigned type) {
+    const unsigned char *data = src + ((type == 1) ? 0x010 : 0x008);
+    size_t size = (type == 3) ? 0x914 : 0x800;
+    return !data[0] && !memcmp(data, data + 1, size - 1);
+}
+
+/***************************************************************************/
+/*
+** The input window.  It holds everything from the first input byte not yet
+** encoded (see the record writer below) up to the end of the data pushed so
+** far, so records can be written out without reading the input a second
+** time.
+**
+** While streaming, the window is a ring of options.window bytes, so what is
+** kept never has to be moved down as more comes in.  The first
+** ECM_WINDOW_MIRROR bytes of the ring are also kept past its end, which
+** makes any stretch the classifier looks at, and any piece of a record
+** encoded in one go, contiguous in memory wherever it starts.
+*/
+#define ECM_WINDOW_MIRROR 0x40000
+#define ECM_WINDOW_SIZE 0x100000
+/* Most input offsets the classifier takes in one go; it keeps them in ints */
+#define ECM_SPAN_MAX 0x40000000
+
+/* How far the encoder advances after finding each sector type */
+static const int typestride[4] = {1, 2352, 2336, 2336};
+
+/* Most sectors checked together after a sector is found */
+#define CLASSIFY_BATCH 64
+
+/*
+** Classify the offset at p.  Each of the maxspan offsets from p must have at
+** least 2352 bytes of data behind it.  Offsets the pre-filter rules out are
+** reported as a run of up to maxspan literal bytes.  A sector is reported
+** together with however many sectors of the same type follow it, up to
+** CLASSIFY_BATCH, since inside a run the next position is already known.
+** *count is set to the number of literal bytes or sectors.
+*/
+static int classify_step(const unsigned char *p, int maxspan, int *count) {
+    int n = literal_span(p, maxspan);
+    int t;
+    if (n) {
+        *count = n;
+        return 0;
+    }
+    *count = 1;
+    t = check_type(p, 1);
+    if (!t) return 0;
+    n = (maxspan - 1) / typestride[t];
+    if (n > CLASSIFY_BATCH) n = CLASSIFY_BATCH;
+    *count += check_type_run(p + typestride[t], typestride[t], n, t);
+    return t;
+}
+
+/***************************************************************************/
+/*
+** Speculative parallel sector classification
+**
+** Where the encoder looks next depends on what it found at the current
+** position, so its walk through the input is inherently serial.  To spread
+** the work out anyway, the bulk of the input window is cut into chunks and
+** each chunk is walked independently, starting from its first byte.  A walk
+** that starts in the middle of a sector slides along one byte at a time
+** until it lands on a real sector boundary; from there on it visits exactly
+** the same positions as the true walk.  The merge step follows the true walk
+** through the chunks, classifying positions itself only until it hits one
+** the chunk's walk has already visited, and adopting the rest of that walk
+** from there.  The result is exactly what the serial encoder would find.
+**
+** Chunk walks are recorded as steps: a single sector, or a run of literal
+** bytes that the pre-filter skipped in one go.
+*/
+
+#define SPEC_MIN_LENGTH 65536
+
+struct spec_chunk {
+    int start;
+    int end;
+    int count;
+    int *pos;
+    int *len;
+    unsigned char *type;
+};
+
+struct spec_state {
+    struct threadpool *pool;
+    const unsigned char *base;
+    unsigned nchunks;
+    struct spec_chunk *chunk;
+    int *pos;
+    int *len;
+    unsigned char *type;
+    /* Merged walk, consumed in order by the encoder */
+    int count;
+    int next;
+    int *merged_len;
+    unsigned char *merged_type;
+};
+
+/* For spec_classify() lengths up to span; every offset may be a step of its own */
+static int spec_init(struct spec_state *s, struct threadpool *pool, int span) {
+    memset(s, 0, sizeof(*s));
+    s->pool = pool;
+    s->nchunks = threadpool_size(pool);
+    s->chunk = calloc(s->nchunks, sizeof(*s->chunk));
+    s->pos = malloc(span * sizeof(*s->pos));
+    s->len = malloc(span * sizeof(*s->len));
+    s->type = malloc(span);
+    s->merged_len = malloc(span * sizeof(*s->merged_len));
+    s->merged_type = malloc(span);
+    return s->chunk && s->pos && s->len && s->type && s->merged_len && s->merged_type;
+}
+
+static void spec_free(struct spec_state *s) {
+    free(s->chunk);
+    free(s->pos);
+    free(s->len);
+    free(s->type);
+    free(s->merged_len);
+    free(s->merged_type);
+}
+
+static void spec_push(struct spec_state *s, int type, int len) {
+    s->merged_type[s->count] = type;
+    s->merged_len[s->count] = len;
+    s->count++;
+}
+
+/* Last offset visited by step j of a chunk's walk */
+#define spec_last(c, j) ((c)->pos[j] + ((c)->type[j] ? 0 : (c)->len[j] - 1))
+
+static void spec_walk(void *arg, unsigned index) {
+    struct spec_state *s = arg;
+    struct spec_chunk *c = s->chunk + index;
+    int p = c->start;
+    c->count = 0;
+    while (p < c->end) {
+        int n;
+        int t = classify_step(s->base + p, c->end - p, &n);
+        if (!t) {
+            c->pos[c->count] = p;
+            c->len[c->count] = n;
+            c->type[c->count] = 0;
+            c->count++;
+            p += n;
+            continue;
+        }
+        while (n--) {
+            c->pos[c->count] = p;
+            c->len[c->count] = 1;
+            c->type[c->count] = t;
+            c->count++;
+            p += typestride[t];
+        }
+    }
+}
+
+/*
+** Classify the true walk through every offset in [0, length) of base; each
+** offset must have at least 2352 bytes of data behind it
+*/
+static void spec_classify(struct spec_state *s, const unsigned char *base, int length) {
+    unsigned i;
+    int p = 0;
+    s->base = base;
+    for (i = 0; i < s->nchunks; i++) {
+        struct spec_chunk *c = s->chunk + i;
+        c->start = (int) (((long long) length * i) / s->nchunks);
+        c->end = (int) (((long long) length * (i + 1)) / s->nchunks);
+        c->pos = s->pos + c->start;
+        c->len = s->len + c->start;
+        c->type = s->type + c->start;
+    }
+    threadpool_run(s->pool, spec_walk, s, s->nchunks);
+    s->count = 0;
+    s->next = 0;
+    for (i = 0; i < s->nchunks; i++) {
+        struct spec_chunk *c = s->chunk + i;
+        int j = 0;
+        while (p < c->end) {
+            int t, n;
+            while ((j < c->count) && (spec_last(c, j) < p)) j++;
+            if ((j < c->count) && (c->pos[j] <= p)) {
+                /* Caught up with this chunk's walk; take the rest of it */
+                spec_push(s, c->type[j], c->len[j] - (p - c->pos[j]));
+                for (j++; j < c->count; j++) spec_push(s, c->type[j], c->len[j]);
+                j = c->count - 1;
+                p = c->pos[j] + c->len[j] * typestride[c->type[j]];
+                break;
+            }
+            t = classify_step(base + p, c->end - p, &n);
+            spec_push(s, t, n);
+            p += n * typestride[t];
+        }
+    }
+}
+
+
+/***************************************************************************/
+/*
+** Encoder context
+*/
+
+struct ecm_encoder {
+    struct ecm_encoder_options options;
+    struct threadpool *pool;
+    struct spec_state spec;
+    /*
+    ** Input window, from input offset winpos on.  One-shot, window[0] is
+    ** winpos; streaming, it is the ring in buffer, of ringsize bytes.
+    */
+    unsigned char *buffer;
+    const unsigned char *window;
+    size_t ringsize;
+    size_t winlen;
+    unsigned long long winpos;
+    /* Next input offset to classify */
+    unsigned long long checkpos;
+    /* Most offsets classified in one go: the window size, up to ECM_SPAN_MAX */
+    int span;
+    /* Run being collected: what of it is not yet passed on, where it ends, and its length */
+    int curtype;
+    unsigned long long curtypecount;
+    unsigned long long curtype_in_start;
+    unsigned long long runend;
+    unsigned long long runlength;
+    /* With options.merge, sectors after a literal run that may still join it */
+    int tailtype;
+    unsigned tailcount;
+    /* Record being written, if rectype >= 0 (see record_add()), and the units of it spilled */
+    int rectype;
+    unsigned reccount;
+    unsigned recspilled;
+    unsigned recedc;
+    unsigned long long recpos;
+    unsigned char recprefix[4];
+    /* Mode 1 sectors with consecutive addresses from segpos on (format version 1 and up) */
+    unsigned long long segpos;
+    unsigned segcount;
+    int segempty;
+    unsigned char segnext[3];
+    /* The spill: its bytes not yet in the file, in it, and still to be pulled from it */
+    struct ecm_sink spill;
+    FILE *spillfile;
+    unsigned long long spillsize;
+    unsigned long long spillleft;
+    unsigned edc;
+    int started;
+    int finished;
+    int trailer;
+    int status;
+    unsigned long long encoded;
+    unsigned long long progress_next;
+    unsigned long long count[4];
+    unsigned long long in_bytes;
+    struct ecm_sink out;
+    struct ecm_index index;
+    /* Copy of options.literal, and the first extent not yet passed */
+    struct ecm_extent *literal;
+    unsigned literal_next;
+    /* Time in encoder_run() so far, when the current call started, and in the record writer */
+    double run_seconds;
+    double run_start;
+    double encode_seconds;
+};
+
+void ecm_encoder_stats(const struct ecm_encoder *enc, struct ecm_encoder_stats *stats) {
+    memcpy(stats->count, enc->count, sizeof(stats->count));
+    stats->in_bytes = enc->in_bytes;
+    stats->analyzed_bytes = enc->checkpos;
+    stats->encoded_bytes = enc->encoded;
+    stats->out_bytes = enc->out.total;
+    stats->analyze_seconds = enc->run_seconds - enc->encode_seconds;
+    if (enc->run_start) stats->analyze_seconds += stopwatch_now() - enc->run_start;
+    stats->encode_seconds = enc->encode_seconds;
+}
+
+static void encoder_progress(struct ecm_encoder *e) {
+    struct ecm_encoder_stats stats;
+    double start;
+    if (!e->options.progress || (e->checkpos < e->progress_next)) return;
+    e->progress_next = e->checkpos + ECM_PROGRESS_STEP;
+    ecm_encoder_stats(e, &stats);
+    start = stopwatch_now();
+    e->options.progress(e->options.opaque, &stats);
+    /* The callback's own time isn't the encoder's */
+    e->run_start += stopwatch_now() - start;
+}
+
+/*
+** Where an input offset in the window is in memory; at least
+** ECM_WINDOW_MIRROR bytes from it are contiguous, or up to the end of a
+** one-shot window
+*/
+static const unsigned char *window_at(const struct ecm_encoder *e, unsigned long long offset) {
+    if (!e->ringsize) return e->window + (size_t) (offset - e->winpos);
+    return e->buffer + (size_t) (offset % e->ringsize);
+}
+
+/***************************************************************************/
+/*
+** The record writer.  Each run of one type is one record, however long, as
+** with the original ECM, so the output only depends on the input.  A
+** record's header holds its count, so nothing of it can be written until it
+** is complete; until then its sectors stay in the window.  If the window
+** fills up first, what it has of the record is encoded into a temporary
+** file, the spill, and pulled back out of that after the header once the
+** record ends.
+**
+** Records only end early where they have to: at RECORD_MAX units, the most
+** a header can hold, and, with options.index, at every ECM_INDEX_INTERVAL
+** bytes of input, which keeps every block of the index that long.
+**
+** In format version 1 and up, a Mode 1 run is written as records of types
+** 1, 4 and 5, and in version 2 a Mode 2 run as records of types 2 or 3 and
+** 6 or 7.  The sectors are settled one at a time; only a stretch of
+** consecutive addresses still too short for type 4 has to wait, which is at
+** most SEQUENTIAL_MIN - 1 sectors.
+*/
+#define RECORD_MAX 0x7FFFFFFF
+
+/* Encode count units of the open record from input offset pos on */
+static void record_encode(struct ecm_encoder *e, unsigned long long pos, unsigned count, struct ecm_sink *out) {
+    unsigned stride = recordstride[e->rectype];
+    unsigned chunk = ECM_WINDOW_MIRROR / stride;
+    while (count) {
+        unsigned n = (count > chunk) ? chunk : count;
+        e->edc = in_flush(e->edc, (unsigned) e->rectype, n, window_at(e, pos), out);
+        pos += (unsigned long long) n * stride;
+        count -= n;
+    }
+    e->encoded = pos;
+}
+
+/*
+** Move what the window has of the open record to the spill, a piece of up
+** to ECM_WINDOW_MIRROR bytes of input at a time
+*/
+static void record_spill(struct ecm_encoder *e) {
+    unsigned chunk;
+    if (e->rectype < 0) return;
+    chunk = ECM_WINDOW_MIRROR / recordstride[e->rectype];
+    while (!e->status && (e->recspilled < e->reccount)) {
+        unsigned n = e->reccount - e->recspilled;
+        if (n > chunk) n = chunk;
+        record_encode(e, e->recpos + (unsigned long long) e->recspilled * recordstride[e->rectype], n, &e->spill);
+        e->recspilled += n;
+        if (e->spill.error) e->status = e->spill.error;
+        if (!e->spill.pos || e->status) continue;
+        if (!e->spillfile) e->spillfile = tmpfile();
+        if (!e->spillfile || (fwrite(e->spill.buf, 1, e->spill.pos, e->spillfile) != e->spill.pos)) {
+            e->status = ECM_ERROR_IO;
+        }
+        e->spillsize += e->spill.pos;
+        e->spill.pos = 0;
+    }
+}
+
+static void record_close(struct ecm_encoder *e) {
+    unsigned type = (unsigned) e->rectype;
+    if (e->rectype < 0) return;
+    if (e->options.index && !index_add(&e->index, e->recpos, e->out.total, e->recedc)) {
+        e->status = ECM_ERROR_MEMORY;
+    }
+    if (e->options.record) e->options.record(e->options.opaque, type, e->recpos, e->reccount);
+    write_type_count(&e->out, e->options.version, type, e->reccount);
+    /* Prefix: the first address, or the flags every sector shares */
+    if ((type == 4) || (type == 5)) sink_write(&e->out, e->recprefix, 3);
+    if (type >= 6) sink_write(&e->out, e->recprefix, 4);
+    if (e->spillsize && !e->status) {
+        /* ecm_encoder_pull() hands out the spill before what is written after this */
+        rewind(e->spillfile);
+        e->out.split = e->out.pos;
+        e->out.total += e->spillsize;
+        e->spillleft = e->spillsize;
+        e->spillsize = 0;
+    }
+    record_encode(e, e->recpos + (unsigned long long) e->recspilled * recordstride[type],
+                  e->reccount - e->recspilled, &e->out);
+    e->rectype = -1;
+    e->recspilled = 0;
+}
+
+/*
+** Add count units of a record type from input offset pos on, to the open
+** record if it is of that type, unless fresh is set
+*/
+static void record_add(struct ecm_encoder *e, unsigned type, unsigned long long pos, unsigned long long count, int fresh) {
+    unsigned stride = recordstride[type];
+    while (count) {
+        unsigned long long n = count;
+        if (fresh || (e->rectype != (int) type) || (e->reccount == RECORD_MAX) ||
+            (e->options.index && (pos / ECM_INDEX_INTERVAL != e->recpos / ECM_INDEX_INTERVAL))) {
+            record_close(e);
+            e->rectype = (int) type;
+            e->reccount = 0;
+            e->recpos = pos;
+            e->recedc = e->edc;
+            if (type >= 4) memcpy(e->recprefix, window_at(e, pos) + ((type < 6) ? 0x00C : 0x004), 4);
+            fresh = 0;
+        }
+        if (n > RECORD_MAX - e->reccount) n = RECORD_MAX - e->reccount;
+        if (e->options.index) {
+            /* Only units that start before the next interval */
+            unsigned long long end = (e->recpos / ECM_INDEX_INTERVAL + 1) * ECM_INDEX_INTERVAL;
+            if (n > (end - pos + stride - 1) / stride) n = (end - pos + stride - 1) / stride;
+        }
+        e->reccount += (unsigned) n;
+        pos += n * stride;
+        count -= n;
+    }
+}
+
+/* Settle the Mode 1 sectors from segpos on, if too few for type 4 */
+static void segment_end(struct ecm_encoder *e) {
+    if (e->segcount && !e->segempty && (e->segcount < SEQUENTIAL_MIN)) record_add(e, 1, e->segpos, e->segcount, 0);
+    e->segcount = 0;
+}
+
+/* Add the Mode 1 sector at input offset pos, in format version 1 or later */
+static void segment_add(struct ecm_encoder *e, unsigned long long pos) {
+    const unsigned char *sector = window_at(e, pos);
+    int empty = (e->options.version >= 2) && sector_empty(sector, 1);
+    if (!e->segcount || (empty != e->segempty) || memcmp(e->segnext, sector + 0x00C, 3)) {
+        segment_end(e);
+        e->segpos = pos;
+        e->segempty = empty;
+        memcpy(e->segnext, sector + 0x00C, 3);
+    }
+    e->segcount++;
+    ecm_address_next(e->segnext);
+    if (empty) {
+        record_add(e, 5, pos, 1, e->segcount == 1);
+    } else if (e->segcount == SEQUENTIAL_MIN) {
+        record_add(e, 4, e->segpos, SEQUENTIAL_MIN, 1);
+    } else if (e->segcount > SEQUENTIAL_MIN) {
+        record_add(e, 4, pos, 1, 0);
+    }
+}
+
+/* Add the Mode 2 sector of type 2 or 3 at input offset pos, in format version 2 */
+static void mode2_add(struct ecm_encoder *e, unsigned type, unsigned long long pos) {
+    const unsigned char *sector = window_at(e, pos);
+    if (!sector_empty(sector, type)) {
+        record_add(e, type, pos, 1, 0);
+    } else {
+        record_add(e, type + 4, pos, 1, (e->rectype == (int) type + 4) && memcmp(e->recprefix, sector + 0x004, 4));
+    }
+}
+
+/* Pass the run collected so far on to the record writer */
+static void encoder_commit(struct ecm_encoder *e) {
+    unsigned long long pos = e->curtype_in_start;
+    unsigned long long n = e->curtypecount;
+    unsigned version = e->options.version;
+    if (!n) return;
+    e->count[e->curtype] += n;
+    if ((e->curtype == 1) && version) {
+        for (; n; n--, pos += 2352) segment_add(e, pos);
+    } else if ((e->curtype >= 2) && (version >= 2)) {
+        for (; n; n--, pos += 2336) mode2_add(e, (unsigned) e->curtype, pos);
+    } else {
+        record_add(e, (unsigned) e->curtype, pos, n, 0);
+    }
+    e->curtype_in_start = e->runend;
+    e->curtypecount = 0;
+}
+
+/* Write out the run collected so far, which has ended */
+static void encoder_flush(struct ecm_encoder *e) {
+    double start;
+    if (!e->curtypecount && (e->rectype < 0) && !e->segcount) return;
+    start = stopwatch_now();
+    encoder_commit(e);
+    segment_end(e);
+    record_close(e);
+    e->encode_seconds += stopwatch_now() - start;
+}
+
+/*
+** Make room in the window: pass on the run collected so far, unless
+** options.merge may yet turn it into literal bytes, and spill what the
+** window has of the open record.  That waits if passing the run on has
+** ended a spilled record still to be pulled.
+*/
+static void encoder_spill(struct ecm_encoder *e) {
+    double start = stopwatch_now();
+    if ((e->curtype <= 0) || (e->runlength >= e->options.merge)) encoder_commit(e);
+    if (!e->spillleft) record_spill(e);
+    e->encode_seconds += stopwatch_now() - start;
+}
+
+/* The first input offset the window still has to keep */
+static unsigned long long encoder_keep(const struct ecm_encoder *e) {
+    if ((e->rectype >= 0) && (e->recspilled < e->reccount)) {
+        return e->recpos + (unsigned long long) e->recspilled * recordstride[e->rectype];
+    }
+    if (e->segcount && !e->segempty && (e->segcount < SEQUENTIAL_MIN)) return e->segpos;
+    return e->curtypecount ? e->curtype_in_start : e->runend;
+}
+
+/* Add count literal bytes or sectors of the type, ending the run before if it is of another */
+static void encoder_add(struct ecm_encoder *e, int type, unsigned long long count) {
+    if (type != e->curtype) {
+        encoder_flush(e);
+        e->curtype = type;
+        e->curtype_in_start = e->runend;
+        e->runlength = 0;
+    }
+    e->curtypecount += count;
+    e->runlength += count;
+    e->runend += count * typestride[type];
+}
+
+/*
+** The run planner.  Without options.merge every type change starts a new
+** record.  With it, a run of fewer than options.merge sectors next to
+** literal bytes is taken as literal bytes too: sectors found after a
+** literal run are held back as its tail until there are enough of them,
+** and a short run of sectors is turned into literal bytes if literal bytes
+** follow it.  Either way the decision only depends on the input.
+*/
+static void encoder_tail_to_literal(struct ecm_encoder *e) {
+    if (!e->tailcount) return;
+    encoder_add(e, 0, (unsigned long long) e->tailcount * typestride[e->tailtype]);
+    e->tailcount = 0;
+}
+
+static void encoder_plan(struct ecm_encoder *e, int type, unsigned count) {
+    unsigned merge = e->options.merge;
+    e->checkpos += (unsigned long long) count * typestride[type];
+    if (!merge) {
+        encoder_add(e, type, count);
+    } else if (!type) {
+        encoder_tail_to_literal(e);
+        if ((e->curtype > 0) && (e->runlength < merge)) {
+            /* Too short to have been passed on, so still all in the run being collected */
+            e->curtypecount *= typestride[e->curtype];
+            e->runlength = e->curtypecount;
+            e->curtype = 0;
+        }
+        encoder_add(e, 0, count);
+    } else if (e->curtype || !e->runlength) {
+        encoder_add(e, type, count);
+    } else {
+        unsigned n = merge - e->tailcount;
+        if (e->tailcount && (type != e->tailtype)) {
+            encoder_tail_to_literal(e);
+            n = merge;
+        }
+        e->tailtype = type;
+        if (count < n) {
+            e->tailcount += count;
+            return;
+        }
+        /* Long enough for a record of its own */
+        encoder_add(e, type, e->tailcount + count);
+        e->tailcount = 0;
+    }
+}
+
+/*
+** Classify and encode as much of the window as possible.  Until the end of
+** the input is known, that stops 2352 bytes short of the end of the window.
+*/
+static void encoder_run(struct ecm_encoder *e) {
+    unsigned char magic[4] = {'E', 'C', 'M', 0x00};
+    if (!e->started) {
+        /* Magic identifier, ending in the format version */
+        magic[3] = (unsigned char) e->options.version;
+        sink_write(&e->out, magic, 4);
+        e->started = 1;
+    }
+    e->run_start = stopwatch_now();
+    while (!e->status) {
+        size_t offset = (size_t) (e->checkpos - e->winpos);
+        size_t avail = e->winlen - offset;
+        const struct ecm_extent *x = NULL;
+        const unsigned char *p;
+        int maxspan = 0;
+        int bounded = 0;
+        int detecttype;
+        int detectcount;
+        if (!avail) break;
+        while ((e->literal_next < e->options.literal_count) &&
+               (e->literal[e->literal_next].offset + e->literal[e->literal_next].length <= e->checkpos)) {
+            e->literal_next++;
+        }
+        if (e->literal_next < e->options.literal_count) x = e->literal + e->literal_next;
+        /* Inside a literal extent, take it as it comes; before one, search only up to it */
+        if (x && (e->checkpos >= x->offset)) {
+            unsigned long long n = x->offset + x->length - e->checkpos;
+            if (n > avail) n = avail;
+            /* A one-shot window can be larger than an int; the rest comes next time round */
+            if (n > (unsigned long long) e->span) n = e->span;
+            detecttype = 0;
+            detectcount = (int) n;
+        } else {
+            if (x && (x->offset - e->checkpos <= avail)) {
+                avail = (size_t) (x->offset - e->checkpos);
+                bounded = 1;
+            }
+            if ((avail < 2352) && !e->finished && !bounded) break;
+            p = window_at(e, e->checkpos);
+            if (avail >= 2352) {
+                size_t span = avail - 2351;
+                /* Not past the copy of the start of the ring */
+                if (e->ringsize && (span > e->ringsize + ECM_WINDOW_MIRROR - 2351 - (size_t) (p - e->buffer))) {
+                    span = e->ringsize + ECM_WINDOW_MIRROR - 2351 - (size_t) (p - e->buffer);
+                }
+                maxspan = (span > (size_t) e->span) ? e->span : (int) span;
+            }
+            if (e->pool && (e->spec.next >= e->spec.count) && (maxspan >= SPEC_MIN_LENGTH)) {
+                spec_classify(&e->spec, p, maxspan);
+            }
+            if (e->pool && (e->spec.next < e->spec.count)) {
+                detecttype = e->spec.merged_type[e->spec.next];
+                detectcount = e->spec.merged_len[e->spec.next];
+                e->spec.next++;
+            } else if (avail < 2336) {
+                detecttype = 0;
+                detectcount = 1;
+            } else if (avail < 2352) {
+                detecttype = check_type(p, 0);
+                detectcount = 1;
+            } else {
+                detecttype = classify_step(p, maxspan, &detectcount);
+            }
+        }
+        encoder_plan(e, detecttype, detectcount);
+        if (e->out.error) e->status = e->out.error;
+        encoder_progress(e);
+    }
+    if (!e->status && e->finished && (e->checkpos == e->winpos + e->winlen) && !e->trailer) {
+        unsigned char edcbytes[4];
+        /* A tail left at the end follows literal bytes all the same */
+        encoder_tail_to_literal(e);
+        encoder_flush(e);
+        /* End-of-records indicator */
+        write_type_count(&e->out, e->options.version, 0, 0);
+        /* Input file EDC */
+        edcbytes[0] = (e->edc >> 0) & 0xFF;
+        edcbytes[1] = (e->edc >> 8) & 0xFF;
+        edcbytes[2] = (e->edc >> 16) & 0xFF;
+        edcbytes[3] = (e->edc >> 24) & 0xFF;
+        sink_write(&e->out, edcbytes, 4);
+        /* Seek index */
+        if (e->options.index) index_write(&e->index, &e->out, e->checkpos, e->edc);
+        if (e->out.error && !e->status) e->status = e->out.error;
+        e->trailer = 1;
+        if (e->options.progress) {
+            e->progress_next = 0;
+            encoder_progress(e);
+        }
+    }
+    e->run_seconds += stopwatch_now() - e->run_start;
+    e->run_start = 0;
+}
+
+struct ecm_encoder *ecm_encoder_create(const struct ecm_encoder_options *options) {
+    struct ecm_encoder *e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    eccedc_init();
+    if (options) e->options = *options;
+    if ((e->options.version > ECM_FORMAT_VERSION) || (e->options.merge > ECM_MERGE_MAX) ||
+        (e->options.window && (e->options.window < ECM_WINDOW_MIN))) {
+        free(e);
+        return NULL;
+    }
+    if (e->options.literal_count) {
+        unsigned i;
+        for (i = 0; i < e->options.literal_count; i++) {
+            const struct ecm_extent *x = e->options.literal + i;
+            if ((x->length > ~0ULL - x->offset) ||
+                (i && (x->offset < x[-1].offset + x[-1].length))) {
+                free(e);
+                return NULL;
+            }
+        }
+        e->literal = malloc(e->options.literal_count * sizeof(*e->literal));
+        if (!e->literal) {
+            free(e);
+            return NULL;
+        }
+        memcpy(e->literal, e->options.literal, e->options.literal_count * sizeof(*e->literal));
+        e->options.literal = e->literal;
+    }
+    e->curtype = -1;
+    e->rectype = -1;
+    e->span = ECM_WINDOW_SIZE;
+    if (e->options.window) e->span = (e->options.window > ECM_SPAN_MAX) ? ECM_SPAN_MAX : (int) e->options.window;
+    if (e->options.threads > 1) {
+        e->pool = threadpool_create(e->options.threads);
+        if (!e->pool || !spec_init(&e->spec, e->pool, e->span)) {
+            ecm_encoder_destroy(e);
+            return NULL;
+        }
+    }
+    return e;
+}
+
+void ecm_encoder_destroy(struct ecm_encoder *enc) {
+    if (!enc) return;
+    threadpool_destroy(enc->pool);
+    spec_free(&enc->spec);
+    free(enc->buffer);
+    if (!enc->out.fixed) free(enc->out.buf);
+    free(enc->spill.buf);
+    if (enc->spillfile) fclose(enc->spillfile);
+    free(enc->index.entries);
+    free(enc->index.checks);
+    free(enc->literal);
+    free(enc);
+}
+
+/* Append to the ring, copying what lands at its start past its end as well */
+static void window_write(struct ecm_encoder *e, const unsigned char *src, size_t n) {
+    while (n) {
+        size_t at = (size_t) ((e->winpos + e->winlen) % e->ringsize);
+        size_t m = e->ringsize - at;
+        if (m > n) m = n;
+        memcpy(e->buffer + at, src, m);
+        if (at < ECM_WINDOW_MIRROR) memcpy(e->buffer + e->ringsize + at, src, (m < ECM_WINDOW_MIRROR - at) ? m : ECM_WINDOW_MIRROR - at);
+        e->winlen += m;
+        src += m;
+        n -= m;
+    }
+}
+
+size_t ecm_encoder_push(struct ecm_encoder *enc, const void *buf, size_t len) {
+    unsigned long long keep;
+    size_t n;
+    if (enc->status || enc->finished || enc->out.fixed) return 0;
+    /* Make the caller pull what is already there first */
+    if (enc->spillleft || (enc->out.pos - enc->out.head >= ECM_WINDOW_SIZE)) return 0;
+    if (!enc->buffer) {
+        size_t size = enc->options.window ? enc->options.window : ECM_WINDOW_SIZE;
+        enc->buffer = (size <= SIZE_MAX - ECM_WINDOW_MIRROR) ? malloc(size + ECM_WINDOW_MIRROR) : NULL;
+        if (!enc->buffer) {
+            enc->status = ECM_ERROR_MEMORY;
+            return 0;
+        }
+        enc->ringsize = size;
+    }
+    /* Past half full with what is not yet written, spill the open record */
+    if (enc->winpos + enc->winlen - encoder_keep(enc) > enc->ringsize / 2) {
+        encoder_spill(enc);
+        if (enc->status) return 0;
+    }
+    keep = encoder_keep(enc);
+    enc->winlen -= (size_t) (keep - enc->winpos);
+    enc->winpos = keep;
+    n = enc->ringsize - enc->winlen;
+    if (n > len) n = len;
+    window_write(enc, buf, n);
+    enc->in_bytes += n;
+    encoder_run(enc);
+    return n;
+}
+
+void ecm_encoder_finish(struct ecm_encoder *enc) {
+    if (enc->out.fixed) return;
+    enc->finished = 1;
+    encoder_run(enc);
+}
+
+size_t ecm_encoder_pull(struct ecm_encoder *enc, void *buf, size_t len) {
+    unsigned char *p = buf;
+    size_t n = 0;
+    if (enc->out.fixed) return 0;
+    while (n < len) {
+        /* A spilled record body goes between its header and what follows it */
+        size_t m = (enc->spillleft ? enc->out.split : enc->out.pos) - enc->out.head;
+        if (m > len - n) m = len - n;
+        memcpy(p + n, enc->out.buf + enc->out.head, m);
+        enc->out.head += m;
+        n += m;
+        if (!enc->spillleft || (n == len)) break;
+        m = (enc->spillleft < len - n) ? (size_t) enc->spillleft : len - n;
+        if (fread(p + n, 1, m, enc->spillfile) != m) {
+            enc->status = ECM_ERROR_IO;
+            enc->spillleft = 0;
+            break;
+        }
+        n += m;
+        enc->spillleft -= m;
+        if (!enc->spillleft) rewind(enc->spillfile);
+    }
+    if ((enc->out.head == enc->out.pos) && !enc->spillleft) {
+        enc->out.head = 0;
+        enc->out.pos = 0;
+        if (!enc->status && enc->trailer) enc->status = ECM_DONE;
+    }
+    return n;
+}
+
+int ecm_encoder_status(const struct ecm_encoder *enc) {
+    return enc->status;
+}
+
+size_t ecm_encode_bound(size_t len, int index) {
+    /*
+    ** Every sector record saves more than its own header and the literal
+    ** header in front of it, and literal records end early (see
+    ** RECORD_MAX) at most every ECM_INDEX_INTERVAL bytes
+    */
+    size_t bound = len + len / 1024 + 64;
+    if (index) {
+        bound += (len / ECM_INDEX_INTERVAL + 1) * (ECM_INDEX_ENTRY + ECM_CHECKSUM_ENTRY);
+        bound += ECM_CHECKSUM_FOOTER + ECM_INDEX_FOOTER;
+    }
+    return bound;
+}
+
+int ecm_encoder_encode_buffer(
+        struct ecm_encoder *enc,
+        const void *in,
+        size_t len,
+        void *out,
+        size_t outsize,
+        size_t *outlen
+) {
+    if (enc->started || enc->buffer) return enc->status = ECM_ERROR_STATE;
+    enc->out.buf = out;
+    enc->out.size = outsize;
+    enc->out.fixed = 1;
+    enc->window = in;
+    enc->winlen = len;
+    enc->in_bytes = len;
+    enc->finished = 1;
+    encoder_run(enc);
+    *outlen = enc->out.pos;
+    if (!enc->status) enc->status = ECM_DONE;
+    return enc->status;
+}
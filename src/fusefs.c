@@ -0,0 +1,312 @@
+/***************************************************************************/
+/*
+** UNECM-FUSE - ECM files as raw images, read-only, through FUSE
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#define FUSE_USE_VERSION 31
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ecmformat.h"
+#include "image.h"
+#include "unecm.h"
+
+/***************************************************************************/
+
+/* The directory shown, as an absolute path */
+static char *root;
+static struct image_cache *cache;
+
+/*
+** Image sizes found so far, by ECM file, so that listing a directory does not
+** walk the files without a seek index again every time
+*/
+struct known_size {
+    struct known_size *next;
+    char *path;
+    time_t mtime;
+    off_t ecmsize;
+    unsigned long long size;
+};
+static struct known_size *sizes;
+
+/* An open file: passed through, or an image */
+struct handle {
+    int fd;
+    FILE *in;
+    struct image *img;
+};
+
+static int ecm_suffix(const char *name) {
+    size_t n = strlen(name);
+    return (n > 4) && !strcasecmp(name + n - 4, ".ecm");
+}
+
+/* Whether the file is an uncompressed ECM file, which can be read at random */
+static int plain_ecm(const char *path) {
+    unsigned char magic[4];
+    FILE *f = fopen(path, "rb");
+    int ok;
+    if (!f) return 0;
+    ok = (fread(magic, 1, 4, f) == 4) && !memcmp(magic, "ECM", 3) && (magic[3] <= ECM_FORMAT_VERSION);
+    fclose(f);
+    return ok;
+}
+
+/*
+** Where a path in the mount comes from.  Everything under root shows up as
+** it is, except that a plain ECM file named something.ecm shows up as the
+** image, named something, unless a real file has that name.  Puts the real
+** path in real and returns 0, or returns -errno.
+*/
+static int resolve(const char *path, char *real, struct stat *st, int *image) {
+    int n = snprintf(real, PATH_MAX, "%s%s", root, path);
+    *image = 0;
+    if ((n < 0) || (n + 4 >= PATH_MAX)) return -ENAMETOOLONG;
+    if (!stat(real, st)) {
+        struct stat other;
+        int taken;
+        if (!S_ISREG(st->st_mode) || !ecm_suffix(real) || !plain_ecm(real)) return 0;
+        real[n - 4] = 0;
+        taken = !stat(real, &other);
+        real[n - 4] = '.';
+        return taken ? 0 : -ENOENT;
+    }
+    strcat(real, ".ecm");
+    if (stat(real, st) || !S_ISREG(st->st_mode) || !plain_ecm(real)) return -ENOENT;
+    *image = 1;
+    return 0;
+}
+
+static int size_of_image(const char *real, const struct stat *st, unsigned long long *size) {
+    struct known_size *k;
+    struct image *img;
+    FILE *in;
+    int status;
+    for (k = sizes; k; k = k->next) {
+        if (!strcmp(k->path, real) && (k->mtime == st->st_mtime) && (k->ecmsize == st->st_size)) {
+            *size = k->size;
+            return 0;
+        }
+    }
+    in = fopen(real, "rb");
+    if (!in) return -errno;
+    img = image_open(in, cache, &status);
+    if (!img) {
+        fprintf(stderr, "%s: %s\n", real, ecm_status_string(status));
+        fclose(in);
+        return -EIO;
+    }
+    *size = image_size(img);
+    image_close(img);
+    fclose(in);
+    k = calloc(1, sizeof(*k));
+    if (k && (k->path = strdup(real))) {
+        k->mtime = st->st_mtime;
+        k->ecmsize = st->st_size;
+        k->size = *size;
+        k->next = sizes;
+        sizes = k;
+    } else {
+        free(k);
+    }
+    return 0;
+}
+
+/***************************************************************************/
+
+static int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    char real[PATH_MAX];
+    int image;
+    int r = resolve(path, real, st, &image);
+    (void) fi;
+    if (r) return r;
+    if (image) {
+        unsigned long long size;
+        r = size_of_image(real, st, &size);
+        if (r) return r;
+        st->st_size = (off_t) size;
+        st->st_blocks = (blkcnt_t) ((size + 511) / 512);
+    }
+    st->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+    return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    char real[PATH_MAX];
+    struct dirent *e;
+    DIR *d;
+    (void) offset;
+    (void) fi;
+    (void) flags;
+    if (snprintf(real, sizeof(real), "%s%s", root, path) >= (int) sizeof(real)) return -ENAMETOOLONG;
+    d = opendir(real);
+    if (!d) return -errno;
+    while ((e = readdir(d))) {
+        const char *name = e->d_name;
+        char full[PATH_MAX];
+        char shown[PATH_MAX];
+        struct stat st;
+        int n = snprintf(full, sizeof(full), "%s/%s", real, e->d_name);
+        if ((n > 0) && (n < (int) sizeof(full)) && ecm_suffix(e->d_name) &&
+            !stat(full, &st) && S_ISREG(st.st_mode) && plain_ecm(full)) {
+            /* Shown as the image, unless a real file has its name */
+            full[n - 4] = 0;
+            if (stat(full, &st)) {
+                size_t len = strlen(e->d_name) - 4;
+                memcpy(shown, e->d_name, len);
+                shown[len] = 0;
+                name = shown;
+            }
+        }
+        if (filler(buf, name, NULL, 0, 0)) break;
+    }
+    closedir(d);
+    return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+    char real[PATH_MAX];
+    struct handle *h;
+    struct stat st;
+    int image;
+    int status;
+    int r;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+    r = resolve(path, real, &st, &image);
+    if (r) return r;
+    h = calloc(1, sizeof(*h));
+    if (!h) return -ENOMEM;
+    h->fd = -1;
+    if (!image) {
+        h->fd = open(real, O_RDONLY);
+        if (h->fd < 0) {
+            r = -errno;
+            free(h);
+            return r;
+        }
+    } else {
+        h->in = fopen(real, "rb");
+        if (!h->in) {
+            r = -errno;
+            free(h);
+            return r;
+        }
+        h->img = image_open(h->in, cache, &status);
+        if (!h->img) {
+            fprintf(stderr, "%s: %s\n", real, ecm_status_string(status));
+            fclose(h->in);
+            free(h);
+            return -EIO;
+        }
+        /* What was read stays valid as long as the ECM file doesn't change */
+        fi->keep_cache = 1;
+    }
+    fi->fh = (uint64_t) (uintptr_t) h;
+    return 0;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct handle *h = (struct handle *) (uintptr_t) fi->fh;
+    long long n;
+    if (h->fd >= 0) {
+        ssize_t got = pread(h->fd, buf, size, offset);
+        return (got < 0) ? -errno : (int) got;
+    }
+    n = image_read(h->img, buf, size, (unsigned long long) offset);
+    if (n < 0) {
+        fprintf(stderr, "%s: %s at byte %lld\n", path, ecm_status_string((int) n), (long long) offset);
+        return -EIO;
+    }
+    return (int) n;
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi) {
+    struct handle *h = (struct handle *) (uintptr_t) fi->fh;
+    (void) path;
+    if (h->fd >= 0) close(h->fd);
+    image_close(h->img);
+    if (h->in) fclose(h->in);
+    free(h);
+    return 0;
+}
+
+static const struct fuse_operations operations = {
+        .getattr = fs_getattr,
+        .readdir = fs_readdir,
+        .open = fs_open,
+        .read = fs_read,
+        .release = fs_release,
+};
+
+/***************************************************************************/
+
+static void usage(const char *progname) {
+    fprintf(stderr, "usage: %s [--cache MB] ecmdir mountpoint [FUSE options]\n", progname);
+}
+
+int main(int argc, char **argv) {
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    unsigned long cachemb = 64;
+    int argi = 1;
+    int i, r;
+    while ((argi < argc) && !strncmp(argv[argi], "--", 2)) {
+        if (!strcmp(argv[argi], "--cache") && (argi + 1 < argc)) {
+            char *end;
+            cachemb = strtoul(argv[argi + 1], &end, 10);
+            if (*end || (argv[argi + 1][0] == '-') || (cachemb > (SIZE_MAX >> 20))) {
+                fprintf(stderr, "invalid cache size '%s'\n", argv[argi + 1]);
+                return 1;
+            }
+            argi += 2;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - argi < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    /* FUSE changes to / once it is running in the background */
+    root = realpath(argv[argi], NULL);
+    if (!root) {
+        perror(argv[argi]);
+        return 1;
+    }
+    cache = image_cache_create((size_t) cachemb << 20);
+    if (!cache) abort();
+    fuse_opt_add_arg(&args, argv[0]);
+    for (i = argi + 1; i < argc; i++) fuse_opt_add_arg(&args, argv[i]);
+    /* One request at a time, since the images and the cache aren't thread-safe */
+    fuse_opt_add_arg(&args, "-s");
+    fuse_opt_add_arg(&args, "-oro");
+    r = fuse_main(args.argc, args.argv, &operations, NULL);
+    fuse_opt_free_args(&args);
+    image_cache_destroy(cache);
+    while (sizes) {
+        struct known_size *next = sizes->next;
+        free(sizes->path);
+        free(sizes);
+        sizes = next;
+    }
+    free(root);
+    return r;
+}
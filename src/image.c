@@ -0,0 +1,439 @@
+/***************************************************************************/
+/*
+** Random access to the image in an ECM file, for the ECM tools
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eccedc.h"
+#include "ecmformat.h"
+#include "image.h"
+#include "largefile.h"
+#include "unecm.h"
+
+/***************************************************************************/
+
+static unsigned get_le32(const unsigned char *p) {
+    return p[0] | ((unsigned) p[1] << 8) | ((unsigned) p[2] << 16) | ((unsigned) p[3] << 24);
+}
+
+static unsigned long long get_le64(const unsigned char *p) {
+    unsigned long long v = 0;
+    int i;
+    for (i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+void trailer_free(struct trailer *t) {
+    free(t->image);
+    free(t->ecm);
+    free(t->edc);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Read the block checksums ending at offset end, if there are n of them */
+static void trailer_load_checks(FILE *in, long long end, struct trailer *t) {
+    unsigned char buf[ECM_CHECKSUM_FOOTER];
+    unsigned i;
+    if (end - 4 < ECM_CHECKSUM_FOOTER + (long long) t->count * ECM_CHECKSUM_ENTRY) return;
+    if (file_seek(in, end - ECM_CHECKSUM_FOOTER, SEEK_SET)) return;
+    if (fread(buf, 1, ECM_CHECKSUM_FOOTER, in) != ECM_CHECKSUM_FOOTER) return;
+    if (memcmp(buf + 4, "ECMC", 4) || (get_le32(buf) != t->count)) return;
+    if (file_seek(in, end - ECM_CHECKSUM_FOOTER - (long long) t->count * ECM_CHECKSUM_ENTRY, SEEK_SET)) return;
+    t->edc = malloc((t->count + 1) * sizeof(*t->edc));
+    if (!t->edc) abort();
+    for (i = 0; i < t->count; i++) {
+        if (fread(buf, 1, ECM_CHECKSUM_ENTRY, in) != ECM_CHECKSUM_ENTRY) {
+            free(t->edc);
+            t->edc = NULL;
+            return;
+        }
+        t->edc[i] = get_le32(buf);
+    }
+}
+
+int trailer_load(FILE *in, struct trailer *t) {
+    unsigned char buf[ECM_INDEX_FOOTER];
+    unsigned long long n, i;
+    long long filesize, entries;
+    memset(t, 0, sizeof(*t));
+    if (file_seek(in, 0, SEEK_END)) return 0;
+    filesize = file_tell(in);
+    if (filesize < 4 + ECM_INDEX_FOOTER) return 0;
+    if (file_seek(in, filesize - ECM_INDEX_FOOTER, SEEK_SET)) return 0;
+    if (fread(buf, 1, ECM_INDEX_FOOTER, in) != ECM_INDEX_FOOTER) return 0;
+    if (memcmp(buf + 12, "ECMI", 4)) return 0;
+    n = get_le32(buf + 8);
+    if (!n || (n > (unsigned long long) (filesize - 4 - ECM_INDEX_FOOTER) / ECM_INDEX_ENTRY)) return 0;
+    entries = filesize - ECM_INDEX_FOOTER - (long long) n * ECM_INDEX_ENTRY;
+    if (file_seek(in, entries, SEEK_SET)) return 0;
+    t->count = (unsigned) n;
+    t->image = malloc((n + 1) * sizeof(*t->image));
+    t->ecm = malloc(n * sizeof(*t->ecm));
+    if (!t->image || !t->ecm) abort();
+    t->image[n] = get_le64(buf);
+    for (i = 0; i < n; i++) {
+        if (fread(buf, 1, ECM_INDEX_ENTRY, in) != ECM_INDEX_ENTRY) break;
+        t->image[i] = get_le64(buf);
+        t->ecm[i] = get_le64(buf + 8);
+        /* Entries must be in order, within the image and the file */
+        if ((t->image[i] > t->image[n]) || (i && (t->image[i] < t->image[i - 1]))) break;
+        if ((t->ecm[i] < 4) || (t->ecm[i] >= (unsigned long long) entries)) break;
+    }
+    if (i < n) {
+        trailer_free(t);
+        return 0;
+    }
+    trailer_load_checks(in, entries, t);
+    return 1;
+}
+
+/***************************************************************************/
+/*
+** Block cache: a list with the most recently used block first
+*/
+
+struct cache_block {
+    struct cache_block *prev;
+    struct cache_block *next;
+    const struct image *img;
+    unsigned index;
+    size_t size;
+    unsigned char *data;
+};
+
+struct image_cache {
+    size_t limit;
+    size_t used;
+    struct cache_block *first;
+    struct cache_block *last;
+};
+
+struct image_cache *image_cache_create(size_t size) {
+    struct image_cache *cache = calloc(1, sizeof(*cache));
+    if (cache) cache->limit = size;
+    return cache;
+}
+
+static void cache_unlink(struct image_cache *cache, struct cache_block *b) {
+    if (b->prev) b->prev->next = b->next; else cache->first = b->next;
+    if (b->next) b->next->prev = b->prev; else cache->last = b->prev;
+}
+
+static void cache_push_front(struct image_cache *cache, struct cache_block *b) {
+    b->prev = NULL;
+    b->next = cache->first;
+    if (cache->first) cache->first->prev = b; else cache->last = b;
+    cache->first = b;
+}
+
+static void cache_drop(struct image_cache *cache, struct cache_block *b) {
+    cache_unlink(cache, b);
+    cache->used -= b->size;
+    free(b->data);
+    free(b);
+}
+
+static struct cache_block *cache_find(struct image_cache *cache, const struct image *img, unsigned index) {
+    struct cache_block *b;
+    for (b = cache->first; b; b = b->next) {
+        if ((b->img == img) && (b->index == index)) {
+            cache_unlink(cache, b);
+            cache_push_front(cache, b);
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/* Take a decoded block, dropping old ones to make room; the newest is always kept */
+static void cache_add(struct image_cache *cache, struct cache_block *b) {
+    cache_push_front(cache, b);
+    cache->used += b->size;
+    while ((cache->used > cache->limit) && (cache->last != b)) cache_drop(cache, cache->last);
+}
+
+/* Drop the blocks of one image */
+static void cache_forget(struct image_cache *cache, const struct image *img) {
+    struct cache_block *b = cache->first;
+    while (b) {
+        struct cache_block *next = b->next;
+        if (b->img == img) cache_drop(cache, b);
+        b = next;
+    }
+}
+
+void image_cache_destroy(struct image_cache *cache) {
+    if (!cache) return;
+    while (cache->first) cache_drop(cache, cache->first);
+    free(cache);
+}
+
+/***************************************************************************/
+
+struct image {
+    FILE *in;
+    struct image_cache *cache;
+    unsigned version;
+    int indexed;
+    /*
+    ** blocks.ecm[i] is the offset of the header of the record block i starts
+    ** in, and start[i] where in the image that record starts: a walk can
+    ** start a block partway through a long record.  With a seek index each
+    ** block starts at a record, and start is blocks.image.
+    */
+    struct trailer blocks;
+    unsigned long long *start;
+};
+
+/*
+** Read a type/count combo in the given format version, by the same rules as
+** the decoder's parse_type_count(); returns 0 at EOF, or -1 if it runs on
+** past five bytes
+*/
+static int read_type_count(FILE *in, unsigned version, unsigned *type, unsigned *num) {
+    int c = fgetc(in);
+    int bits = version ? 4 : 5;
+    int i = 1;
+    if (c == EOF) return 0;
+    if (version) {
+        *type = c & 7;
+        *num = (c >> 3) & 0x0F;
+    } else {
+        *type = c & 3;
+        *num = (c >> 2) & 0x1F;
+    }
+    while (c & 0x80) {
+        if (i++ == 5) return -1;
+        c = fgetc(in);
+        if (c == EOF) return 0;
+        *num |= ((unsigned) (c & 0x7F)) << bits;
+        bits += 7;
+    }
+    return 1;
+}
+
+/* Read the next record header and check it; *num is 0 at the end of the records */
+static int read_record(struct image *img, unsigned *type, unsigned *num) {
+    int r = read_type_count(img->in, img->version, type, num);
+    if (r <= 0) return r ? ECM_ERROR_CORRUPT : ECM_ERROR_TRUNCATED;
+    if (*num == 0xFFFFFFFF) {
+        *num = 0;
+        return 0;
+    }
+    (*num)++;
+    if ((*num >= 0x80000000) || (*type >= ECM_RECORD_TYPES(img->version))) return ECM_ERROR_CORRUPT;
+    return 0;
+}
+
+static void image_add_block(struct image *img, unsigned *capacity, unsigned long long pos,
+                            unsigned long long header, unsigned long long recstart) {
+    struct trailer *t = &img->blocks;
+    if (t->count + 1 >= *capacity) {
+        unsigned n = *capacity ? *capacity * 2 : 64;
+        unsigned long long *image = realloc(t->image, n * sizeof(*image));
+        unsigned long long *ecm = realloc(t->ecm, n * sizeof(*ecm));
+        unsigned long long *start = realloc(img->start, n * sizeof(*start));
+        if (!image || !ecm || !start) abort();
+        t->image = image;
+        t->ecm = ecm;
+        img->start = start;
+        *capacity = n;
+    }
+    t->image[t->count] = pos;
+    t->ecm[t->count] = header;
+    img->start[t->count] = recstart;
+    t->count++;
+}
+
+/* Find blocks for a file without a seek index, skipping over the records' data */
+static int image_walk(struct image *img) {
+    unsigned long long pos = 0;
+    unsigned long long next = 0;
+    unsigned capacity = 0;
+    if (file_seek(img->in, 4, SEEK_SET)) return ECM_ERROR_TRUNCATED;
+    for (;;) {
+        long long header = file_tell(img->in);
+        unsigned long long size;
+        unsigned type, num;
+        int r = read_record(img, &type, &num);
+        if (r) return r;
+        if (!num) break;
+        size = (unsigned long long) num * ecm_decoded_unit(type);
+        /* A block starts at the first unit at or past every interval */
+        while (next < pos + size) {
+            unsigned unit = ecm_decoded_unit(type);
+            unsigned long long from = (next > pos) ? pos + (next - pos + unit - 1) / unit * unit : pos;
+            image_add_block(img, &capacity, from, (unsigned long long) header, pos);
+            next = from + ECM_INDEX_INTERVAL;
+        }
+        if (file_seek(img->in, ecm_prefix_size(type) + (long long) num * ecm_stored_size(type), SEEK_CUR)) {
+            return ECM_ERROR_TRUNCATED;
+        }
+        pos += size;
+    }
+    if (!img->blocks.count) image_add_block(img, &capacity, 0, 0, 0);
+    img->blocks.image[img->blocks.count] = pos;
+    return 0;
+}
+
+struct image *image_open(FILE *in, struct image_cache *cache, int *status) {
+    unsigned char magic[4];
+    struct image *img;
+    int r;
+    *status = ECM_ERROR_HEADER;
+    if (file_seek(in, 0, SEEK_SET) || (fread(magic, 1, 4, in) != 4)) return NULL;
+    if (memcmp(magic, "ECM", 3) || (magic[3] > ECM_FORMAT_VERSION)) return NULL;
+    eccedc_init();
+    img = calloc(1, sizeof(*img));
+    if (!img) {
+        *status = ECM_ERROR_MEMORY;
+        return NULL;
+    }
+    img->in = in;
+    img->cache = cache;
+    img->version = magic[3];
+    img->indexed = trailer_load(in, &img->blocks);
+    if (img->indexed) {
+        img->start = img->blocks.image;
+    } else if ((r = image_walk(img))) {
+        *status = r;
+        image_close(img);
+        return NULL;
+    }
+    *status = ECM_OK;
+    return img;
+}
+
+void image_close(struct image *img) {
+    if (!img) return;
+    cache_forget(img->cache, img);
+    if (img->start != img->blocks.image) free(img->start);
+    trailer_free(&img->blocks);
+    free(img);
+}
+
+unsigned long long image_size(const struct image *img) {
+    return img->blocks.image[img->blocks.count];
+}
+
+int image_indexed(const struct image *img) {
+    return img->indexed;
+}
+
+/***************************************************************************/
+
+/* Decode block i into out */
+static int image_decode(struct image *img, unsigned i, unsigned char *out) {
+    unsigned char stored[0x918];
+    unsigned char sector[2352];
+    unsigned long long from = img->blocks.image[i];
+    unsigned long long end = img->blocks.image[i + 1];
+    unsigned long long pos = img->start[i];
+    if (file_seek(img->in, (long long) img->blocks.ecm[i], SEEK_SET)) return ECM_ERROR_TRUNCATED;
+    while (pos < end) {
+        unsigned long long skip = 0;
+        unsigned type, num, unit;
+        size_t prefix;
+        int r = read_record(img, &type, &num);
+        if (r) return r;
+        /* The records end before the block does */
+        if (!num) return ECM_ERROR_CORRUPT;
+        prefix = ecm_prefix_size(type);
+        unit = ecm_decoded_unit(type);
+        if (fread(stored, 1, prefix, img->in) != prefix) return ECM_ERROR_TRUNCATED;
+        /* Skip whole units before the block without reading them */
+        if (from > pos) {
+            skip = (from - pos) / unit;
+            if (skip > num) skip = num;
+        }
+        if (file_seek(img->in, (long long) skip * ecm_stored_size(type), SEEK_CUR)) return ECM_ERROR_TRUNCATED;
+        if ((type == 4) || (type == 5)) ecm_address_advance(stored, skip);
+        pos += skip * unit;
+        num -= (unsigned) skip;
+        if (!num) continue;
+        if (!type) {
+            size_t n = (num > end - pos) ? (size_t) (end - pos) : num;
+            if (fread(out + (size_t) (pos - from), 1, n, img->in) != n) return ECM_ERROR_TRUNCATED;
+            pos += n;
+            continue;
+        }
+        while (num-- && (pos < end)) {
+            if (fread(stored + prefix, 1, ecm_stored_size(type), img->in) != ecm_stored_size(type)) {
+                return ECM_ERROR_TRUNCATED;
+            }
+            if ((pos >= from) && (end - pos >= unit)) {
+                ecm_sector_rebuild(type, stored, out + (size_t) (pos - from));
+            } else {
+                /* A unit only partly in the block */
+                size_t a = (from > pos) ? (size_t) (from - pos) : 0;
+                size_t b = (end - pos < unit) ? (size_t) (end - pos) : unit;
+                ecm_sector_rebuild(type, stored, sector);
+                memcpy(out + (size_t) (pos + a - from), sector + a, b - a);
+            }
+            if ((type == 4) || (type == 5)) ecm_address_next(stored);
+            pos += unit;
+        }
+    }
+    if (img->blocks.edc && (edc_partial_computeblock(0, out, (size_t) (end - from)) != img->blocks.edc[i])) {
+        return ECM_ERROR_EDC;
+    }
+    return 0;
+}
+
+/* The block holding image offset pos, which must be inside the image */
+static unsigned image_block(const struct image *img, unsigned long long pos) {
+    unsigned lo = 0;
+    unsigned hi = img->blocks.count;
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (img->blocks.image[mid] <= pos) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+long long image_read(struct image *img, void *buf, size_t len, unsigned long long offset) {
+    unsigned char *dst = buf;
+    unsigned long long size = image_size(img);
+    size_t done = 0;
+    if (offset >= size) return 0;
+    if (len > size - offset) len = (size_t) (size - offset);
+    while (done < len) {
+        unsigned long long pos = offset + done;
+        unsigned i = image_block(img, pos);
+        struct cache_block *b = cache_find(img->cache, img, i);
+        size_t n;
+        if (!b) {
+            int r;
+            b = calloc(1, sizeof(*b));
+            if (!b) return ECM_ERROR_MEMORY;
+            b->img = img;
+            b->index = i;
+            b->size = (size_t) (img->blocks.image[i + 1] - img->blocks.image[i]);
+            b->data = malloc(b->size ? b->size : 1);
+            if (!b->data) {
+                free(b);
+                return ECM_ERROR_MEMORY;
+            }
+            r = image_decode(img, i, b->data);
+            if (r) {
+                free(b->data);
+                free(b);
+                return r;
+            }
+            cache_add(img->cache, b);
+        }
+        n = (size_t) (img->blocks.image[i + 1] - pos);
+        if (n > len - done) n = len - done;
+        memcpy(dst + done, b->data + (size_t) (pos - img->blocks.image[i]), n);
+        done += n;
+    }
+    return (long long) done;
+}
@@ -0,0 +1,163 @@
+/***************************************************************************/
+/*
+** Whole-file memory mappings for the ECM tools
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#include <string.h>
+#include "mapfile.h"
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+static void mapfile_reset(struct mapfile *m, int writable) {
+    memset(m, 0, sizeof(*m));
+    m->writable = writable;
+    m->file = INVALID_HANDLE_VALUE;
+}
+
+static int mapfile_view(struct mapfile *m) {
+    LARGE_INTEGER size;
+    size.QuadPart = (LONGLONG) m->size;
+    if (!m->size) return 0;
+    m->mapping = CreateFileMappingA(
+            m->file, NULL, m->writable ? PAGE_READWRITE : PAGE_READONLY,
+            (DWORD) (size.QuadPart >> 32), (DWORD) size.QuadPart, NULL
+    );
+    if (!m->mapping) return -1;
+    m->data = MapViewOfFile(m->mapping, m->writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, m->size);
+    return m->data ? 0 : -1;
+}
+
+int mapfile_open_read(struct mapfile *m, const char *path) {
+    LARGE_INTEGER size;
+    mapfile_reset(m, 0);
+    m->file = CreateFileA(
+            path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL
+    );
+    if (m->file == INVALID_HANDLE_VALUE) return -1;
+    if (!GetFileSizeEx(m->file, &size) || ((unsigned long long) size.QuadPart > (size_t) -1)) {
+        mapfile_close(m, 0);
+        return -1;
+    }
+    m->size = (size_t) size.QuadPart;
+    if (mapfile_view(m)) {
+        mapfile_close(m, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int mapfile_create(struct mapfile *m, const char *path, size_t size) {
+    mapfile_reset(m, 1);
+    m->file = CreateFileA(
+            path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL
+    );
+    if (m->file == INVALID_HANDLE_VALUE) return -1;
+    m->size = size;
+    if (mapfile_view(m)) {
+        mapfile_close(m, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int mapfile_close(struct mapfile *m, size_t finalsize) {
+    int r = 0;
+    if (m->data) {
+        if (m->writable && !FlushViewOfFile(m->data, 0)) r = -1;
+        UnmapViewOfFile(m->data);
+    }
+    if (m->mapping) CloseHandle(m->mapping);
+    if (m->file != INVALID_HANDLE_VALUE) {
+        if (m->writable) {
+            LARGE_INTEGER end;
+            end.QuadPart = (LONGLONG) finalsize;
+            if (!SetFilePointerEx(m->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(m->file)) r = -1;
+        }
+        CloseHandle(m->file);
+    }
+    mapfile_reset(m, 0);
+    return r;
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void mapfile_reset(struct mapfile *m, int writable) {
+    memset(m, 0, sizeof(*m));
+    m->writable = writable;
+    m->fd = -1;
+}
+
+static int mapfile_view(struct mapfile *m) {
+    void *p;
+    if (!m->size) return 0;
+    p = mmap(
+            NULL, m->size, m->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED, m->fd, 0
+    );
+    if (p == MAP_FAILED) return -1;
+    m->data = p;
+#if defined(MADV_SEQUENTIAL)
+    madvise(p, m->size, MADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
+int mapfile_open_read(struct mapfile *m, const char *path) {
+    struct stat st;
+    mapfile_reset(m, 0);
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0) return -1;
+    if (fstat(m->fd, &st) || ((unsigned long long) st.st_size > (size_t) -1)) {
+        mapfile_close(m, 0);
+        return -1;
+    }
+    m->size = (size_t) st.st_size;
+    if (mapfile_view(m)) {
+        mapfile_close(m, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int mapfile_create(struct mapfile *m, const char *path, size_t size) {
+    mapfile_reset(m, 1);
+    m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (m->fd < 0) return -1;
+    m->size = size;
+    if (ftruncate(m->fd, (off_t) size) || mapfile_view(m)) {
+        mapfile_close(m, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int mapfile_close(struct mapfile *m, size_t finalsize) {
+    int r = 0;
+    if (m->data) {
+        if (m->writable && msync(m->data, m->size, MS_SYNC)) r = -1;
+        munmap(m->data, m->size);
+    }
+    if (m->fd >= 0) {
+        if (m->writable && ftruncate(m->fd, (off_t) finalsize)) r = -1;
+        if (close(m->fd)) r = -1;
+    }
+    mapfile_reset(m, 0);
+    return r;
+}
+
+#endif
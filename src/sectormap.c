@@ -0,0 +1,186 @@
+/***************************************************************************/
+/*
+** Sector maps for the ECM tools
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "sectormap.h"
+
+/***************************************************************************/
+
+static const char *const kind_name[4] = {"LITERAL", "MODE1", "MODE2/2336", "MODE2/2352"};
+static const unsigned kind_size[4] = {1, 2352, 2336, 2352};
+/* As tracks of a CUE sheet */
+static const char *const cue_mode[4] = {"AUDIO", "MODE1/2352", "MODE2/2336", "MODE2/2352"};
+static const unsigned cue_size[4] = {2352, 2352, 2336, 2352};
+
+/* What each record type holds */
+static const enum sector_kind record_kind[8] = {
+        SECTOR_LITERAL, SECTOR_MODE1, SECTOR_MODE2, SECTOR_MODE2,
+        SECTOR_MODE1, SECTOR_MODE1, SECTOR_MODE2, SECTOR_MODE2
+};
+
+static unsigned long long run_end(const struct sector_run *r) {
+    return r->offset + r->count * kind_size[r->kind];
+}
+
+/* Add a run, onto the last one if it carries on from it */
+static void map_add(struct sector_map *m, enum sector_kind kind, unsigned long long offset, unsigned long long count) {
+    struct sector_run *r = m->count ? m->runs + m->count - 1 : NULL;
+    if (r && (r->kind == kind) && (run_end(r) == offset)) {
+        r->count += count;
+        return;
+    }
+    if (m->count == m->capacity) {
+        unsigned capacity = m->capacity ? m->capacity * 2 : 64;
+        r = realloc(m->runs, capacity * sizeof(*r));
+        if (!r) abort();
+        m->runs = r;
+        m->capacity = capacity;
+    }
+    r = m->runs + m->count++;
+    r->offset = offset;
+    r->count = count;
+    r->kind = kind;
+}
+
+void sector_map_record(void *opaque, unsigned type, unsigned long long offset, unsigned count) {
+    struct sector_map *m = opaque;
+    struct sector_run *r = m->count ? m->runs + m->count - 1 : NULL;
+    enum sector_kind kind = record_kind[type & 7];
+    /* In a raw image, the header of a Mode 2 sector is the 16 literal bytes before it */
+    if ((kind == SECTOR_MODE2) && r && (r->kind == SECTOR_LITERAL) && (r->count >= 16) && (run_end(r) == offset)) {
+        r->count -= 16;
+        if (!r->count) m->count--;
+        map_add(m, SECTOR_MODE2_RAW, offset - 16, 1);
+        offset += 2336;
+        if (!--count) return;
+    }
+    map_add(m, kind, offset, count);
+}
+
+void sector_map_free(struct sector_map *m) {
+    free(m->runs);
+    memset(m, 0, sizeof(*m));
+}
+
+unsigned long long sector_map_size(const struct sector_map *m) {
+    return m->count ? run_end(m->runs + m->count - 1) : 0;
+}
+
+/***************************************************************************/
+
+int sector_map_save(const struct sector_map *m, FILE *f) {
+    unsigned i;
+    fprintf(f, "# ECM sector map: image offset, kind, count (bytes for LITERAL, sectors otherwise)\n");
+    for (i = 0; i < m->count; i++) {
+        const struct sector_run *r = m->runs + i;
+        fprintf(f, "%llu %s %llu\n", r->offset, kind_name[r->kind], r->count);
+    }
+    return !ferror(f);
+}
+
+int sector_map_load(struct sector_map *m, const char *name) {
+    char line[256];
+    int bad = 0;
+    FILE *f = fopen(name, "r");
+    memset(m, 0, sizeof(*m));
+    if (!f) {
+        perror(name);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long offset, count;
+        char word[16];
+        int kind;
+        if ((line[0] == '#') || !strcspn(line, "\r\n")) continue;
+        bad = (sscanf(line, "%llu %15s %llu", &offset, word, &count) != 3);
+        for (kind = 0; !bad && (kind < 4) && strcmp(word, kind_name[kind]); kind++);
+        /* In order and not overlapping, so that the literal runs are valid extents */
+        if (bad || (kind == 4) || !count || (count > ~0ULL / 2352) || (offset < sector_map_size(m))) {
+            bad = 1;
+            break;
+        }
+        map_add(m, (enum sector_kind) kind, offset, count);
+    }
+    if (ferror(f) || bad) {
+        fprintf(stderr, "%s: not a sector map\n", name);
+        fclose(f);
+        sector_map_free(m);
+        return 0;
+    }
+    fclose(f);
+    return 1;
+}
+
+unsigned sector_map_literal(const struct sector_map *m, struct ecm_extent **extents) {
+    unsigned i, n = 0;
+    *extents = malloc((m->count ? m->count : 1) * sizeof(**extents));
+    if (!*extents) abort();
+    for (i = 0; i < m->count; i++) {
+        if (m->runs[i].kind != SECTOR_LITERAL) continue;
+        (*extents)[n].offset = m->runs[i].offset;
+        (*extents)[n].length = m->runs[i].count;
+        n++;
+    }
+    return n;
+}
+
+/***************************************************************************/
+
+#define CUE_MAX_TRACKS 99
+/* The shortest a track can be, in bytes of 2352-byte sectors */
+#define CUE_MIN_TRACK (300ULL * 2352)
+
+struct cue_span {
+    enum sector_kind kind;
+    unsigned long long start;
+    unsigned long long end;
+};
+
+/* Returns the number of tracks, with the stretch added */
+static int span_add(struct cue_span *t, int n, enum sector_kind kind, unsigned long long start, unsigned long long end) {
+    if (n && ((t[n - 1].kind == kind) || (end - start < CUE_MIN_TRACK) || (n == CUE_MAX_TRACKS))) {
+        t[n - 1].end = end;
+        return n;
+    }
+    if ((n == 1) && (t[0].end - t[0].start < CUE_MIN_TRACK)) {
+        /* Too short to be the first track on its own */
+        t[0].kind = kind;
+        t[0].end = end;
+        return n;
+    }
+    t[n].kind = kind;
+    t[n].start = start;
+    t[n].end = end;
+    return n + 1;
+}
+
+int sector_map_cue(const struct sector_map *m, FILE *f, const char *imagename) {
+    struct cue_span track[CUE_MAX_TRACKS];
+    unsigned long long sector = 0;
+    const char *p;
+    int i, n = 0;
+    unsigned j;
+    for (j = 0; j < m->count; j++) {
+        const struct sector_run *r = m->runs + j;
+        n = span_add(track, n, r->kind, r->offset, run_end(r));
+    }
+    if (!n) n = span_add(track, n, SECTOR_MODE2_RAW, 0, 0);
+    /* The sheet sits next to the image */
+    for (p = imagename; *p; p++) if ((*p == '/') || (*p == '\\')) imagename = p + 1;
+    fprintf(f, "FILE \"%s\" BINARY\n", imagename);
+    for (i = 0; i < n; i++) {
+        fprintf(f, "  TRACK %02d %s\n", i + 1, cue_mode[track[i].kind]);
+        fprintf(f, "    INDEX 01 %02llu:%02llu:%02llu\n", sector / (75 * 60), sector / 75 % 60, sector % 75);
+        sector += (track[i].end - track[i].start) / cue_size[track[i].kind];
+    }
+    return !ferror(f);
+}
@@ -0,0 +1,35 @@
+/***************************************************************************/
+/*
+** Monotonic clock for the ECM statistics and benchmarks
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#include "stopwatch.h"
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+double stopwatch_now(void) {
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    return (double) c.QuadPart / (double) f.QuadPart;
+}
+
+#else
+
+#include <time.h>
+
+double stopwatch_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+#endif
@@ -0,0 +1,170 @@
+/***************************************************************************/
+/*
+** Minimal fork/join worker pool shared by the ECM tools.
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+/***************************************************************************/
+
+#include <stdlib.h>
+#include "threadpool.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+typedef HANDLE tp_thread;
+typedef CRITICAL_SECTION tp_mutex;
+typedef CONDITION_VARIABLE tp_cond;
+#define tp_mutex_init(m) InitializeCriticalSection(m)
+#define tp_mutex_destroy(m) DeleteCriticalSection(m)
+#define tp_lock(m) EnterCriticalSection(m)
+#define tp_unlock(m) LeaveCriticalSection(m)
+#define tp_cond_init(c) InitializeConditionVariable(c)
+#define tp_cond_destroy(c) ((void) 0)
+#define tp_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define tp_broadcast(c) WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+typedef pthread_t tp_thread;
+typedef pthread_mutex_t tp_mutex;
+typedef pthread_cond_t tp_cond;
+#define tp_mutex_init(m) pthread_mutex_init(m, NULL)
+#define tp_mutex_destroy(m) pthread_mutex_destroy(m)
+#define tp_lock(m) pthread_mutex_lock(m)
+#define tp_unlock(m) pthread_mutex_unlock(m)
+#define tp_cond_init(c) pthread_cond_init(c, NULL)
+#define tp_cond_destroy(c) pthread_cond_destroy(c)
+#define tp_wait(c, m) pthread_cond_wait(c, m)
+#define tp_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/***************************************************************************/
+
+struct threadpool {
+    unsigned nworkers;
+    tp_thread *workers;
+    tp_mutex lock;
+    tp_cond work;
+    tp_cond done;
+    /* Current job; guarded by lock */
+    unsigned generation;
+    threadpool_func func;
+    void *arg;
+    unsigned count;
+    unsigned next;
+    unsigned active;
+    int shutdown;
+};
+
+/*
+** Hand out indices of the current job until there are none left.
+** Called and returns with the lock held.
+*/
+static void threadpool_drain(struct threadpool *pool) {
+    while (pool->next < pool->count) {
+        unsigned index = pool->next++;
+        tp_unlock(&pool->lock);
+        pool->func(pool->arg, index);
+        tp_lock(&pool->lock);
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI threadpool_worker(LPVOID param) {
+#else
+static void *threadpool_worker(void *param) {
+#endif
+    struct threadpool *pool = param;
+    unsigned seen = 0;
+    tp_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen) tp_wait(&pool->work, &pool->lock);
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        threadpool_drain(pool);
+        if (!--pool->active) tp_broadcast(&pool->done);
+    }
+    tp_unlock(&pool->lock);
+    return 0;
+}
+
+/***************************************************************************/
+
+struct threadpool *threadpool_create(unsigned threads) {
+    struct threadpool *pool;
+    unsigned i;
+    if (threads < 1) threads = 1;
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+    pool->workers = calloc(threads, sizeof(*pool->workers));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    tp_mutex_init(&pool->lock);
+    tp_cond_init(&pool->work);
+    tp_cond_init(&pool->done);
+    /* The thread calling threadpool_run() counts as one of the workers */
+    for (i = 0; i + 1 < threads; i++) {
+#if defined(_WIN32)
+        pool->workers[i] = CreateThread(NULL, 0, threadpool_worker, pool, 0, NULL);
+        if (!pool->workers[i]) break;
+#else
+        if (pthread_create(&pool->workers[i], NULL, threadpool_worker, pool)) break;
+#endif
+        pool->nworkers++;
+    }
+    return pool;
+}
+
+void threadpool_destroy(struct threadpool *pool) {
+    unsigned i;
+    if (!pool) return;
+    tp_lock(&pool->lock);
+    pool->shutdown = 1;
+    tp_broadcast(&pool->work);
+    tp_unlock(&pool->lock);
+    for (i = 0; i < pool->nworkers; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(pool->workers[i], INFINITE);
+        CloseHandle(pool->workers[i]);
+#else
+        pthread_join(pool->workers[i], NULL);
+#endif
+    }
+    tp_cond_destroy(&pool->done);
+    tp_cond_destroy(&pool->work);
+    tp_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+unsigned threadpool_size(const struct threadpool *pool) {
+    return pool ? pool->nworkers + 1 : 1;
+}
+
+void threadpool_run(
+        struct threadpool *pool,
+        threadpool_func func,
+        void *arg,
+        unsigned count
+) {
+    unsigned i;
+    if (!pool || !pool->nworkers || count < 2) {
+        for (i = 0; i < count; i++) func(arg, i);
+        return;
+    }
+    tp_lock(&pool->lock);
+    pool->func = func;
+    pool->arg = arg;
+    pool->count = count;
+    pool->next = 0;
+    pool->active = pool->nworkers;
+    pool->generation++;
+    tp_broadcast(&pool->work);
+    threadpool_drain(pool);
+    while (pool->active) tp_wait(&pool->done, &pool->lock);
+    tp_unlock(&pool->lock);
+}
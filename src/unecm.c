@@ -32,8 +32,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "asyncio.h"
+#include "batch.h"
+#include "eccedc.h"
+#include "ecmformat.h"
+#include "image.h"
+#include "largefile.h"
+#include "mapfile.h"
+#include "sectormap.h"
+#include "stopwatch.h"
+#include "threadpool.h"
 #include "unecm.h"
 
+#if defined(WIN32) || defined(WIN64)
+#include <fcntl.h>
+#include <io.h>
+#define strcasecmp _stricmp
+#endif
+
 /***************************************************************************/
 
 void banner(void) {
@@ -45,362 +61,901 @@ void banner(void) {
 
 /***************************************************************************/
 
-/* Data types */
-#define ecc_uint8 unsigned char
-#define ecc_uint16 unsigned short
-#define ecc_uint32 unsigned
-
-/* LUTs used for computing ECC/EDC */
-static ecc_uint8 ecc_f_lut[256];
-static ecc_uint8 ecc_b_lut[256];
-static ecc_uint32 edc_lut[256];
-
-/* Init routine */
-static void eccedc_init(void) {
-    ecc_uint32 i, j, edc;
-    for (i = 0; i < 256; i++) {
-        j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
-        ecc_f_lut[i] = j;
-        ecc_b_lut[i ^ j] = i;
-        edc = i;
-        for (j = 0; j < 8; j++) edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
-        edc_lut[i] = edc;
+unsigned long long mycounter;
+unsigned long long mycounter_total;
+
+void resetcounter(unsigned long long total) {
+    mycounter = 0;
+    mycounter_total = total;
+}
+
+/* A total of 0 means the size isn't known, as when reading a pipe */
+void setcounter(unsigned long long n) {
+    if ((n >> 20) != (mycounter >> 20)) {
+        unsigned long long a = (n + 64) / 128;
+        unsigned long long d = (mycounter_total + 64) / 128;
+        if (!mycounter_total) {
+            fprintf(stderr, "Decoding (%lluM)\r", n >> 20);
+        } else {
+            if (!d) d = 1;
+            fprintf(stderr, "Decoding (%02u%%)\r", (unsigned) ((100 * a) / d));
+        }
     }
+    mycounter = n;
+}
+
+/*
+** Open a file, or standard input/output (switched to binary) for "-"
+*/
+static FILE *open_stream(const char *filename, const char *mode, FILE *std) {
+    if (strcmp(filename, "-")) return fopen(filename, mode);
+#if defined(WIN32) || defined(WIN64)
+    _setmode(_fileno(std), _O_BINARY);
+#endif
+    return std;
 }
 
+/*
+** Tell what went wrong; an EDC error has already been described.  Returns 1.
+*/
+static int report_status(int status) {
+    switch (status) {
+        case ECM_ERROR_EDC:
+            break;
+        case ECM_ERROR_HEADER:
+            fprintf(stderr, "Header not found!\n");
+            break;
+        case ECM_ERROR_TRUNCATED:
+            fprintf(stderr, "Unexpected EOF!\n");
+            break;
+        case ECM_ERROR_CORRUPT:
+            break;
+        default:
+            fprintf(stderr, "%s\n", ecm_status_string(status));
+            return 1;
+    }
+    fprintf(stderr, "Corrupt ECM file!\n");
+    return 1;
+}
+
+/*
+** Tell how decoding went, the same way for every I/O path
+*/
+static int report(struct ecm_decoder *dec, int status) {
+    struct ecm_decoder_stats stats;
+    ecm_decoder_stats(dec, &stats);
+    if ((status != ECM_DONE) && (status != ECM_ERROR_EDC)) return report_status(status);
+    fprintf(stderr, "Decoded %llu bytes -> %llu bytes\n", stats.in_bytes, stats.out_bytes);
+    if (status == ECM_DONE) {
+        fprintf(stderr, "Done; file is OK\n");
+        return 0;
+    }
+    fprintf(stderr, "EDC error (%08X, should be %08X)\n", stats.edc, stats.stored_edc);
+    return report_status(status);
+}
+
+/*
+** With block checksums, each block of the image is checked as soon as it
+** has been decoded.  Pulls of output stop at the end of each block, which is
+** a record boundary, so the decoder's EDC is then that of the image so far.
+** The block's own EDC follows from that and the EDC at its start, without
+** hashing anything again.
+*/
+struct blockcheck {
+    struct trailer blocks;
+    const char *name;         /* The ecmfile, for the messages */
+    unsigned next;            /* First block not checked yet */
+    unsigned edc;             /* EDC of the image up to it */
+    unsigned long long base;  /* Where in the image decoding began */
+    unsigned bad;
+};
+
+/* Trim a pull of space bytes so it stops at the end of the current block */
+static size_t block_room(const struct blockcheck *c, struct ecm_decoder *dec, size_t space) {
+    struct ecm_decoder_stats stats;
+    unsigned long long pos, end;
+    if (!c->blocks.edc || (c->next >= c->blocks.count)) return space;
+    ecm_decoder_stats(dec, &stats);
+    pos = c->base + stats.out_bytes;
+    end = c->blocks.image[c->next + 1];
+    return ((end > pos) && (end - pos < space)) ? (size_t) (end - pos) : space;
+}
+
+static void block_check(struct blockcheck *c, struct ecm_decoder *dec) {
+    struct ecm_decoder_stats stats;
+    unsigned long long pos;
+    if (!c->blocks.edc) return;
+    ecm_decoder_stats(dec, &stats);
+    pos = c->base + stats.out_bytes;
+    while ((c->next < c->blocks.count) && (c->blocks.image[c->next + 1] <= pos)) {
+        unsigned long long start = c->blocks.image[c->next];
+        unsigned long long end = c->blocks.image[c->next + 1];
+        unsigned edc = stats.edc ^ edc_combine(c->edc, 0, end - start);
+        if ((end != pos) || (edc != c->blocks.edc[c->next])) {
+            fprintf(stderr, "%s: EDC error in block %u (bytes %llu-%llu)\n", c->name, c->next, start, end - 1);
+            c->bad++;
+        }
+        c->edc = stats.edc;
+        c->next++;
+    }
+}
+
+/* The checks for decoding a single file, which --resume sets up */
+static struct blockcheck checks;
+static unsigned long long ecm_base;  /* ECM bytes skipped when resuming */
+
 /***************************************************************************/
 /*
-** Compute EDC for a block
+** Statistics for --stats-json, one JSON object per line: one each time the
+** decoder reports progress, then a last one with "done" set.  I/O time is
+** only what the tool spends in stdio; with --mmap, reading and writing the
+** mappings shows up as decoder time instead.
 */
-ecc_uint32 edc_partial_computeblock(
-        ecc_uint32 edc,
-        const ecc_uint8 *src,
-        ecc_uint16 size
-) {
-    while (size--) edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
-    return edc;
+
+static FILE *statsfile;
+static double stats_start;
+static double io_seconds;
+static unsigned long long stats_total;  /* ECM file size, or 0 if unknown */
+
+static void stats_line(const struct ecm_decoder_stats *s, const char *status) {
+    double elapsed = stopwatch_now() - stats_start;
+    double rate = (elapsed > 0) ? (double) s->in_bytes / elapsed : 0;
+    fprintf(statsfile, "{\"tool\":\"unecm\",\"done\":%s,", status ? "true" : "false");
+    if (status) fprintf(statsfile, "\"status\":\"%s\",", status);
+    fprintf(statsfile, "\"elapsed_seconds\":%.3f,", elapsed);
+    if (stats_total) {
+        fprintf(statsfile, "\"total_bytes\":%llu,", stats_total);
+    } else {
+        fprintf(statsfile, "\"total_bytes\":null,");
+    }
+    fprintf(statsfile,
+            "\"in_bytes\":%llu,\"out_bytes\":%llu,\"literal_bytes\":%llu,\"mode1_sectors\":%llu,"
+            "\"mode2_form1_sectors\":%llu,\"mode2_form2_sectors\":%llu,\"mb_per_second\":%.2f,",
+            s->in_bytes, s->out_bytes, s->count[0], s->count[1] + s->count[4] + s->count[5],
+            s->count[2] + s->count[6], s->count[3] + s->count[7],
+            (elapsed > 0) ? (double) s->out_bytes / elapsed / 1e6 : 0.0
+    );
+    if (stats_total && (rate > 0) && !status) {
+        fprintf(statsfile, "\"eta_seconds\":%.1f,", (double) (stats_total - s->in_bytes) / rate);
+    } else {
+        fprintf(statsfile, "\"eta_seconds\":%s,", status ? "0" : "null");
+    }
+    fprintf(statsfile, "\"decode_seconds\":%.3f,\"io_seconds\":%.3f}\n", s->decode_seconds, io_seconds);
+    fflush(statsfile);
+}
+
+static void progress(void *opaque, const struct ecm_decoder_stats *stats) {
+    (void) opaque;
+    setcounter(ecm_base + stats->in_bytes);
+    if (statsfile) stats_line(stats, NULL);
+}
+
+/*
+** Input is read and output written on background threads, so the disk and
+** the decoder both keep busy.  Output blocks are large enough that a
+** threaded decoder has plenty of sectors to work on in each pull.  The I/O
+** time in the statistics is the time spent waiting on them.
+*/
+#define IO_READ_BLOCK 0x100000
+#define IO_WRITE_BLOCK 0x400000
+#define IO_BUFFERS 4
+
+/*
+** Where decode_stream() sends the image: the writer ring, or nowhere for
+** --verify, with the block checks and the buffers it needs on the way.
+** Each call has its own, so several can run at once.
+*/
+struct output {
+    struct async_ring *ring;
+    struct blockcheck *check;
+    int batch;  /* No progress display or statistics to keep up */
+    unsigned char discard[IO_WRITE_BLOCK];
+    /* Unpacked ECM data on its way to the decoder */
+    unsigned char ecmbuf[0x400000];
+};
+
+/* Time spent waiting on I/O; only kept for --stats-json, which has one file */
+static void io_wait(double start) {
+    if (statsfile) io_seconds += stopwatch_now() - start;
+}
+
+static size_t timed_read(struct async_ring *in, const unsigned char **data) {
+    double start = stopwatch_now();
+    size_t n = async_read(in, data);
+    io_wait(start);
+    return n;
 }
 
-void edc_computeblock(
-        const ecc_uint8 *src,
-        ecc_uint16 size,
-        ecc_uint8 *dest
+/* Pull everything the decoder has straight into the output buffers */
+static void pull_out(struct ecm_decoder *dec, struct output *out) {
+    size_t space, m;
+    do {
+        unsigned char *buf = out->discard;
+        space = sizeof(out->discard);
+        if (out->ring) {
+            double start = stopwatch_now();
+            buf = async_buffer(out->ring, &space);
+            io_wait(start);
+        }
+        space = block_room(out->check, dec, space);
+        m = ecm_decoder_pull(dec, buf, space);
+        if (out->ring) async_commit(out->ring, m);
+        block_check(out->check, dec);
+    } while (m == space);
+}
+
+/*
+** Decode ECM data straight from the input block into the output buffers,
+** writing out what it decodes.  A unit cut off at the end of the block
+** waits in the decoder for the next one.
+*/
+static void decode_some(struct ecm_decoder *dec, struct output *out, const unsigned char *buf, size_t n) {
+    size_t used = 0;
+    while (!ecm_decoder_status(dec)) {
+        unsigned char *dst = out->discard;
+        size_t space = sizeof(out->discard);
+        size_t u, m;
+        if (out->ring) {
+            double start = stopwatch_now();
+            dst = async_buffer(out->ring, &space);
+            io_wait(start);
+        }
+        space = block_room(out->check, dec, space);
+        m = ecm_decoder_decode(dec, buf + used, n - used, &u, dst, space);
+        used += u;
+        if (out->ring) async_commit(out->ring, m);
+        block_check(out->check, dec);
+        if ((m < space) && ((used == n) || !u)) break;
+    }
+}
+
+static void decode_finish(struct ecm_decoder *dec, struct output *out) {
+    ecm_decoder_finish(dec);
+    pull_out(dec, out);
+}
+
+/* The same for a compressed container, through the unpacker first */
+static void unpack_some(
+        struct ecm_unpacker *up,
+        struct ecm_decoder *dec,
+        struct output *out,
+        const unsigned char *buf,
+        size_t n
 ) {
-    ecc_uint32 edc = edc_partial_computeblock(0, src, size);
-    dest[0] = (edc >> 0) & 0xFF;
-    dest[1] = (edc >> 8) & 0xFF;
-    dest[2] = (edc >> 16) & 0xFF;
-    dest[3] = (edc >> 24) & 0xFF;
+    size_t used = 0;
+    size_t m;
+    for (;;) {
+        used += ecm_unpacker_push(up, buf + used, n - used);
+        while ((m = ecm_unpacker_pull(up, out->ecmbuf, sizeof(out->ecmbuf)))) decode_some(dec, out, out->ecmbuf, m);
+        if ((ecm_unpacker_status(up) < 0) || ecm_decoder_status(dec) || (used == n)) return;
+    }
 }
 
-/***************************************************************************/
 /*
-** Compute ECC for a block (can do either P or Q)
+** Decode by pushing the ECM file through the decoder in blocks, unpacking
+** it first if it is a compressed container.  Never seeks, so in and out may
+** be pipes.  With out NULL, the image is only checked.  Returns the status
+** of the decoding, or 0 (with a message) if the output couldn't be written.
 */
-static void ecc_computeblock(
-        ecc_uint8 *src,
-        ecc_uint32 major_count,
-        ecc_uint32 minor_count,
-        ecc_uint32 major_mult,
-        ecc_uint32 minor_inc,
-        ecc_uint8 *dest
+static int decode_stream(
+        FILE *in,
+        FILE *out,
+        struct ecm_decoder *dec,
+        unsigned threads,
+        struct blockcheck *check,
+        int batch
 ) {
-    ecc_uint32 size = major_count * minor_count;
-    ecc_uint32 major, minor;
-    for (major = 0; major < major_count; major++) {
-        ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
-        ecc_uint8 ecc_a = 0;
-        ecc_uint8 ecc_b = 0;
-        for (minor = 0; minor < minor_count; minor++) {
-            ecc_uint8 temp = src[index];
-            index += minor_inc;
-            if (index >= size) index -= size;
-            ecc_a ^= temp;
-            ecc_b ^= temp;
-            ecc_a = ecc_f_lut[ecc_a];
+    struct async_ring *rin = async_reader_create(in, IO_READ_BLOCK, IO_BUFFERS);
+    struct output *o = malloc(sizeof(*o));
+    const unsigned char *inbuf = NULL;
+    struct ecm_unpacker *up = NULL;
+    struct ecm_pack_options packoptions;
+    size_t n;
+    int status = ECM_ERROR_MEMORY;
+    if (o) {
+        o->ring = out ? async_writer_create(out, IO_WRITE_BLOCK, IO_BUFFERS) : NULL;
+        o->check = check;
+        o->batch = batch;
+    }
+    if (!rin || !o || (out && !o->ring)) goto done;
+    n = timed_read(rin, &inbuf);
+    /* When resuming, the input starts at a record rather than the magic */
+    if (!check->base && (n >= 4) && !memcmp(inbuf, "ECMZ", 4)) {
+        memset(&packoptions, 0, sizeof(packoptions));
+        packoptions.threads = threads;
+        up = ecm_unpacker_create(&packoptions);
+        if (!up) goto done;
+        /* The progress counter can't be measured against the packed size */
+        if (!batch) {
+            resetcounter(0);
+            stats_total = 0;
+        }
+    }
+    while (n) {
+        if (up) {
+            unpack_some(up, dec, o, inbuf, n);
+            if (ecm_unpacker_status(up) < 0) break;
+        } else {
+            decode_some(dec, o, inbuf, n);
         }
-        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-        dest[major] = ecc_a;
-        dest[major + major_count] = ecc_a ^ ecc_b;
+        if (ecm_decoder_status(dec)) break;
+        n = timed_read(rin, &inbuf);
+    }
+    if (up && !ecm_decoder_status(dec)) {
+        ecm_unpacker_finish(up);
+        unpack_some(up, dec, o, inbuf, 0);
     }
+    decode_finish(dec, o);
+    status = ecm_decoder_status(dec);
+    if (up && (ecm_unpacker_status(up) < 0)) status = ecm_unpacker_status(up);
+done:
+    ecm_unpacker_destroy(up);
+    if (async_close(rin) && (status != ECM_ERROR_MEMORY)) fprintf(stderr, "Error reading the input\n");
+    if (o) {
+        if (async_close(o->ring) && (status != ECM_ERROR_MEMORY)) {
+            fprintf(stderr, "Error writing the output\n");
+            status = 0;
+        }
+        free(o);
+    }
+    return status;
+}
+
+int unecmify(
+        FILE *in,
+        FILE *out,
+        struct ecm_decoder *dec,
+        unsigned threads
+) {
+    int status = decode_stream(in, out, dec, threads, &checks, 0);
+    if (!status) return 1;
+    if (checks.bad) fprintf(stderr, "%u of %u blocks failed their check\n", checks.bad, checks.blocks.count);
+    return report(dec, status);
 }
 
+/***************************************************************************/
 /*
-** Generate ECC P and Q codes for a block
+** Decode only the sectors [lba, lba + count) of 2352 bytes each, or as much
+** of them as the image holds, starting from the nearest indexed record.  A
+** range that starts past the end of the image is an error.
 */
-static void ecc_generate(
-        ecc_uint8 *sector,
-        int zeroaddress
+int unecm_range(
+        FILE *in,
+        FILE *out,
+        unsigned long lba,
+        unsigned long count
 ) {
-    ecc_uint8 address[4], i;
-    /* Save the address and zero it out */
-    if (zeroaddress)
-        for (i = 0; i < 4; i++) {
-            address[i] = sector[12 + i];
-            sector[12 + i] = 0;
+    static unsigned char buf[0x10000];
+    unsigned long long pos = (unsigned long long) lba * 2352;
+    unsigned long long left = (unsigned long long) count * 2352;
+    long long written = 0;
+    struct image_cache *cache;
+    struct image *img;
+    unsigned char magic[4] = {0};
+    int status;
+    if ((fread(magic, 1, 4, in) == 4) && !memcmp(magic, "ECMZ", 4)) {
+        fprintf(stderr, "--range can't read a compressed ECM file\n");
+        return 1;
+    }
+    /* Only the block being copied out needs keeping */
+    cache = image_cache_create(0);
+    if (!cache) return report_status(ECM_ERROR_MEMORY);
+    img = image_open(in, cache, &status);
+    if (!img) {
+        image_cache_destroy(cache);
+        return report_status(status);
+    }
+    if (lba >= (image_size(img) + 2351) / 2352) {
+        fprintf(stderr, "Sector %lu is past the end of the image (%llu sectors)\n",
+                lba, (image_size(img) + 2351) / 2352);
+        image_close(img);
+        image_cache_destroy(cache);
+        return 1;
+    }
+    if (!image_indexed(img)) fprintf(stderr, "No seek index; scanning from the start\n");
+    while (left) {
+        size_t n = (left < sizeof(buf)) ? (size_t) left : sizeof(buf);
+        long long got = image_read(img, buf, n, pos);
+        if (got == ECM_ERROR_EDC) fprintf(stderr, "EDC error reading bytes %llu-%llu\n", pos, pos + n - 1);
+        if (got <= 0) {
+            status = (int) got;
+            break;
         }
-    /* Compute ECC P code */
-    ecc_computeblock(sector + 0xC, 86, 24, 2, 86, sector + 0x81C);
-    /* Compute ECC Q code */
-    ecc_computeblock(sector + 0xC, 52, 43, 86, 88, sector + 0x8C8);
-    /* Restore the address */
-    if (zeroaddress) for (i = 0; i < 4; i++) sector[12 + i] = address[i];
+        if (fwrite(buf, 1, (size_t) got, out) != (size_t) got) break;
+        written += got;
+        pos += (unsigned long long) got;
+        left -= (unsigned long long) got;
+    }
+    image_close(img);
+    image_cache_destroy(cache);
+    if (status < 0) return report_status(status);
+    if (fflush(out) || ferror(out)) {
+        fprintf(stderr, "Error writing the output\n");
+        return 1;
+    }
+    /* Cut short at the end of the image */
+    count = (unsigned long) ((written + 2351) / 2352);
+    fprintf(stderr, "Decoded sectors %lu-%lu (%lld bytes)\n", lba, lba + count - 1, written);
+    fprintf(stderr, "Done.\n");
+    return 0;
 }
 
 /***************************************************************************/
 /*
-** Generate ECC/EDC information for a sector (must be 2352 = 0x930 bytes)
-** Returns 0 on success
+** Pick up an interrupted decode where it stopped.  The blocks of the image
+** that out already holds are checked against their checksums, up to the
+** first one that is missing, short or damaged; out is then positioned at
+** that block, and in at its record, with the magic identifier read into
+** magic and the EDC of the image kept in options->edc.  Returns 0 to decode
+** from there, 1 if out is already complete, or -1 if it can't be resumed.
 */
-void eccedc_generate(ecc_uint8 *sector, int type) {
-    ecc_uint32 i;
-    switch (type) {
-        case 1: /* Mode 1 */
-            /* Compute EDC */
-            edc_computeblock(sector + 0x00, 0x810, sector + 0x810);
-            /* Write out zero bytes */
-            for (i = 0; i < 8; i++) sector[0x814 + i] = 0;
-            /* Generate ECC P/Q codes */
-            ecc_generate(sector, 0);
-            break;
-        case 2: /* Mode 2 form 1 */
-            /* Compute EDC */
-            edc_computeblock(sector + 0x10, 0x808, sector + 0x818);
-            /* Generate ECC P/Q codes */
-            ecc_generate(sector, 1);
-            break;
-        case 3: /* Mode 2 form 2 */
-            /* Compute EDC */
-            edc_computeblock(sector + 0x10, 0x91C, sector + 0x92C);
-            break;
+static int resume_open(FILE *in, FILE *out, unsigned char *magic, struct ecm_decoder_options *options) {
+    static unsigned char buf[0x10000];
+    long long size;
+    unsigned edc = 0;
+    unsigned i;
+    /* No decoder has been created yet to build the EDC tables */
+    eccedc_init();
+    if (file_seek(out, 0, SEEK_END) || ((size = file_tell(out)) < 0)) return -1;
+    if ((unsigned long long) size > checks.blocks.image[checks.blocks.count]) return -1;
+    if (file_seek(out, 0, SEEK_SET)) return -1;
+    for (i = 0; (i < checks.blocks.count) && (checks.blocks.image[i + 1] <= (unsigned long long) size); i++) {
+        unsigned long long length = checks.blocks.image[i + 1] - checks.blocks.image[i];
+        unsigned long long left = length;
+        unsigned b = 0;
+        while (left) {
+            size_t n = (left < sizeof(buf)) ? (size_t) left : sizeof(buf);
+            if (fread(buf, 1, n, out) != n) return -1;
+            b = edc_partial_computeblock(b, buf, n);
+            left -= n;
+        }
+        if (b != checks.blocks.edc[i]) break;
+        edc = edc_combine(edc, b, length);
+    }
+    if (i == checks.blocks.count) return 1;
+    if (file_seek(out, (long long) checks.blocks.image[i], SEEK_SET)) return -1;
+    if (file_seek(in, 0, SEEK_SET) || (fread(magic, 1, 4, in) != 4)) return -1;
+    if (file_seek(in, i ? (long long) checks.blocks.ecm[i] : 0, SEEK_SET)) return -1;
+    if (i) {
+        fprintf(stderr, "Resuming at byte %llu; the %u blocks before it are intact\n", checks.blocks.image[i], i);
+        checks.next = i;
+        checks.edc = edc;
+        checks.base = checks.blocks.image[i];
+        ecm_base = checks.blocks.ecm[i] - 4;
+        options->edc = edc;
     }
+    return 0;
 }
 
 /***************************************************************************/
+/*
+** --batch: decode, or with --verify check, every ECM file on a list.  The
+** files are shared out over the threads the same way as the encoder does
+** it, largest first, and each one's blocks are checked as it goes.
+*/
 
-unsigned mycounter;
-unsigned mycounter_total;
+struct batch {
+    struct batch_job *jobs;
+    struct ecm_decoder_options options;
+    int verify;
+};
 
-void resetcounter(unsigned total) {
-    mycounter = 0;
-    mycounter_total = total;
+static int batch_want(const char *name) {
+    size_t n = strlen(name);
+    return (name[0] != '.') && (n > 4) && !strcasecmp(name + n - 4, ".ecm");
 }
 
-void setcounter(unsigned n) {
-    if ((n >> 20) != (mycounter >> 20)) {
-        unsigned a = (n + 64) / 128;
-        unsigned d = (mycounter_total + 64) / 128;
-        if (!d) d = 1;
-        fprintf(stderr, "Decoding (%02d%%)\r", (100 * a) / d);
+static void batch_decode(void *arg, unsigned index) {
+    struct batch *b = arg;
+    struct batch_job *job = b->jobs + index;
+    struct blockcheck check;
+    struct ecm_decoder *dec;
+    char *outfilename = NULL;
+    FILE *fin, *fout = NULL;
+    int status = 0;
+    job->failed = 1;
+    memset(&check, 0, sizeof(check));
+    check.name = job->name;
+    fin = fopen(job->name, "rb");
+    if (!fin) {
+        perror(job->name);
+        return;
     }
-    mycounter = n;
+    trailer_load(fin, &check.blocks);
+    if (file_seek(fin, 0, SEEK_SET)) {
+        perror(job->name);
+    } else if (b->verify) {
+        status = 1;
+    } else if (strlen(job->name) <= 4) {
+        fprintf(stderr, "filename '%s' is too short\n", job->name);
+    } else {
+        outfilename = malloc(strlen(job->name) - 3);
+        if (!outfilename) abort();
+        memcpy(outfilename, job->name, strlen(job->name) - 4);
+        outfilename[strlen(job->name) - 4] = 0;
+        fout = fopen(outfilename, "wb");
+        if (!fout) {
+            perror(outfilename);
+        } else {
+            status = 1;
+        }
+    }
+    if (status) {
+        dec = ecm_decoder_create(&b->options);
+        status = dec ? decode_stream(fin, fout, dec, b->options.threads, &check, 1) : ECM_ERROR_MEMORY;
+        if (dec) {
+            struct ecm_decoder_stats stats;
+            ecm_decoder_stats(dec, &stats);
+            job->in_bytes = stats.in_bytes;
+            job->out_bytes = stats.out_bytes;
+            ecm_decoder_destroy(dec);
+        }
+        if (status == ECM_DONE) {
+            job->failed = 0;
+            fprintf(stderr, "%s: %llu bytes -> %llu bytes, OK\n", job->name, job->in_bytes, job->out_bytes);
+        } else if (status) {
+            fprintf(stderr, "%s: %s\n", job->name, ecm_status_string(status));
+        }
+    }
+    if (job->failed) fprintf(stderr, "%s: failed\n", job->name);
+    trailer_free(&check.blocks);
+    if (fout) fclose(fout);
+    fclose(fin);
+    free(outfilename);
 }
 
-int unecmify(
-        FILE *in,
-        FILE *out
-) {
-    unsigned checkedc = 0;
-    unsigned char sector[2352];
-    unsigned type;
-    unsigned num;
-    fseek(in, 0, SEEK_END);
-    resetcounter(ftell(in));
-    fseek(in, 0, SEEK_SET);
-    if (
-            (fgetc(in) != 'E') ||
-            (fgetc(in) != 'C') ||
-            (fgetc(in) != 'M') ||
-            (fgetc(in) != 0x00)
-            ) {
-        fprintf(stderr, "Header not found!\n");
-        goto corrupt;
+static int unecm_batch(const char *list, const struct ecm_decoder_options *options, int verify) {
+    struct batch b;
+    struct threadpool *pool;
+    unsigned long long in = 0, out = 0;
+    unsigned threads = options->threads ? options->threads : 1;
+    unsigned failed = 0;
+    double start = stopwatch_now();
+    double elapsed;
+    int i, n;
+    n = batch_list(list, batch_want, &b.jobs);
+    if (n < 0) return 1;
+    if (!n) {
+        fprintf(stderr, "No ECM files to decode\n");
+        return 0;
     }
-    for (;;) {
-        int c = fgetc(in);
-        int bits = 5;
-        if (c == EOF) goto uneof;
-        type = c & 3;
-        num = (c >> 2) & 0x1F;
-        while (c & 0x80) {
-            c = fgetc(in);
-            if (c == EOF) goto uneof;
-            num |= ((unsigned) (c & 0x7F)) << bits;
-            bits += 7;
-        }
-        if (num == 0xFFFFFFFF) break;
-        num++;
-        if (num >= 0x80000000) goto corrupt;
-        if (!type) {
-            while (num) {
-                int b = num;
-                if (b > 2352) b = 2352;
-                if (fread(sector, 1, b, in) != b) goto uneof;
-                checkedc = edc_partial_computeblock(checkedc, sector, b);
-                fwrite(sector, 1, b, out);
-                num -= b;
-                setcounter(ftell(in));
-            }
+    b.options = *options;
+    b.options.threads = ((unsigned) n < threads) ? threads / n : 1;
+    b.options.progress = NULL;
+    b.verify = verify;
+    pool = threadpool_create(((unsigned) n < threads) ? (unsigned) n : threads);
+    if (!pool) {
+        fprintf(stderr, "Out of memory\n");
+        batch_free(b.jobs, n);
+        return 1;
+    }
+    /* The tables have to be built before the workers start using them */
+    eccedc_init();
+    threadpool_run(pool, batch_decode, &b, (unsigned) n);
+    threadpool_destroy(pool);
+    elapsed = stopwatch_now() - start;
+    for (i = 0; i < n; i++) {
+        failed += b.jobs[i].failed;
+        in += b.jobs[i].in_bytes;
+        out += b.jobs[i].out_bytes;
+    }
+    fprintf(stderr, "%s %u of %d files, %llu bytes -> %llu bytes in %.1f seconds (%.2f MB/s)\n",
+            verify ? "Verified" : "Decoded", n - failed, n, in, out, elapsed,
+            (elapsed > 0) ? (double) out / elapsed / 1e6 : 0.0
+    );
+    batch_free(b.jobs, n);
+    return failed != 0;
+}
+
+/***************************************************************************/
+
+static void usage(const char *progname) {
+    fprintf(stderr, "usage: %s [--threads N] [--cue] [--mmap] [--range LBA:count] [--stats-json statsfile]\n", progname);
+    fprintf(stderr, "       [--resume] ecmfile [outputfile]\n");
+    fprintf(stderr, "       %s --verify [--threads N] [--stats-json statsfile] ecmfile\n", progname);
+    fprintf(stderr, "       %s --batch directory|- [--verify] [--threads N]\n", progname);
+    fprintf(stderr, "       ecmfile and outputfile may be - for standard input and output\n");
+}
+
+/*
+** Decode infilename to outfilename through memory mappings of both
+*/
+static int unecm_mapped(const char *infilename, const char *outfilename, struct ecm_decoder *dec) {
+    struct mapfile inmap, outmap;
+    unsigned long long outsize;
+    size_t outlen = 0;
+    int r;
+    if (mapfile_open_read(&inmap, infilename)) {
+        perror(infilename);
+        return 1;
+    }
+    if ((inmap.size >= 4) && !memcmp(inmap.data, "ECMZ", 4)) {
+        fprintf(stderr, "--mmap can't read a compressed ECM file\n");
+        mapfile_close(&inmap, 0);
+        return 1;
+    }
+    resetcounter(inmap.size);
+    stats_total = inmap.size;
+    /* Walk the records first to find out how large the output will be */
+    r = ecm_decoded_size(inmap.data, inmap.size, &outsize);
+    if (r == ECM_OK) {
+        if ((size_t) outsize != outsize) {
+            r = ECM_ERROR_MEMORY;
+        } else if (mapfile_create(&outmap, outfilename, (size_t) outsize)) {
+            perror(outfilename);
+            mapfile_close(&inmap, 0);
+            return 1;
         } else {
-            while (num--) {
-                memset(sector, 0, sizeof(sector));
-                memset(sector + 1, 0xFF, 10);
-                switch (type) {
-                    case 1:
-                        sector[0x0F] = 0x01;
-                        if (fread(sector + 0x00C, 1, 0x003, in) != 0x003) goto uneof;
-                        if (fread(sector + 0x010, 1, 0x800, in) != 0x800) goto uneof;
-                        eccedc_generate(sector, 1);
-                        checkedc = edc_partial_computeblock(checkedc, sector, 2352);
-                        fwrite(sector, 2352, 1, out);
-                        setcounter(ftell(in));
-                        break;
-                    case 2:
-                        sector[0x0F] = 0x02;
-                        if (fread(sector + 0x014, 1, 0x804, in) != 0x804) goto uneof;
-                        sector[0x10] = sector[0x14];
-                        sector[0x11] = sector[0x15];
-                        sector[0x12] = sector[0x16];
-                        sector[0x13] = sector[0x17];
-                        eccedc_generate(sector, 2);
-                        checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-                        fwrite(sector + 0x10, 2336, 1, out);
-                        setcounter(ftell(in));
-                        break;
-                    case 3:
-                        sector[0x0F] = 0x02;
-                        if (fread(sector + 0x014, 1, 0x918, in) != 0x918) goto uneof;
-                        sector[0x10] = sector[0x14];
-                        sector[0x11] = sector[0x15];
-                        sector[0x12] = sector[0x16];
-                        sector[0x13] = sector[0x17];
-                        eccedc_generate(sector, 3);
-                        checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-                        fwrite(sector + 0x10, 2336, 1, out);
-                        setcounter(ftell(in));
-                        break;
-                }
+            r = ecm_decoder_decode_buffer(dec, inmap.data, inmap.size, outmap.data, outmap.size, &outlen);
+            if (mapfile_close(&outmap, outlen)) {
+                perror(outfilename);
+                mapfile_close(&inmap, 0);
+                return 1;
             }
         }
     }
-    if (fread(sector, 1, 4, in) != 4) goto uneof;
-    fprintf(stderr, "Decoded %ld bytes -> %ld bytes\n", ftell(in), ftell(out));
-    if (
-            (sector[0] != ((checkedc >> 0) & 0xFF)) ||
-            (sector[1] != ((checkedc >> 8) & 0xFF)) ||
-            (sector[2] != ((checkedc >> 16) & 0xFF)) ||
-            (sector[3] != ((checkedc >> 24) & 0xFF))
-            ) {
-        fprintf(stderr, "EDC error (%08X, should be %02X%02X%02X%02X)\n",
-                checkedc,
-                sector[3],
-                sector[2],
-                sector[1],
-                sector[0]
-        );
-        goto corrupt;
-    }
-    fprintf(stderr, "Done; file is OK\n");
-    return 0;
-    uneof:
-    fprintf(stderr, "Unexpected EOF!\n");
-    corrupt:
-    fprintf(stderr, "Corrupt ECM file!\n");
-    return 1;
+    mapfile_close(&inmap, 0);
+    return report(dec, r);
 }
 
-/***************************************************************************/
-
 int main(int argc, char **argv) {
     FILE *fin, *fout;
     char *infilename;
-    char *outfilename;
-    char *cuefilename;
+    char *outfilename = NULL;
+    char *cuefilename = NULL;
+    struct sector_map map;
+    char *statsfilename = NULL;
+    char *batchlist = NULL;
     char createcue = 0;
+    int usemmap = 0;
+    int userange = 0;
+    int verify = 0;
+    int resume = 0;
+    unsigned char magic[4];
+    unsigned long rangelba = 0;
+    unsigned long rangecount = 0;
+    struct ecm_decoder_options options;
+    struct ecm_decoder *dec;
+    int argi = 1;
+    int r;
     banner();
-    /*
-    ** Initialize the ECC/EDC tables
-    */
-    eccedc_init();
+    memset(&options, 0, sizeof(options));
+    memset(&map, 0, sizeof(map));
+    options.progress = progress;
     /*
     ** Check command line
     */
-    if((argc != 2) && (argc != 3) && (argc != 4)) {
-      fprintf(stderr, "usage: %s [--cue] ecmfile [outputfile]\n", argv[0]);
-      return 1;
+    while ((argi < argc) && !strncmp(argv[argi], "--", 2)) {
+        if (!strcmp(argv[argi], "--threads") && (argi + 1 < argc)) {
+            int threads = atoi(argv[argi + 1]);
+            if (threads < 1) {
+                fprintf(stderr, "invalid thread count '%s'\n", argv[argi + 1]);
+                return 1;
+            }
+            options.threads = threads;
+            argi++;
+        } else if (!strcasecmp(argv[argi], "--cue")) {
+            createcue = 1;
+        } else if (!strcmp(argv[argi], "--mmap")) {
+            usemmap = 1;
+        } else if (!strcmp(argv[argi], "--range") && (argi + 1 < argc)) {
+            char *end;
+            argi++;
+            /* strtoul() would take "-1" as a huge number */
+            rangelba = strtoul(argv[argi], &end, 0);
+            if ((end != argv[argi]) && (*end == ':')) rangecount = strtoul(end + 1, &end, 0);
+            if (*end || !rangecount || strchr(argv[argi], '-') ||
+                (rangelba > 0xFFFFFFFFUL) || (rangecount > 0xFFFFFFFFUL)) {
+                fprintf(stderr, "invalid range '%s'\n", argv[argi]);
+                return 1;
+            }
+            userange = 1;
+        } else if (!strcmp(argv[argi], "--stats-json") && (argi + 1 < argc)) {
+            statsfilename = argv[++argi];
+        } else if (!strcmp(argv[argi], "--verify")) {
+            verify = 1;
+        } else if (!strcmp(argv[argi], "--resume")) {
+            resume = 1;
+        } else if (!strcmp(argv[argi], "--batch") && (argi + 1 < argc)) {
+            batchlist = argv[++argi];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        argi++;
     }
-    /*
-    ** Get cur generation status
-    */
-    if (!strcasecmp(argv[1], "--cue")) {
-      createcue = 1;
+    if (batchlist) {
+        if ((argc != argi) || createcue || usemmap || userange || resume || statsfilename) {
+            usage(argv[0]);
+            return 1;
+        }
+        return unecm_batch(batchlist, &options, verify);
+    }
+    if ((argc - argi != 1) && ((argc - argi != 2) || verify)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (verify && (createcue || usemmap || userange)) {
+        fprintf(stderr, "--verify can't be used with --cue, --mmap or --range\n");
+        return 1;
+    }
+    if (resume && (verify || usemmap || userange)) {
+        fprintf(stderr, "--resume can't be used with --verify, --mmap or --range\n");
+        return 1;
+    }
+    if (createcue && (userange || resume)) {
+        /* The sheet comes from the records, so they all have to be decoded */
+        fprintf(stderr, "--cue can't be used with --range or --resume\n");
+        return 1;
+    }
+    if (createcue) {
+        options.record = sector_map_record;
+        options.opaque = &map;
     }
     /*
     ** Verify that the input filename is valid
     */
-    infilename = argv[1 + createcue];
-    if (strlen(infilename) < 5) {
-      fprintf(stderr, "filename '%s' is too short\n", infilename);
-      return 1;
-    }
-    if (strcasecmp(infilename + strlen(infilename) - 4, ".ecm")) {
-      fprintf(stderr, "filename must end in .ecm\n");
-      return 1;
+    infilename = argv[argi];
+    if (!strcmp(infilename, "-")) {
+        /* Streaming from a pipe; the output goes to standard output too */
+        if (userange || usemmap || resume) {
+            fprintf(stderr, "--range, --mmap and --resume need an ecmfile, not standard input\n");
+            return 1;
+        }
+    } else if (strlen(infilename) < 5) {
+        fprintf(stderr, "filename '%s' is too short\n", infilename);
+        return 1;
+    } else if (strcasecmp(infilename + strlen(infilename) - 4, ".ecm")) {
+        fprintf(stderr, "filename must end in .ecm\n");
+        return 1;
     }
     /*
     ** Figure out what the output filename should be
     */
-    if (argc == 3 + createcue) {
-      outfilename = argv[2 + createcue];
+    if (verify) {
+        /* Nothing is written; the image is only checked */
+    } else if (argc - argi == 2) {
+        outfilename = argv[argi + 1];
+    } else if (!strcmp(infilename, "-")) {
+        outfilename = "-";
     } else {
-      outfilename = malloc(strlen(infilename) - 3);
-      if (!outfilename) abort();
-      memcpy(outfilename, infilename, strlen(infilename) - 4);
-      outfilename[strlen(infilename) - 4] = 0;
+        outfilename = malloc(strlen(infilename) - 3);
+        if (!outfilename) abort();
+        memcpy(outfilename, infilename, strlen(infilename) - 4);
+        outfilename[strlen(infilename) - 4] = 0;
     }
-    fprintf(stderr, "Decoding %s to %s.\n", infilename, outfilename);
-    /*
-    ** Open both files
-    */
-    fin = fopen(infilename, "rb");
-    if (!fin) {
-      perror(infilename);
-      return 1;
+    if (outfilename && !strcmp(outfilename, "-") && (createcue || usemmap || resume)) {
+        fprintf(stderr, "--cue, --mmap and --resume need an outputfile, not standard output\n");
+        return 1;
     }
-    fout = fopen(outfilename, "wb");
-    if (!fout) {
-      perror(outfilename);
-      fclose(fin);
-      return 1;
+    if (createcue) {
+        /* image.bin goes with image.cue */
+        size_t n = strlen(outfilename);
+        cuefilename = malloc(n + 5);
+        if (!cuefilename) abort();
+        strcpy(cuefilename, outfilename);
+        if ((n > 4) && (cuefilename[n - 4] == '.')) n -= 4;
+        strcpy(cuefilename + n, ".cue");
+        if (!strcmp(cuefilename, outfilename)) {
+            fprintf(stderr, "the CUE sheet for %s would overwrite it\n", outfilename);
+            return 1;
+        }
     }
-    /*
-    ** Decode
-    */
-    unecmify(fin, fout);
-    /*
-    ** Close everything
-    */
-    fclose(fout);
-    fclose(fin);
+    if (statsfilename && (userange || (outfilename && !strcmp(statsfilename, "-") && !strcmp(outfilename, "-")))) {
+        fprintf(stderr, "--stats-json can't be used with --range or share standard output with the image\n");
+        return 1;
+    }
+    if (statsfilename) {
+        statsfile = open_stream(statsfilename, "w", stdout);
+        if (!statsfile) {
+            perror(statsfilename);
+            return 1;
+        }
+    }
+    stats_start = stopwatch_now();
+    if (verify) {
+        fprintf(stderr, "Verifying %s.\n", infilename);
+    } else {
+        fprintf(stderr, "Decoding %s to %s.\n", infilename, outfilename);
+    }
+    fin = fout = NULL;
+    r = 0;
+    if (!usemmap || userange) {
+        /*
+        ** Open both files
+        */
+        fin = open_stream(infilename, "rb", stdin);
+        if (!fin) {
+            perror(infilename);
+            return 1;
+        }
+        /* Block checksums let each block be checked as soon as it is decoded */
+        if ((fin != stdin) && !userange) {
+            trailer_load(fin, &checks.blocks);
+            file_seek(fin, 0, SEEK_SET);
+        }
+        checks.name = infilename;
+        if (resume && !checks.blocks.edc) {
+            fprintf(stderr, "--resume needs an ecmfile with block checksums (see ecm --index)\n");
+            fclose(fin);
+            return 1;
+        }
+        /* Resuming keeps what is there; with no outputfile yet, it starts afresh */
+        if (resume) fout = fopen(outfilename, "r+b");
+        if (fout) {
+            r = resume_open(fin, fout, magic, &options);
+            if (r < 0) fprintf(stderr, "%s isn't part of this image; remove it to decode from the start\n", outfilename);
+            if (r > 0) fprintf(stderr, "%s is already complete\n", outfilename);
+        } else if (outfilename) {
+            fout = open_stream(outfilename, "wb", stdout);
+            if (!fout) {
+                perror(outfilename);
+                fclose(fin);
+                return 1;
+            }
+        }
+        if (r) {
+            fclose(fout);
+            fclose(fin);
+            trailer_free(&checks.blocks);
+            return (r < 0);
+        }
+    }
+    dec = ecm_decoder_create(&options);
+    if (!dec) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (usemmap && !userange) {
+        r = unecm_mapped(infilename, outfilename, dec);
+    } else {
+        /*
+        ** Decode
+        */
+        if (userange) {
+            r = unecm_range(fin, fout, rangelba, rangecount);
+        } else {
+            /* Only a file can be measured for the progress display */
+            resetcounter(0);
+            if ((fin != stdin) && !file_seek(fin, 0, SEEK_END) && (file_tell(fin) > 0)) {
+                stats_total = (unsigned long long) file_tell(fin);
+                resetcounter(stats_total);
+                file_seek(fin, (long long) (checks.base ? checks.blocks.ecm[checks.next] : 0), SEEK_SET);
+            }
+            /* What was read of the magic identifier comes first */
+            if (checks.base) ecm_decoder_push(dec, magic, 4);
+            r = unecmify(fin, fout, dec, options.threads);
+        }
+        /*
+        ** Close everything
+        */
+        if (fout && fclose(fout) && !r) {
+            fprintf(stderr, "Error writing the output\n");
+            r = 1;
+        }
+        fclose(fin);
+    }
+    trailer_free(&checks.blocks);
+    if (statsfile) {
+        struct ecm_decoder_stats stats;
+        int status = ecm_decoder_status(dec);
+        ecm_decoder_stats(dec, &stats);
+        stats_line(&stats, !r ? ecm_status_string(ECM_DONE) : (status < 0) ? ecm_status_string(status) : "Failed");
+        if (statsfile != stdout) fclose(statsfile);
+    }
+    ecm_decoder_destroy(dec);
     /*
     ** Write cue file
     */
-    if (createcue) {
-      cuefilename = malloc(strlen(outfilename));
-      if(!cuefilename) abort();
-      memcpy(cuefilename, outfilename, strlen(outfilename));
-      memcpy(cuefilename + strlen(outfilename) - 3, "cue", 3);
-      fout = fopen(cuefilename, "wt");
-      if(!fout) {
-        perror(cuefilename);
-        fclose(fout);
-        return 1;
-      }
-      fwrite("FILE \"", 1, 6, fout);
-      fwrite(outfilename, 1, strlen(outfilename), fout);
-      fwrite("\" BINARY\n  TRACK 01 MODE2/2352\n    INDEX 01 00:00:00\n", 1, 53, fout);
-      fclose(fout);
+    if (createcue && !r) {
+        fout = fopen(cuefilename, "wt");
+        if (!fout || !sector_map_cue(&map, fout, outfilename)) {
+            perror(cuefilename);
+            r = 1;
+        }
+        if (fout) fclose(fout);
     }
-    return 0;
-  }
-  
\ No newline at end of file
+    free(cuefilename);
+    sector_map_free(&map);
+    return r;
+}